@@ -0,0 +1,182 @@
+// Builds the BVHs of a scene file the way the path tracer does (one Tri_Mesh
+// per mesh, instanced by a scene BVH of transformed objects) in each layout,
+// and times closest-hit and shadow rays through them.
+//
+//     bench_bvh <scene file> [rays = 200000] [build threads = all cores]
+//
+// Camera rays start outside the scene and aim at random points inside it.
+// Bounce rays leave each camera hit in a random direction above the surface,
+// and shadow rays go from each hit towards a point above the scene. Rays are
+// traced on one thread, so the rates are per thread.
+
+#include "../src/rays/object.h"
+#include "../src/util/thread_pool.h"
+
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace PT;
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static Mat4 ai_mat(const aiMatrix4x4 &T) {
+    return Mat4{Vec4{T[0][0], T[1][0], T[2][0], T[3][0]}, Vec4{T[0][1], T[1][1], T[2][1], T[3][1]},
+                Vec4{T[0][2], T[1][2], T[2][2], T[3][2]}, Vec4{T[0][3], T[1][3], T[2][3], T[3][3]}};
+}
+
+struct Instance {
+    unsigned int mesh;
+    Mat4 transform;
+};
+
+static void find_instances(const aiNode *node, aiMatrix4x4 transform,
+                           std::vector<Instance> &instances) {
+    transform = transform * node->mTransformation;
+    for (unsigned int i = 0; i < node->mNumMeshes; i++) {
+        instances.push_back({node->mMeshes[i], ai_mat(transform)});
+    }
+    for (unsigned int i = 0; i < node->mNumChildren; i++) {
+        find_instances(node->mChildren[i], transform, instances);
+    }
+}
+
+static GL::Mesh to_mesh(const aiMesh *mesh) {
+    std::vector<GL::Mesh::Vert> verts;
+    std::vector<GL::Mesh::Index> indices;
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
+        const aiVector3D &p = mesh->mVertices[i];
+        Vec3 n = mesh->mNormals ? Vec3(mesh->mNormals[i].x, mesh->mNormals[i].y,
+                                       mesh->mNormals[i].z)
+                                : Vec3(0.0f, 1.0f, 0.0f);
+        verts.push_back({Vec3(p.x, p.y, p.z), n, 0});
+    }
+    for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+        const aiFace &face = mesh->mFaces[i];
+        if (face.mNumIndices != 3) continue;
+        indices.insert(indices.end(), {face.mIndices[0], face.mIndices[1], face.mIndices[2]});
+    }
+    return GL::Mesh(std::move(verts), std::move(indices));
+}
+
+// Rays are drawn from a fixed seed, so every layout (and every build of this
+// benchmark) traces the same ones
+static std::mt19937 rng;
+static float unit() { return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng); }
+static Vec3 random_dir() { return Vec3(unit() - 0.5f, unit() - 0.5f, unit() - 0.5f).unit(); }
+static Vec3 random_in(const BBox &box) {
+    return box.min + (box.max - box.min) * Vec3(unit(), unit(), unit());
+}
+
+static const char *layout_names[(int)BVH_Layout::count] = {"binary", "wide"};
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::printf("usage: %s <scene file> [rays] [build threads]\n", argv[0]);
+        return 1;
+    }
+    size_t n_rays = argc > 2 ? std::stoul(argv[2]) : 200000;
+    size_t threads = argc > 3 ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+
+    Assimp::Importer importer;
+    const aiScene *ai_scene = importer.ReadFile(
+        argv[1], aiProcess_Triangulate | aiProcess_JoinIdenticalVertices |
+                     aiProcess_GenSmoothNormals | aiProcess_FindDegenerates);
+    if (!ai_scene) {
+        std::printf("Failed to load %s: %s\n", argv[1], importer.GetErrorString());
+        return 1;
+    }
+    std::vector<GL::Mesh> meshes;
+    for (unsigned int i = 0; i < ai_scene->mNumMeshes; i++) {
+        meshes.push_back(to_mesh(ai_scene->mMeshes[i]));
+    }
+    std::vector<Instance> instances;
+    find_instances(ai_scene->mRootNode, aiMatrix4x4(), instances);
+
+    size_t triangles = 0;
+    for (const Instance &inst : instances) triangles += meshes[inst.mesh].indices().size() / 3;
+    std::printf("%s: %zu meshes, %zu instances, %zu triangles\n", argv[1], meshes.size(),
+                instances.size(), triangles);
+
+    Thread_Pool pool(threads);
+    for (int l = 0; l < (int)BVH_Layout::count; l++) {
+        BVH_Layout layout = (BVH_Layout)l;
+
+        Clock::time_point start = Clock::now();
+        std::vector<std::shared_ptr<Tri_Mesh>> tri_meshes;
+        for (const GL::Mesh &mesh : meshes) {
+            tri_meshes.push_back(std::make_shared<Tri_Mesh>());
+            tri_meshes.back()->build(mesh, layout, &pool);
+        }
+        double mesh_build = seconds_since(start);
+
+        start = Clock::now();
+        std::vector<Object> objects;
+        for (size_t i = 0; i < instances.size(); i++) {
+            objects.push_back(Object(tri_meshes[instances[i].mesh], (Scene_ID)i, 0,
+                                     instances[i].transform));
+        }
+        BVH<Object> scene;
+        scene.build(std::move(objects), 1, layout, &pool);
+        double scene_build = seconds_since(start);
+
+        rng.seed(7);
+        BBox bounds = scene.bbox();
+        Vec3 center = bounds.center(), extent = bounds.max - bounds.min;
+        float radius = extent.norm();
+        std::vector<Ray> camera_rays;
+        for (size_t i = 0; i < n_rays; i++) {
+            Vec3 from = center + random_dir() * radius;
+            camera_rays.push_back(Ray(from, random_in(bounds) - from));
+        }
+
+        start = Clock::now();
+        std::vector<Trace> hits;
+        for (const Ray &ray : camera_rays) {
+            Trace hit = scene.hit(ray);
+            if (hit.hit) hits.push_back(hit);
+        }
+        double camera_time = seconds_since(start);
+
+        Vec3 light = center + Vec3(0.0f, extent.y, 0.0f);
+        std::vector<Ray> bounce_rays, shadow_rays;
+        for (const Trace &hit : hits) {
+            Vec3 n = hit.normal.unit();
+            Vec3 d = random_dir();
+            if (dot(d, n) < 0.0f) d = -d;
+            Vec3 from = hit.position + n * (radius * 1e-5f);
+            bounce_rays.push_back(Ray(from, d));
+            Ray shadow(from, light - from);
+            shadow.time_bounds.y = (light - from).norm();
+            shadow_rays.push_back(shadow);
+        }
+
+        start = Clock::now();
+        size_t bounce_hits = 0;
+        for (const Ray &ray : bounce_rays) bounce_hits += scene.hit(ray).hit;
+        double bounce_time = seconds_since(start);
+
+        start = Clock::now();
+        size_t blocked = 0;
+        for (const Ray &ray : shadow_rays) blocked += scene.occluded(ray);
+        double shadow_time = seconds_since(start);
+
+        std::printf("%-6s build %.3f s (+%.4f s scene)  camera %.2fM/s  bounce %.2fM/s  "
+                    "shadow %.2fM/s  [hits %zu, %zu, blocked %zu]\n",
+                    layout_names[l], mesh_build, scene_build,
+                    camera_rays.size() / camera_time / 1e6,
+                    bounce_rays.size() / bounce_time / 1e6,
+                    shadow_rays.size() / shadow_time / 1e6, hits.size(), bounce_hits, blocked);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Times building and sampling an environment map's importance sampler, on a
+// procedural sky with a small, very bright sun.
+//
+//     bench_env_map [width = 2048] [samples = 20000000] [build threads = all cores]
+//
+// The map is width x width/2. Sampling goes through Env_Map::sample, so it
+// includes the radiance lookup as well as picking the direction. The mean of
+// radiance / pdf estimates the sky's total (red) radiance, which is printed
+// so that changes to the sampler can be checked for bias.
+
+#include "../src/rays/env_light.h"
+#include "../src/util/thread_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+using namespace PT;
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static HDR_Image sky(size_t w, size_t h) {
+    HDR_Image image(w, h);
+    for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+            float u = (x + 0.5f) / w, v = (y + 0.5f) / h;
+            float du = u - 0.3f, dv = v - 0.25f;
+            float sun = du * du + dv * dv < 0.0001f ? 5000.0f : 0.0f;
+            image.at(x, y) = Spectrum(0.2f + v + sun, 0.3f + v + sun, 0.8f + sun);
+        }
+    }
+    return image;
+}
+
+int main(int argc, char **argv) {
+    size_t w = argc > 1 ? std::stoul(argv[1]) : 2048;
+    size_t n_samples = argc > 2 ? std::stoul(argv[2]) : 20000000;
+    size_t threads = argc > 3 ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+    size_t h = w / 2;
+
+    Thread_Pool pool(threads);
+    HDR_Image image = sky(w, h);
+
+    Clock::time_point start = Clock::now();
+    Env_Map map(std::move(image), &pool);
+    double build = seconds_since(start);
+
+    start = Clock::now();
+    double sum = 0.0;
+    for (size_t i = 0; i < n_samples; i++) {
+        Light_Sample s = map.sample();
+        sum += s.radiance.r / s.pdf;
+    }
+    double sampling = seconds_since(start);
+
+    std::printf("%zux%zu  build %.1f ms on %zu threads  sample %.1f ns (%.2fM/s)  estimate %.3f\n",
+                w, h, build * 1e3, threads, sampling / n_samples * 1e9,
+                n_samples / sampling / 1e6, sum / n_samples);
+    return 0;
+}
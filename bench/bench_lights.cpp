@@ -0,0 +1,187 @@
+// Compares the light selection modes on a street of many lights: summing
+// every light, picking one by power, and picking one with the light tree.
+//
+//     bench_lights [lamps along x = 40] [lamps along z = 25]
+//
+// The scene is a grid of spot lights pointing down at a ground plane, one
+// rect light for every ten of them, and a few dim point lights, with boxes
+// standing on the ground to cast shadows. Each mode estimates the direct
+// light at the same ground points, tracing a shadow ray for each light it
+// samples, and is scored against a reference computed with many samples per
+// area light. Every mode is then given the time "all" takes for one sample
+// per point, and takes as many samples as fit in it.
+
+#include "../src/rays/light_tree.h"
+#include "../src/rays/samplers.h"
+#include "../src/rays/tri_mesh.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace PT;
+using Clock = std::chrono::steady_clock;
+
+static double us_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Irradiance luma from one light at p, averaged over samples
+static float contribution(const Light &light, const Tri_Mesh &blockers, Vec3 p, Vec3 n,
+                          int samples) {
+    float sum = 0.0f;
+    for (int i = 0; i < samples; i++) {
+        Light_Sample s = light.sample(p);
+        float cos = dot(s.direction, n);
+        if (cos <= 0.0f) continue;
+        Ray shadow(p, s.direction);
+        shadow.time_bounds = Vec2(EPS_F, s.distance - EPS_F);
+        if (blockers.occluded(shadow)) continue;
+        sum += cos / s.pdf * s.radiance.luma();
+    }
+    return sum / samples;
+}
+
+// The scene layout comes from a fixed seed, so every run is of the same scene
+static std::mt19937 rng(7);
+static float unit() { return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng); }
+
+static void add_box(BBox box, std::vector<GL::Mesh::Vert> &verts,
+                    std::vector<GL::Mesh::Index> &indices) {
+    GL::Mesh::Index base = (GL::Mesh::Index)verts.size();
+    for (int i = 0; i < 8; i++) {
+        Vec3 corner(i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y,
+                    i & 4 ? box.max.z : box.min.z);
+        verts.push_back({corner, Vec3(0.0f, 1.0f, 0.0f), 0});
+    }
+    const GL::Mesh::Index faces[6][4] = {{0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1},
+                                         {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}};
+    for (const auto &f : faces) {
+        indices.insert(indices.end(), {base + f[0], base + f[1], base + f[2], base + f[0],
+                                       base + f[2], base + f[3]});
+    }
+}
+
+int main(int argc, char **argv) {
+    int nx = argc > 1 ? std::stoi(argv[1]) : 40;
+    int nz = argc > 2 ? std::stoi(argv[2]) : 25;
+    float size_x = nx * 10.0f, size_z = nz * 10.0f;
+
+    std::vector<Light> lights;
+    Mat4 down = Mat4::euler(Vec3(180.0f, 0.0f, 0.0f));
+    for (int i = 0; i < nx; i++) {
+        for (int j = 0; j < nz; j++) {
+            Spectrum r = Spectrum(1.0f, 0.9f, 0.7f) * (1.0f + unit());
+            lights.push_back(Light(Spot_Light(r, Vec2(50.0f, 70.0f)), 0,
+                                   Mat4::translate(Vec3(i * 10.0f, 5.0f, j * 10.0f)) * down));
+        }
+    }
+    for (int i = 0; i < nx * nz / 10; i++) {
+        Vec3 at(unit() * size_x, 4.0f, unit() * size_z);
+        lights.push_back(
+            Light(Rect_Light(Spectrum(2.0f), Vec2(2.0f, 1.0f)), 0, Mat4::translate(at)));
+    }
+    for (int i = 0; i < 4; i++) {
+        Vec3 at(unit() * size_x, 20.0f, unit() * size_z);
+        lights.push_back(Light(Point_Light(Spectrum(0.01f)), 0, Mat4::translate(at)));
+    }
+
+    // Boxes the size of parked cars, about one per lamp
+    std::vector<BBox> boxes;
+    std::vector<GL::Mesh::Vert> verts;
+    std::vector<GL::Mesh::Index> indices;
+    for (int i = 0; i < nx * nz; i++) {
+        Vec3 at(unit() * size_x, 0.0f, unit() * size_z);
+        Vec3 size(1.0f + 3.0f * unit(), 0.5f + 1.5f * unit(), 1.0f + 3.0f * unit());
+        boxes.push_back(BBox(at - Vec3(size.x, 0.0f, size.z) / 2.0f,
+                             at + Vec3(size.x / 2.0f, size.y, size.z / 2.0f)));
+        add_box(boxes.back(), verts, indices);
+    }
+    Tri_Mesh blockers(GL::Mesh(std::move(verts), std::move(indices)));
+    std::printf("%zu lights, %zu boxes\n", lights.size(), boxes.size());
+
+    std::vector<float> power;
+    for (const Light &light : lights) power.push_back(light.power(size_x));
+    Samplers::Alias alias(power);
+
+    Clock::time_point start = Clock::now();
+    Light_Tree tree(lights);
+    std::printf("tree build %.3f ms\n", us_since(start) / 1e3);
+
+    // Points on the ground outside of the boxes
+    const int n_points = 1000;
+    Vec3 n(0.0f, 1.0f, 0.0f);
+    std::vector<Vec3> points;
+    std::vector<float> reference;
+    while (points.size() < n_points) {
+        Vec3 p(unit() * size_x, 0.0f, unit() * size_z);
+        bool inside = false;
+        for (const BBox &box : boxes) {
+            inside = inside || (p.x >= box.min.x && p.x <= box.max.x && p.z >= box.min.z &&
+                                p.z <= box.max.z);
+        }
+        if (inside) continue;
+        points.push_back(p);
+        float sum = 0.0f;
+        for (const Light &light : lights) {
+            sum += contribution(light, blockers, p, n, light.is_discrete() ? 1 : 256);
+        }
+        reference.push_back(sum);
+    }
+
+    // Takes samples estimates per point, and returns the time per point. The
+    // error of single estimates and of their average are both kept.
+    auto run = [&](int samples, double &rmse, double &mean_rmse, auto &&estimate) {
+        double error = 0.0, mean_error = 0.0, total = 0.0;
+        start = Clock::now();
+        for (int i = 0; i < n_points; i++) {
+            float mean = 0.0f;
+            for (int s = 0; s < samples; s++) {
+                float e = estimate(points[i]);
+                error += (e - reference[i]) * (e - reference[i]);
+                mean += e;
+            }
+            mean /= samples;
+            mean_error += (mean - reference[i]) * (mean - reference[i]);
+            total += reference[i] * reference[i];
+        }
+        rmse = std::sqrt(error / (total * samples));
+        mean_rmse = std::sqrt(mean_error / total);
+        return us_since(start) / n_points;
+    };
+
+    double budget = 0.0;
+    auto report = [&](const char *name, auto &&estimate) {
+        // Timed over enough samples to be steady, then given the budget
+        double rmse, equal_rmse, unused;
+        int calibration = budget > 0.0 ? 50 : 1;
+        double us = run(calibration, rmse, unused, estimate) / calibration;
+        if (budget == 0.0) budget = us;
+        int samples = std::max((int)(budget / us), 1);
+        double equal_us = run(samples, unused, equal_rmse, estimate);
+        std::printf("%-6s %8.3f us/sample  rel. RMSE %7.4f  1/(MSE * time) %8.3g  "
+                    "in %.0f us: %5d samples, rel. RMSE %7.4f\n",
+                    name, us, rmse, 1.0 / (rmse * rmse * us), equal_us, samples, equal_rmse);
+    };
+
+    report("all", [&](Vec3 p) {
+        float sum = 0.0f;
+        for (const Light &light : lights) sum += contribution(light, blockers, p, n, 1);
+        return sum;
+    });
+    report("power", [&](Vec3 p) {
+        float pmf;
+        size_t l = alias.sample(pmf);
+        return contribution(lights[l], blockers, p, n, 1) / pmf;
+    });
+    report("tree", [&](Vec3 p) {
+        float pmf;
+        size_t l;
+        if (!tree.sample(p, n, l, pmf)) return 0.0f;
+        return contribution(lights[l], blockers, p, n, 1) / pmf;
+    });
+    return 0;
+}
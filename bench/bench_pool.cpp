@@ -0,0 +1,85 @@
+// Times the overhead of Thread_Pool's ways of running work: tasks with and
+// without futures, tasks queued from inside a worker, a Task_Group, and
+// parallel_for over a large array.
+//
+//     bench_pool [threads = all cores] [tasks = 200000]
+//
+// The tasks themselves do almost nothing, so the times are the cost of
+// queueing, stealing and waiting.
+
+#include "../src/util/thread_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static void report(const char *name, size_t tasks, double ms) {
+    std::printf("%-28s %8.1f ms  %6.1f ns/task\n", name, ms, ms * 1e6 / tasks);
+}
+
+int main(int argc, char **argv) {
+    size_t threads = argc > 1 ? std::stoul(argv[1]) : std::thread::hardware_concurrency();
+    size_t n_tasks = argc > 2 ? std::stoul(argv[2]) : 200000;
+    std::printf("%zu threads, %zu tasks\n", threads, n_tasks);
+
+    std::atomic<size_t> sum = 0;
+    {
+        Thread_Pool pool(threads);
+        Clock::time_point start = Clock::now();
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < n_tasks; i++) {
+            futures.push_back(pool.enqueue([&sum, i]() { sum += i; }));
+        }
+        for (std::future<void> &f : futures) f.get();
+        report("enqueue + future", n_tasks, ms_since(start));
+    }
+    {
+        Thread_Pool pool(threads);
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < n_tasks; i++) pool.run([&sum, i]() { sum += i; });
+        pool.wait();
+        report("run + wait", n_tasks, ms_since(start));
+    }
+    {
+        Thread_Pool pool(threads);
+        Clock::time_point start = Clock::now();
+        pool.run([&]() {
+            for (size_t i = 0; i < n_tasks; i++) pool.run([&sum, i]() { sum += i; });
+        });
+        pool.wait();
+        report("run from a worker + wait", n_tasks, ms_since(start));
+    }
+    {
+        Thread_Pool pool(threads);
+        Task_Group group(pool);
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < n_tasks; i++) group.run([&sum, i]() { sum += i; });
+        group.wait();
+        report("Task_Group run + wait", n_tasks, ms_since(start));
+    }
+    {
+        // 16M floats in chunks of 16K, ten times over
+        Thread_Pool pool(threads);
+        std::vector<float> data(size_t(1) << 24, 1.0f);
+        size_t grain = size_t(1) << 14;
+        Clock::time_point start = Clock::now();
+        for (int r = 0; r < 10; r++) {
+            pool.parallel_for(0, data.size(), grain, [&](size_t b, size_t e) {
+                for (size_t i = b; i < e; i++) data[i] = data[i] * 1.0001f + 0.5f;
+            });
+        }
+        report("parallel_for 10x16M", 10 * data.size() / grain, ms_since(start));
+        sum += (size_t)data[0];
+    }
+
+    // Keeps the tasks from being optimized out
+    std::printf("(%zu)\n", sum.load());
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Times the random number generator and checks that renders built on it are
+// reproducible.
+//
+//     bench_rng [draws = 100000000]
+//
+// Draws are timed outside of a pixel sample, inside one for each sequence,
+// and with a fresh begin_sample per draw. std::mt19937 with a uniform float
+// distribution is timed too, for reference. Then a fake render, whose paths
+// draw a data-dependent number of numbers like Russian roulette does, is run
+// with each sequence on 1, 4 and 7 threads, and the images are compared.
+
+#include "../src/util/rand.h"
+#include "../src/util/thread_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static float path() {
+    float sum = 0.0f, throughput = 1.0f;
+    for (int bounce = 0; bounce < 8; bounce++) {
+        sum += throughput * RNG::unit() * RNG::unit();
+        if (RNG::unit() > 0.7f) break;
+        throughput *= RNG::unit();
+    }
+    return sum;
+}
+
+static std::vector<float> render(RNG::Sequence sequence, size_t threads) {
+    const size_t w = 128, h = 128, samples = 16, tile = 8;
+    std::vector<float> image(w * h);
+    Thread_Pool pool(threads);
+    Task_Group group(pool);
+    for (size_t y0 = 0; y0 < h; y0 += tile) {
+        group.run([&, y0]() {
+            for (size_t y = y0; y < y0 + tile; y++) {
+                for (size_t x = 0; x < w; x++) {
+                    float sum = 0.0f;
+                    for (size_t s = 0; s < samples; s++) {
+                        RNG::begin_sample(sequence, 3, (uint32_t)x, (uint32_t)y, (uint32_t)s);
+                        sum += path();
+                        RNG::end_sample();
+                    }
+                    image[y * w + x] = sum / samples;
+                }
+            }
+        });
+    }
+    group.wait();
+    return image;
+}
+
+int main(int argc, char **argv) {
+    size_t n_draws = argc > 1 ? std::stoul(argv[1]) : 100000000;
+
+    // Summed and printed so the draws aren't optimized out
+    double sum = 0.0;
+    auto report = [&](const char *name, size_t draws, double seconds) {
+        std::printf("%-38s %6.2f ns/draw\n", name, seconds / draws * 1e9);
+    };
+
+    std::mt19937 mt;
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < n_draws; i++) sum += dist(mt);
+    report("std::mt19937 (reference)", n_draws, seconds_since(start));
+
+    RNG::seed();
+    start = Clock::now();
+    for (size_t i = 0; i < n_draws; i++) sum += RNG::unit();
+    report("unit(), outside a sample", n_draws, seconds_since(start));
+
+    for (int s = 0; s < (int)RNG::Sequence::count; s++) {
+        // Each sample takes about a path's worth of draws
+        const size_t dims = 32;
+        start = Clock::now();
+        for (size_t i = 0; i < n_draws / dims; i++) {
+            RNG::begin_sample((RNG::Sequence)s, 0, (uint32_t)(i & 1023), (uint32_t)(i >> 10), 0);
+            for (size_t d = 0; d < dims; d++) sum += RNG::unit();
+            RNG::end_sample();
+        }
+        std::string name = std::string("unit(), in a ") + RNG::Sequence_Names[s] + " sample";
+        report(name.c_str(), n_draws / dims * dims, seconds_since(start));
+    }
+
+    size_t n_samples = n_draws / 10;
+    start = Clock::now();
+    for (size_t i = 0; i < n_samples; i++) {
+        RNG::begin_sample(RNG::Sequence::random, 0, (uint32_t)(i & 1023), (uint32_t)(i >> 10),
+                          (uint32_t)i);
+        sum += RNG::unit();
+        RNG::end_sample();
+    }
+    report("begin_sample + one draw (random)", n_samples, seconds_since(start));
+    std::printf("(%f)\n", sum);
+
+    for (int s = 0; s < (int)RNG::Sequence::count; s++) {
+        std::vector<float> one = render((RNG::Sequence)s, 1);
+        bool same = true;
+        for (size_t threads : {4, 7}) {
+            std::vector<float> many = render((RNG::Sequence)s, threads);
+            same = same && !std::memcmp(one.data(), many.data(), one.size() * sizeof(float));
+        }
+        std::printf("%s render on 1, 4 and 7 threads: %s\n", RNG::Sequence_Names[s],
+                    same ? "identical" : "DIFFERENT");
+    }
+    return 0;
+}
@@ -1,5 +1,7 @@
 
 #include <SDL2/SDL.h>
+#include <chrono>
+#include <fstream>
 #include <imgui/imgui.h>
 #include <imgui/imgui_impl_sdl.h>
 
@@ -8,6 +10,82 @@
 #include "platform/platform.h"
 #include "scene/renderer.h"
 
+static std::string json_string(const std::string &s) {
+    std::string ret = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            ret += code;
+        } else {
+            ret += c;
+        }
+    }
+    return ret + "\"";
+}
+
+// Writes what a headless render cost as JSON, so that builds and machines
+// can be compared. Times are in seconds.
+static std::string write_benchmark(const std::string &file, const std::string &scene_file,
+                                   float load_time, const PT::Pathtracer::Stats &stats) {
+
+    std::ofstream out(file, std::ios::trunc);
+    if (!out.is_open()) return "Failed to open benchmark file " + file + "!";
+
+    // Spelled as they are given to --bvh, so results can be fed back to it
+    static const char *bvh_layouts[(int)PT::BVH_Layout::count] = {"binary", "wide"};
+
+    uint64_t rays = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+    double rays_per_second = stats.render_seconds > 0.0f ? rays / stats.render_seconds : 0.0;
+
+    out << "{\n";
+    out << "  \"scene\": " << json_string(scene_file) << ",\n";
+    out << "  \"width\": " << stats.w << ",\n";
+    out << "  \"height\": " << stats.h << ",\n";
+    out << "  \"threads\": " << stats.threads << ",\n";
+    out << "  \"bvh_layout\": " << json_string(bvh_layouts[(int)stats.bvh_layout]) << ",\n";
+    out << "  \"load_seconds\": " << load_time << ",\n";
+    out << "  \"build_seconds\": " << stats.build_seconds << ",\n";
+    out << "  \"scene_bvh_seconds\": " << stats.scene_bvh_seconds << ",\n";
+    size_t triangles = 0;
+    out << "  \"mesh_bvhs\": [";
+    for (size_t i = 0; i < stats.mesh_bvhs.size(); i++) {
+        const PT::Pathtracer::Stats::Mesh_BVH &mesh = stats.mesh_bvhs[i];
+        triangles += mesh.triangles;
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(mesh.name)
+            << ", \"triangles\": " << mesh.triangles << ", \"instances\": " << mesh.instances
+            << ", \"build_seconds\": " << mesh.build_seconds << "}";
+    }
+    out << (stats.mesh_bvhs.empty() ? "],\n" : "\n  ],\n");
+    double triangles_per_second =
+        stats.mesh_bvh_seconds > 0.0f ? triangles / stats.mesh_bvh_seconds : 0.0;
+    out << "  \"mesh_bvh_seconds\": " << stats.mesh_bvh_seconds << ",\n";
+    out << "  \"mesh_triangles_per_second\": " << (uint64_t)triangles_per_second << ",\n";
+    out << "  \"render_seconds\": " << stats.render_seconds << ",\n";
+    out << "  \"samples_per_pixel\": " << stats.samples_per_pixel << ",\n";
+    out << "  \"rays\": " << rays << ",\n";
+    out << "  \"primary_rays\": " << stats.primary_rays << ",\n";
+    out << "  \"secondary_rays\": " << stats.secondary_rays << ",\n";
+    out << "  \"shadow_rays\": " << stats.shadow_rays << ",\n";
+    out << "  \"rays_per_second\": " << (uint64_t)rays_per_second << ",\n";
+    out << "  \"rays_per_second_per_thread\": "
+        << (uint64_t)(stats.threads ? rays_per_second / stats.threads : 0.0) << ",\n";
+    if (PT::traversal_stats_enabled) {
+        const PT::Traversal_Stats &t = stats.traversal;
+        out << "  \"traversal\": {\"nodes\": " << t.nodes << ", \"box_tests\": " << t.box_tests
+            << ", \"primitive_tests\": " << t.primitive_tests << ", \"hits\": " << t.hits
+            << ", \"transforms\": " << t.transforms << "},\n";
+    }
+    out << "  \"peak_memory_bytes\": " << Platform::peak_memory() << "\n";
+    out << "}\n";
+
+    if (!out) return "Failed to write benchmark file " + file + "!";
+    return {};
+}
+
 App::App(Settings set, Platform *plt)
     : window_dim(plt ? plt->window_draw() : Vec2{1.0f}),
       camera(plt ? plt->window_draw() : Vec2{1.0f}), plt(plt), scene(Gui::n_Widget_IDs),
@@ -18,6 +96,7 @@ App::App(Settings set, Platform *plt)
 
     std::string err;
     bool loaded_scene = true;
+    auto load_start = std::chrono::steady_clock::now();
 
     if (!set.scene_file.empty()) {
         info("Loading scene file...");
@@ -36,23 +115,50 @@ App::App(Settings set, Platform *plt)
         if (!err.empty())
             warn("Error loading environment map: %s", err.c_str());
     }
+    std::chrono::duration<float> load_time = std::chrono::steady_clock::now() - load_start;
 
     if (!set.headless) {
         GL::global_params();
         Renderer::setup(window_dim);
         apply_window_dim(plt->window_draw());
+    } else if (!set.merge_files.empty()) {
+
+        info("Merging render shards...");
+        err = gui.get_render().headless_merge(set.merge_files, set.render);
+        if (!err.empty())
+            warn("Error merging shards: %s", err.c_str());
+
     } else if (loaded_scene) {
 
+        PT::Pathtracer::Region &region = set.render.region;
+        if (set.crop.size() == 4) {
+            region.x = std::max(set.crop[0], 0);
+            region.y = std::max(set.crop[1], 0);
+            region.w = std::max(set.crop[2], 0);
+            region.h = std::max(set.crop[3], 0);
+        }
+        if (set.tile_range.size() == 2) {
+            region.first_tile = std::max(set.tile_range[0], 0);
+            region.last_tile = std::max(set.tile_range[1], 0);
+        }
+
         info("Rendering scene...");
-        err = gui.get_render().headless_render(gui.get_animate(), scene, set.output_file,
-                                               set.animate, set.w, set.h, set.s, set.ls, set.d,
-                                               set.exp, set.w_from_ar);
+        err = gui.get_render().headless_render(gui.get_animate(), scene, set.render);
 
         if (!err.empty())
             warn("Error rendering scene: %s", err.c_str());
         else {
             auto [build, render] = gui.get_render().completion_time();
             info("Built scene in %.2fs, rendered in %.2fs", build, render);
+
+            if (!set.benchmark.empty()) {
+                err = write_benchmark(set.benchmark, set.scene_file, load_time.count(),
+                                      gui.get_render().stats());
+                if (!err.empty())
+                    warn("Error writing benchmark: %s", err.c_str());
+                else
+                    info("Wrote benchmark to %s", set.benchmark.c_str());
+            }
         }
     }
 }
@@ -23,15 +23,11 @@ public:
         bool headless = false;
 
         // If headless is true, use all of these
-        std::string output_file = "out.png";
-        int w = 640;
-        int h = 360;
-        int s = 128;
-        int ls = 16;
-        int d = 4;
-        bool animate = false;
-        float exp = 1.0f;
-        bool w_from_ar = false;
+        Gui::Headless_Settings render;
+        std::vector<int> crop, tile_range;
+        std::vector<std::string> merge_files;
+        // Write a JSON report of the render's performance to this file
+        std::string benchmark;
     };
 
     App(Settings set, Platform *plt = nullptr);
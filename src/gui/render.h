@@ -20,9 +20,10 @@ class Render {
 public:
     Render(Scene &scene, Vec2 dim);
 
-    std::string headless_render(Animate &animate, Scene &scene, std::string output, bool a, int w,
-                                int h, int s, int ls, int d, float exp, bool w_from_ar);
+    std::string headless_render(Animate &animate, Scene &scene, Headless_Settings set);
+    std::string headless_merge(std::vector<std::string> shards, const Headless_Settings &set);
     std::pair<float, float> completion_time() const;
+    PT::Pathtracer::Stats stats() const;
 
     bool keydown(Widgets &widgets, SDL_Keysym key);
     Mode UIsidebar(Manager &manager, Undo &undo, Scene &scene, Scene_Maybe selected,
@@ -1,4 +1,6 @@
 
+#include <filesystem>
+#include <future>
 #include <imgui/imgui.h>
 #include <iomanip>
 #include <iostream>
@@ -12,6 +14,7 @@
 
 #include "../geometry/util.h"
 #include "../platform/platform.h"
+#include "../rays/denoiser.h"
 #include "../scene/renderer.h"
 
 namespace Gui {
@@ -560,7 +563,22 @@ void Widget_Render::begin(Scene &scene, Widget_Camera &cam, Camera &user_cam) {
 
     if (method == 1) {
         ImGui::InputInt("Area Light Samples", &out_area_samples, 1, 100);
+        ImGui::Combo("Light Sampling", (int *)&light_mode, PT::Light_Sampling_Names,
+                     (int)PT::Light_Sampling::count);
+        if (light_mode != PT::Light_Sampling::all) {
+            ImGui::InputInt("Lights per Bounce", &out_light_samples, 1, 8);
+        }
+        ImGui::Combo("Sampler", (int *)&sequence, RNG::Sequence_Names,
+                     (int)RNG::Sequence::count);
+        ImGui::Combo("BVH Layout", (int *)&bvh_layout, PT::BVH_Layout_Names,
+                     (int)PT::BVH_Layout::count);
         ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
+        ImGui::Checkbox("Adaptive Sampling", &adaptive);
+        if (adaptive) {
+            ImGui::SliderFloat("Noise Target", &out_noise, 0.001f, 0.2f, "%.3f", 2.0f);
+            ImGui::InputInt("Warm-up Samples", &out_warmup, 1, 16);
+        }
+        ImGui::Checkbox("Denoise", &denoise);
         ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
     } else {
         out_samples = std::min(out_samples, 32);
@@ -570,7 +588,9 @@ void Widget_Render::begin(Scene &scene, Widget_Camera &cam, Camera &user_cam) {
     out_h = std::max(1, out_h);
     out_samples = std::max(1, out_samples);
     out_area_samples = std::max(1, out_area_samples);
+    out_light_samples = std::max(1, out_light_samples);
     out_depth = std::max(1, out_depth);
+    out_warmup = std::max(2, out_warmup);
 
     if (ImGui::Button("Set Width via AR")) {
         out_w = (size_t)std::ceil(cam.get_ar() * out_h);
@@ -581,6 +601,14 @@ void Widget_Render::begin(Scene &scene, Widget_Camera &cam, Camera &user_cam) {
     }
 }
 
+void Widget_Render::drop_denoising() {
+    // The render's buffers can't be resized while a denoise is copying them
+    if (denoising.valid()) denoising.wait();
+    if (frame_denoising.valid()) frame_denoising.wait();
+    denoising = {};
+    frame_denoising = {};
+}
+
 std::string Widget_Render::step(Animate &animate, Scene &scene) {
 
     if (animating) {
@@ -617,14 +645,28 @@ std::string Widget_Render::step(Animate &animate, Scene &scene) {
         } else {
 
             if (init) {
-                pathtracer.begin_render(scene, cam);
+                pathtracer.begin_render(scene, cam, next_frame);
                 init = false;
             }
 
             if (!pathtracer.in_progress()) {
-                std::vector<unsigned char> data;
 
-                pathtracer.get_output().tonemap_to(data, exposure);
+                // The frame is written once it has been denoised
+                if (denoise && !frame_denoising.valid()) {
+                    frame_denoising = std::async(std::launch::async,
+                                                 [this]() { return pathtracer.denoised(); });
+                }
+                if (denoise && frame_denoising.wait_for(std::chrono::seconds(0)) !=
+                                   std::future_status::ready) {
+                    return {};
+                }
+
+                std::vector<unsigned char> data;
+                if (denoise) {
+                    frame_denoising.get().tonemap_to(data, exposure);
+                } else {
+                    pathtracer.get_output().tonemap_to(data, exposure);
+                }
                 std::stringstream str;
                 str << std::setfill('0') << std::setw(4) << next_frame;
                 std::string path = folder + "\\" + str.str() + ".png";
@@ -636,7 +678,7 @@ std::string Widget_Render::step(Animate &animate, Scene &scene) {
                     return "Failed to write output!";
                 }
 
-                pathtracer.begin_render(scene, cam);
+                pathtracer.begin_render(scene, cam, next_frame + 1);
                 next_frame++;
             }
         }
@@ -687,9 +729,13 @@ void Widget_Render::animate(Scene &scene, Widget_Camera &cam, Camera &user_cam,
             next_frame = 0;
             folder = std::string(output_path);
             if (method == 1) {
+                drop_denoising();
                 init = true;
                 ray_log.clear();
-                pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
+                pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples,
+                                     light_mode, out_light_samples, sequence, out_depth,
+                                     adaptive ? out_noise : 0.0f, out_warmup);
+                pathtracer.set_bvh_layout(bvh_layout);
             }
         }
     }
@@ -731,6 +777,17 @@ bool Widget_Render::UI(Scene &scene, Widget_Camera &cam, Camera &user_cam, std::
         if (ImGui::Button("Cancel")) {
             pathtracer.cancel();
             has_rendered = false;
+            has_denoised = false;
+        }
+
+        // Denoising mid-render takes time away from the render, so it is
+        // only done when asked for.
+        if (method == 1 && denoise && !denoising.valid()) {
+            ImGui::SameLine();
+            if (ImGui::Button("Denoise Now")) {
+                denoising = std::async(std::launch::async,
+                                       [this]() { return pathtracer.denoised(); });
+            }
         }
 
         ImGui::SameLine();
@@ -741,10 +798,15 @@ bool Widget_Render::UI(Scene &scene, Widget_Camera &cam, Camera &user_cam, std::
         if (ImGui::Button("Start Render")) {
 
             if (method == 1) {
+                drop_denoising();
                 has_rendered = true;
+                has_denoised = denoised_final = false;
                 ret = true;
                 ray_log.clear();
-                pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples, out_depth);
+                pathtracer.set_sizes(out_w, out_h, out_samples, out_area_samples,
+                                     light_mode, out_light_samples, sequence, out_depth,
+                                     adaptive ? out_noise : 0.0f, out_warmup);
+                pathtracer.set_bvh_layout(bvh_layout);
                 pathtracer.begin_render(scene, cam.get());
             } else {
                 Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples);
@@ -752,6 +814,19 @@ bool Widget_Render::UI(Scene &scene, Widget_Camera &cam, Camera &user_cam, std::
         }
     }
 
+    if (denoising.valid() &&
+        denoising.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        denoised = denoising.get();
+        has_denoised = true;
+    }
+    // The finished render is denoised once
+    if (method == 1 && denoise && has_rendered && !pathtracer.in_progress() && !denoised_final &&
+        !denoising.valid()) {
+        denoising = std::async(std::launch::async, [this]() { return pathtracer.denoised(); });
+        denoised_final = true;
+    }
+    bool show_denoised = method == 1 && denoise && has_denoised;
+
     ImGui::SameLine();
     if (ImGui::Button("Save Image")) {
         char *path = nullptr;
@@ -766,7 +841,8 @@ bool Widget_Render::UI(Scene &scene, Widget_Camera &cam, Camera &user_cam, std::
             std::vector<unsigned char> data;
 
             if (method == 1) {
-                pathtracer.get_output().tonemap_to(data, exposure);
+                const HDR_Image &image = show_denoised ? denoised : pathtracer.get_output();
+                image.tonemap_to(data, exposure);
                 stbi_flip_vertically_on_write(false);
             } else {
                 Renderer::get().saved(data);
@@ -785,12 +861,25 @@ bool Widget_Render::UI(Scene &scene, Widget_Camera &cam, Camera &user_cam, std::
     float h = (w / out_w) * out_h;
 
     if (method == 1) {
-        ImGui::Image((ImTextureID)(long long)pathtracer.get_output_texture(exposure).get_id(),
-                     {w, h});
+        const GL::Tex2D &tex = show_denoised ? denoised.get_texture(exposure)
+                                             : pathtracer.get_output_texture(exposure);
+        ImGui::Image((ImTextureID)(long long)tex.get_id(), {w, h});
 
         if (!pathtracer.in_progress() && has_rendered) {
             auto [build, render] = pathtracer.completion_time();
             ImGui::Text("Scene built in %.2fs, rendered in %.2fs.", build, render);
+            ImGui::Text("Average samples per pixel: %.1f", pathtracer.average_samples());
+            if (PT::traversal_stats_enabled) {
+                PT::Pathtracer::Stats stats = pathtracer.stats();
+                const PT::Traversal_Stats &t = stats.traversal;
+                uint64_t rays = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+                double per_ray = rays ? 1.0 / rays : 0.0;
+                ImGui::Text("Per ray: %.1f nodes, %.1f box tests, %.1f primitive tests,",
+                            t.nodes * per_ray, t.box_tests * per_ray,
+                            t.primitive_tests * per_ray);
+                ImGui::Text("%.2f hits, %.2f transforms", t.hits * per_ray,
+                            t.transforms * per_ray);
+            }
         }
     } else {
         ImGui::Image((ImTextureID)(long long)Renderer::get().saved(), {w, h}, {0.0f, 1.0f},
@@ -801,22 +890,117 @@ bool Widget_Render::UI(Scene &scene, Widget_Camera &cam, Camera &user_cam, std::
     return ret;
 }
 
+// Outputs are written as float EXRs if the file name asks for one, and as
+// tonemapped PNGs otherwise.
+static bool is_exr(const std::string &file) {
+    std::string ext = file.size() >= 4 ? file.substr(file.size() - 4) : "";
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".exr";
+}
+
+static std::string write_png(const HDR_Image &image, const std::string &file, float exp) {
+    auto [w, h] = image.dimension();
+    std::vector<unsigned char> data;
+    image.tonemap_to(data, exp);
+    if (!stbi_write_png(file.c_str(), (int)w, (int)h, 4, data.data(), (int)w * 4)) {
+        return "Failed to write output!";
+    }
+    return {};
+}
+
+// Snapshots are written next to the output and renamed over it, so that
+// whoever is watching the file never reads a partial image.
+static std::string write_snapshot(const HDR_Image &image, const std::string &file, float exp) {
+    std::string temp = file + ".tmp";
+    std::string err = is_exr(file) ? image.save_exr(temp) : write_png(image, temp, exp);
+    if (!err.empty()) return err;
+
+    std::error_code ec;
+    std::filesystem::rename(temp, file, ec);
+    if (ec) return "Failed to replace snapshot " + file + ": " + ec.message();
+    return {};
+}
+
 std::string Widget_Render::headless(Animate &animate, Scene &scene, const Camera &cam,
-                                    std::string output, bool a, int w, int h, int s, int ls, int d,
-                                    float exp) {
+                                    Headless_Settings set) {
+
+    PT::Pathtracer::Checkpoint resume_from;
+    if (!set.resume.empty()) {
+        if (set.animate) return "Resuming is not supported when rendering animations!";
+        if (!set.region.whole()) return "A resumed render always covers the checkpoint's region!";
+        std::string err = resume_from.load(set.resume);
+        if (!err.empty()) return err;
+        set.w = (int)resume_from.w;
+        set.h = (int)resume_from.h;
+        set.samples = (int)resume_from.samples;
+        set.area_samples = (int)resume_from.area_samples;
+        set.light_mode = resume_from.light_mode;
+        set.light_samples = (int)resume_from.light_samples;
+        set.sequence = resume_from.sequence;
+        set.depth = (int)resume_from.depth;
+        set.noise = resume_from.noise;
+        set.warmup = (int)resume_from.warmup;
+        set.region = resume_from.region;
+        info("Resuming from checkpoint %s", set.resume.c_str());
+        // Keep saving progress where it came from, unless told otherwise
+        if (set.checkpoint.empty()) set.checkpoint = set.resume;
+    }
+
+    if (set.animate && !set.region.whole())
+        return "Rendering part of the image is not supported for animations!";
 
     info("Render settings:");
-    info("\twidth: %d", w);
-    info("\theight: %d", h);
-    info("\tsamples: %d", s);
-    info("\tlight samples: %d", ls);
-    info("\tmax depth: %d", d);
-    info("\texposure: %f", exp);
+    info("\twidth: %d", set.w);
+    info("\theight: %d", set.h);
+    info("\tsamples: %d", set.samples);
+    info("\tlight samples: %d", set.area_samples);
+    info("\tlight sampling: %s", PT::Light_Sampling_Names[(int)set.light_mode]);
+    if (set.light_mode != PT::Light_Sampling::all)
+        info("\tlights per bounce: %d", set.light_samples);
+    info("\tsampler: %s", RNG::Sequence_Names[(int)set.sequence]);
+    info("\tBVH layout: %s", PT::BVH_Layout_Names[(int)set.bvh_layout]);
+    info("\tmax depth: %d", set.depth);
+    if (set.noise > 0.0f) {
+        info("\tnoise target: %f", set.noise);
+        info("\twarm-up samples: %d", set.warmup);
+    }
+    info("\texposure: %f", set.exposure);
+    info("\tdenoise: %s", set.denoise ? "yes" : "no");
+    if (!set.aovs.empty()) {
+        std::string names;
+        for (PT::AOV aov : set.aovs) {
+            if (!names.empty()) names += ", ";
+            names += PT::AOV_Names[(int)aov];
+        }
+        info("\tAOVs: %s", names.c_str());
+        if (!is_exr(set.output)) warn("AOVs are only written to EXR outputs!");
+    }
+    if (set.progressive_interval > 0.0f) {
+        info("\tsnapshot interval: %.1fs", set.progressive_interval);
+        if (set.animate || !set.region.whole())
+            warn("Snapshots are only written when rendering a whole, single frame!");
+    }
     info("\trender threads: %u", std::thread::hardware_concurrency());
 
-    out_w = w;
-    out_h = h;
-    pathtracer.set_sizes(w, h, s, ls, d);
+    out_w = set.w;
+    out_h = set.h;
+    exposure = set.exposure;
+    denoise = set.denoise;
+    pathtracer.set_sizes(set.w, set.h, set.samples, set.area_samples, set.light_mode,
+                         set.light_samples, set.sequence, set.depth, set.noise, set.warmup);
+    pathtracer.set_bvh_layout(set.bvh_layout);
+    if (!set.region.whole()) {
+        const PT::Pathtracer::Region &region = set.region;
+        info("\tregion: crop %zu,%zu,%zu,%zu, tiles %zu-%zu of %zu", region.x, region.y,
+             std::min(region.w, (size_t)set.w), std::min(region.h, (size_t)set.h),
+             region.first_tile, std::min(region.last_tile, pathtracer.n_tiles()),
+             pathtracer.n_tiles());
+        pathtracer.set_region(region);
+    }
+    if (!set.resume.empty()) {
+        std::string err = pathtracer.resume(std::move(resume_from));
+        if (!err.empty()) return err;
+    }
 
     auto print_progress = [](float f) {
         std::cout << "Progress: [";
@@ -839,14 +1023,14 @@ std::string Widget_Render::headless(Animate &animate, Scene &scene, const Camera
     };
 
     std::cout << std::fixed << std::setw(2) << std::setprecision(2) << std::setfill('0');
-    if (a) {
+    if (set.animate) {
 
         method = 1;
         init = true;
         animating = true;
         max_frame = animate.n_frames();
         next_frame = 0;
-        folder = output;
+        folder = set.output;
         while (next_frame < max_frame) {
             std::string err = step(animate, scene);
             if (!err.empty())
@@ -858,23 +1042,113 @@ std::string Widget_Render::headless(Animate &animate, Scene &scene, const Camera
 
     } else {
 
+        // Checkpoints and snapshots are copied and written on their own
+        // threads. The render threads skip over each tile only while it is
+        // copied into a checkpoint, and never wait on snapshots.
+        using Clock = std::chrono::steady_clock;
+        auto report = [](std::future<std::string> &task) {
+            std::string err = task.get();
+            if (!err.empty()) warn("%s", err.c_str());
+        };
+        // Starts the task again once the interval has passed since it last
+        // started, and the previous run is done
+        auto periodic = [&report](std::future<std::string> &task, Clock::time_point &last,
+                                  float interval, auto &&fn) {
+            std::chrono::duration<float> since = Clock::now() - last;
+            if (since.count() < interval) return;
+            if (task.valid()) {
+                if (task.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+                report(task);
+            }
+            task = std::async(std::launch::async, fn);
+            last = Clock::now();
+        };
+        std::future<std::string> saving, snapshotting;
+        Clock::time_point last_save = Clock::now(), last_snapshot = last_save;
+        bool snapshots = set.progressive_interval > 0.0f && set.region.whole();
+
+        pathtracer.enable_snapshots(snapshots);
         pathtracer.begin_render(scene, cam);
         while (pathtracer.in_progress()) {
             print_progress(pathtracer.progress());
             std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+            if (!set.checkpoint.empty()) {
+                periodic(saving, last_save, set.checkpoint_interval,
+                         [this, file = set.checkpoint]() {
+                             return pathtracer.checkpoint().save(file);
+                         });
+            }
+            if (snapshots) {
+                periodic(snapshotting, last_snapshot, set.progressive_interval,
+                         [this, file = set.output, exposure = set.exposure]() {
+                             return write_snapshot(pathtracer.snapshot(), file, exposure);
+                         });
+            }
         }
+        if (saving.valid()) report(saving);
+        if (snapshotting.valid()) report(snapshotting);
         std::cout << std::endl;
+        info("Average samples per pixel: %.2f", pathtracer.average_samples());
+        PT::Pathtracer::Stats stats = pathtracer.stats();
+        if (!stats.mesh_bvhs.empty()) {
+            size_t triangles = 0;
+            for (const PT::Pathtracer::Stats::Mesh_BVH &mesh : stats.mesh_bvhs) {
+                triangles += mesh.triangles;
+            }
+            float seconds = stats.mesh_bvh_seconds;
+            info("Built %zu mesh BVHs over %zu triangles in %.2fs (%.2fM triangles/s)",
+                 stats.mesh_bvhs.size(), triangles, seconds,
+                 seconds > 0.0f ? triangles / seconds / 1e6f : 0.0f);
+        }
 
-        std::vector<unsigned char> data;
-        pathtracer.get_output().tonemap_to(data, exp);
-        if (!stbi_write_png(output.c_str(), w, h, 4, data.data(), w * 4)) {
-            return "Failed to write output!";
+        // Parts of an image are written as raw shards, to be merged (and
+        // denoised) later
+        if (!set.region.whole()) return pathtracer.checkpoint().save(set.output);
+        HDR_Image denoised;
+        if (set.denoise) {
+            auto start = std::chrono::steady_clock::now();
+            denoised = pathtracer.denoised();
+            std::chrono::duration<float> took = std::chrono::steady_clock::now() - start;
+            info("Denoised in %.2fs", took.count());
+        }
+        if (is_exr(set.output)) {
+            return pathtracer.save_exr(set.output, set.aovs, set.denoise ? &denoised : nullptr);
         }
+        if (set.denoise) return write_png(denoised, set.output, set.exposure);
+        return write_png(pathtracer.get_output(), set.output, set.exposure);
     }
 
     return {};
 }
 
+std::string Widget_Render::merge(const std::vector<std::string> &shards,
+                                 const Headless_Settings &set) {
+
+    PT::Pathtracer::Checkpoint merged;
+    for (size_t i = 0; i < shards.size(); i++) {
+        PT::Pathtracer::Checkpoint shard;
+        std::string err = shard.load(shards[i]);
+        if (err.empty() && i > 0) err = merged.merge(shard);
+        if (!err.empty()) return err;
+        if (i == 0) merged = std::move(shard);
+    }
+    merged.expand();
+
+    size_t missing = std::count(merged.pixel_samples.begin(), merged.pixel_samples.end(), 0u);
+    if (missing) warn("%zu pixels are not covered by any shard!", missing);
+
+    info("Merged %zu shards into a %zux%zu image", shards.size(), merged.w, merged.h);
+    Thread_Pool &pool = pathtracer.pool();
+    HDR_Image denoised;
+    if (set.denoise) denoised = PT::denoise(merged, &pool);
+    if (is_exr(set.output)) {
+        return merged.save_exr(set.output, set.aovs, &pool, set.denoise ? &denoised : nullptr);
+    }
+    if (set.denoise) return write_png(denoised, set.output, set.exposure);
+    return write_png(merged.image(), set.output, set.exposure);
+}
+
 void Widget_Render::render_log(const Mat4 &view) const {
     std::lock_guard<std::mutex> lock(log_mut);
     Renderer::get().lines(ray_log, view);
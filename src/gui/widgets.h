@@ -1,6 +1,8 @@
 
 #pragma once
 
+#include <future>
+
 #include "../lib/mathlib.h"
 #include "../rays/pathtracer.h"
 #include "../scene/scene.h"
@@ -62,6 +64,35 @@ private:
     void generate_cage();
 };
 
+// How to path-trace a scene without the GUI
+struct Headless_Settings {
+    std::string output = "out.png";
+    bool animate = false;
+    int w = 640;
+    int h = 360;
+    // Compute the width from the camera's aspect ratio
+    bool w_from_ar = false;
+    int samples = 128;
+    int area_samples = 16;
+    PT::Light_Sampling light_mode = PT::Light_Sampling::all;
+    int light_samples = 1;
+    RNG::Sequence sequence = RNG::Sequence::sobol;
+    PT::BVH_Layout bvh_layout = PT::BVH_Layout::wide;
+    int depth = 4;
+    float noise = 0.0f;
+    int warmup = 16;
+    float exposure = 1.0f;
+    bool denoise = false;
+    // Extra layers written to EXR outputs
+    std::vector<PT::AOV> aovs;
+    std::string checkpoint;
+    float checkpoint_interval = 300.0f;
+    // Seconds between snapshots of the render so far, written to the output
+    float progressive_interval = 0.0f;
+    std::string resume;
+    PT::Pathtracer::Region region;
+};
+
 class Widget_Render {
 public:
     Widget_Render(Vec2 dim);
@@ -72,8 +103,9 @@ public:
     void animate(Scene &scene, Widget_Camera &cam, Camera &user_cam, int max_frame);
     std::string step(Animate &animate, Scene &scene);
 
-    std::string headless(Animate &animate, Scene &scene, const Camera &cam, std::string output,
-                         bool a, int w, int h, int s, int ls, int d, float exp);
+    std::string headless(Animate &animate, Scene &scene, const Camera &cam,
+                         Headless_Settings set);
+    std::string merge(const std::vector<std::string> &shards, const Headless_Settings &set);
 
     void log_ray(const Ray &ray, float t, Spectrum color = Spectrum{1.0f});
     void render_log(const Mat4 &view) const;
@@ -81,19 +113,30 @@ public:
     PT::Pathtracer &tracer() { return pathtracer; }
     bool rendered() const { return has_rendered; }
     std::pair<float, float> completion_time() const { return pathtracer.completion_time(); }
+    PT::Pathtracer::Stats stats() const { return pathtracer.stats(); }
     bool in_progress() const { return pathtracer.in_progress(); }
     float wh_ar() const { return (float)out_w / (float)out_h; }
 
 private:
     void begin(Scene &scene, Widget_Camera &cam, Camera &user_cam);
+    // Waits for and discards any denoise still running
+    void drop_denoising();
 
     mutable std::mutex log_mut;
     GL::Lines ray_log;
 
     int out_w, out_h, out_samples = 32, out_area_samples = 8, out_depth = 4;
-    float exposure = 1.0f;
+    int out_warmup = 16, out_light_samples = 1;
+    float exposure = 1.0f, out_noise = 0.02f;
+    bool adaptive = false, denoise = false;
+    PT::Light_Sampling light_mode = PT::Light_Sampling::all;
+    RNG::Sequence sequence = RNG::Sequence::sobol;
+    PT::BVH_Layout bvh_layout = PT::BVH_Layout::wide;
 
     bool has_rendered = false;
+    // The last denoised render, and whether it is of the finished render
+    HDR_Image denoised;
+    bool has_denoised = false, denoised_final = false;
     bool render_window = false, render_window_focus = false;
 
     int method = 1;
@@ -103,6 +146,9 @@ private:
     std::string folder;
 
     PT::Pathtracer pathtracer;
+    // Denoising runs off the UI thread. Declared after the pathtracer, so
+    // that a denoise still running finishes before the pathtracer goes away.
+    std::future<HDR_Image> denoising, frame_denoising;
 };
 
 class Widgets {
@@ -13,16 +13,82 @@ int main(int argc, char **argv) {
     args.add_option("-s,--scene", settings.scene_file, "Scene file to load");
     args.add_option("--env_map", settings.env_map_file, "Override scene environment map");
     args.add_flag("--headless", settings.headless, "Path-trace scene without opening the GUI");
-    args.add_option("-o,--output", settings.output_file, "Image file to write (if headless)");
-    args.add_flag("--animate", settings.animate, "Output animation frames (if headless)");
-    args.add_option("--width", settings.w, "Output image width (if headless)");
-    args.add_option("--height", settings.h, "Output image height (if headless)");
-    args.add_flag("--use_ar", settings.w_from_ar,
+    args.add_option("-o,--output", settings.render.output, "Image file to write (if headless)");
+    args.add_flag("--animate", settings.render.animate, "Output animation frames (if headless)");
+    args.add_option("--width", settings.render.w, "Output image width (if headless)");
+    args.add_option("--height", settings.render.h, "Output image height (if headless)");
+    args.add_flag("--use_ar", settings.render.w_from_ar,
                   "Compute output image width based on camera AR (if headless)");
-    args.add_option("--depth", settings.d, "Maximum ray depth (if headless)");
-    args.add_option("--samples", settings.s, "Pixel samples (if headless)");
-    args.add_option("--exposure", settings.exp, "Output exposure (if headless)");
-    args.add_option("--area_samples", settings.ls, "Area light samples (if headless)");
+    args.add_option("--depth", settings.render.depth, "Maximum ray depth (if headless)");
+    args.add_option("--samples", settings.render.samples,
+                    "Pixel samples, or average sample budget with --noise (if headless)");
+    args.add_option("--noise", settings.render.noise,
+                    "Adaptive sampling target relative error, 0 to disable (if headless)");
+    args.add_option("--warmup", settings.render.warmup,
+                    "Samples per pixel before adaptive sampling starts (if headless)");
+    args.add_option("--exposure", settings.render.exposure, "Output exposure (if headless)");
+    args.add_option("--area_samples", settings.render.area_samples,
+                    "Area light samples (if headless)");
+    args.add_option("--light_sampling", settings.render.light_mode,
+                    "How lights are picked for direct lighting: all, power or tree (if headless)")
+        ->transform(CLI::CheckedTransformer(std::map<std::string, PT::Light_Sampling>{
+                                                {"all", PT::Light_Sampling::all},
+                                                {"power", PT::Light_Sampling::power},
+                                                {"tree", PT::Light_Sampling::tree}},
+                                            CLI::ignore_case));
+    args.add_option("--light_samples", settings.render.light_samples,
+                    "Lights sampled per bounce, unless sampling all lights (if headless)");
+    args.add_option("--sampler", settings.render.sequence,
+                    "Where pixel samples take their random numbers from: random, sobol or "
+                    "blue_noise (if headless)")
+        ->transform(CLI::CheckedTransformer(std::map<std::string, RNG::Sequence>{
+                                                {"random", RNG::Sequence::random},
+                                                {"sobol", RNG::Sequence::sobol},
+                                                {"blue_noise", RNG::Sequence::blue_noise}},
+                                            CLI::ignore_case));
+    args.add_option("--bvh", settings.render.bvh_layout,
+                    "How BVHs are laid out for traversal: binary or wide (if headless)")
+        ->transform(CLI::CheckedTransformer(std::map<std::string, PT::BVH_Layout>{
+                                                {"binary", PT::BVH_Layout::binary},
+                                                {"wide", PT::BVH_Layout::wide}},
+                                            CLI::ignore_case));
+    args.add_flag("--denoise", settings.render.denoise,
+                  "Filter the remaining noise out of the output image (if headless)");
+    args.add_option("--aovs", settings.render.aovs,
+                    "Extra layers to write to EXR outputs: depth, normal, albedo, samples or "
+                    "variance (if headless)")
+        ->delimiter(',')
+        ->transform(CLI::CheckedTransformer(std::map<std::string, PT::AOV>{
+                                                {"depth", PT::AOV::depth},
+                                                {"normal", PT::AOV::normal},
+                                                {"albedo", PT::AOV::albedo},
+                                                {"samples", PT::AOV::samples},
+                                                {"variance", PT::AOV::variance}},
+                                            CLI::ignore_case));
+    args.add_option("--checkpoint", settings.render.checkpoint,
+                    "Periodically save render progress to this file (if headless)");
+    args.add_option("--checkpoint_interval", settings.render.checkpoint_interval,
+                    "Seconds between checkpoints (if headless)");
+    args.add_option("--progressive_interval", settings.render.progressive_interval,
+                    "Seconds between writing the render so far to the output image, 0 to "
+                    "disable (if headless)");
+    args.add_option("--resume", settings.render.resume,
+                    "Continue a render from a checkpoint file, using its settings (if headless)");
+    args.add_option("--crop", settings.crop,
+                    "Only render pixels x,y,w,h (from the top left) to a raw shard file "
+                    "(if headless)")
+        ->expected(4)
+        ->delimiter(',');
+    args.add_option("--tile_range", settings.tile_range,
+                    "Only render tiles first,last (exclusive) to a raw shard file (if headless)")
+        ->expected(2)
+        ->delimiter(',');
+    args.add_option("--benchmark", settings.benchmark,
+                    "Write a JSON report of load, build and render times, ray counts and peak "
+                    "memory to this file (if headless)");
+    args.add_option("--merge", settings.merge_files,
+                    "Merge raw shard files into the output image instead of rendering "
+                    "(if headless)");
 
     CLI11_PARSE(args, argc, argv);
 
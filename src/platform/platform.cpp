@@ -13,12 +13,15 @@
 #ifdef _WIN32
 #include <ConsoleApi.h>
 #include <ShellScalingApi.h>
+#include <Windows.h>
+#include <Psapi.h>
 extern "C" {
 __declspec(dllexport) bool NvOptimusEnablement = true;
 __declspec(dllexport) bool AmdPowerXpressRequestHighPerformance = true;
 }
 #else
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #endif
 
 int Platform::console_width() {
@@ -35,6 +38,23 @@ int Platform::console_width() {
     return cols;
 }
 
+size_t Platform::peak_memory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    // Linux reports kilobytes
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
 void Platform::remove_console() {
 #ifdef _WIN32
     FreeConsole();
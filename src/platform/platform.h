@@ -27,6 +27,8 @@ public:
 
     static void remove_console();
     static int console_width();
+    // Most memory the process has held at once, in bytes
+    static size_t peak_memory();
     static void strcpy(char *dest, const char *src, size_t limit);
 
 private:
@@ -120,6 +120,18 @@ public:
                           underlying);
     }
 
+    // The color the surface gives to the light it scatters, which the
+    // denoiser divides out so that texture detail isn't blurred away.
+    Spectrum albedo() const {
+        return std::visit(
+            overloaded{[](const BSDF_Lambertian &b) { return b.albedo; },
+                       [](const BSDF_Mirror &b) { return b.reflectance; },
+                       [](const BSDF_Glass &b) { return (b.reflectance + b.transmittance) * 0.5f; },
+                       [](const BSDF_Diffuse &) { return Spectrum{1.0f}; },
+                       [](const BSDF_Refract &b) { return b.transmittance; }},
+            underlying);
+    }
+
 private:
     std::variant<BSDF_Lambertian, BSDF_Mirror, BSDF_Glass, BSDF_Diffuse, BSDF_Refract> underlying;
 };
@@ -6,16 +6,41 @@
 
 #include "trace.h"
 
+#include <cstdint>
+#include <memory>
+
+// Wide nodes test their children four at a time with SSE where the target has
+// it, and one after another otherwise.
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define SCOTTY3D_BVH_SSE
+#include <xmmintrin.h>
+#endif
+
+class Thread_Pool;
+class Task_Group;
+class Work_Timer;
+
 namespace PT {
 
+// How a built BVH is laid out for traversal: as a binary tree, or collapsed
+// into a tree of four-wide nodes whose children are tested at once.
+enum class BVH_Layout : int { binary, wide, count };
+extern const char *BVH_Layout_Names[(int)BVH_Layout::count];
+
 template <typename Primitive> class BVH {
 public:
     BVH() = default;
-    BVH(std::vector<Primitive> &&primitives, size_t max_leaf_size = 1);
-    void build(std::vector<Primitive> &&primitives, size_t max_leaf_size = 1);
+    BVH(std::vector<Primitive> &&primitives, size_t max_leaf_size = 1,
+        BVH_Layout layout = BVH_Layout::wide);
+    // Builds on the pool, if given. The tree is the same either way, and
+    // doesn't depend on the number of threads.
+    void build(std::vector<Primitive> &&primitives, size_t max_leaf_size = 1,
+               BVH_Layout layout = BVH_Layout::wide, Thread_Pool *pool = nullptr);
 
     BBox bbox() const;
     Trace hit(const Ray &ray) const;
+    // Whether anything blocks the ray within its time bounds
+    bool occluded(const Ray &ray) const;
 
     size_t visualize(GL::Lines &lines, GL::Lines &active, size_t level, const Mat4 &trans) const;
 
@@ -23,19 +48,112 @@ public:
     void clear();
 
 private:
-    class Node {
+    // Nodes as the build creates them
+    class Build_Node {
         BBox bbox;
         size_t start, size, l, r;
 
         bool is_leaf() const;
         friend class BVH<Primitive>;
     };
-    size_t new_node(BBox box = {}, size_t start = 0, size_t size = 0, size_t l = 0, size_t r = 0);
-    void recursive_build(const size_t node_idx, const size_t max_leaf_size);
-    void find_closest_hit(const Ray &ray, const size_t nodeIdx, Trace &closest) const;
+
+    // Nodes are traversed in a compact copy of the tree, stored depth first
+    // so that an interior node's left child directly follows it. Leaves keep
+    // their primitive range, interior nodes their right child and the axis
+    // along which the children are split (for visiting the nearer one first).
+    struct alignas(32) Node {
+        Vec3 min;
+        // First primitive of a leaf, or the right child of an interior node
+        uint32_t offset;
+        Vec3 max;
+        // The top bit marks leaves, and the rest is their primitive count.
+        // Interior nodes hold their split axis instead.
+        uint32_t info;
+
+        static const uint32_t leaf_bit = 0x80000000u;
+        bool is_leaf() const { return info & leaf_bit; }
+        uint32_t count() const { return info & ~leaf_bit; }
+    };
+    static_assert(sizeof(Node) == 32);
+
+    // Four children of the wide layout, with their bounds stored lane by lane
+    // so that one slab test covers all of them. A child is either a wide node
+    // or a leaf's primitive range; unused slots are empty leaves whose
+    // inverted bounds no ray can hit.
+    struct alignas(64) Wide_Node {
+        float min_x[4], min_y[4], min_z[4];
+        float max_x[4], max_y[4], max_z[4];
+        // The child's node, or the first primitive of a leaf
+        uint32_t child[4];
+        // Zero for nodes, and Node::leaf_bit plus the primitive count for leaves
+        uint32_t info[4];
+    };
+    static_assert(sizeof(Wide_Node) == 128);
+
+    // A wide node's child still to be visited, and where the ray enters it
+    struct Wide_Entry {
+        uint32_t child, info;
+        float t;
+    };
+
+    // A ray prepared for box tests: its inverse direction, and whether it
+    // travels towards negative coordinates along each axis.
+    struct Box_Ray {
+        explicit Box_Ray(const Ray &ray);
+        // Narrows [t_min, t_max] to the part of the ray inside the node
+        bool hit(const Node &node, float &t_min, float &t_max) const;
+        // Tests all children of a wide node within [t_min, t_max], returning a
+        // mask of those hit and where the ray enters each
+        int hit(const Wide_Node &node, float t_min, float t_max, float (&enter)[4]) const;
+
+        Vec3 point, inv_dir;
+        bool negative[3];
+    };
+
+    // A primitive's bounds and centroid, computed once for the build
+    struct Build_Ref {
+        BBox bbox;
+        Vec3 center;
+        size_t index;
+    };
+
+    // Part of the tree, built by one task. Subtrees that are big enough are
+    // handed to tasks of their own, and spliced in where they were forked
+    // once the whole build is done.
+    struct Build_Part {
+        std::vector<Build_Node> nodes;
+        std::vector<std::pair<size_t, std::unique_ptr<Build_Part>>> forks;
+    };
+
+    // What all tasks of one build share
+    struct Build_State {
+        std::vector<Build_Ref> &refs;
+        size_t max_leaf_size;
+        Thread_Pool *pool;
+        Task_Group *group;
+        Work_Timer *timer;
+    };
+
+    size_t new_node(Build_Part &part, BBox box = {}, size_t start = 0, size_t size = 0,
+                    size_t l = 0, size_t r = 0);
+    void recursive_build(const Build_State &state, Build_Part &part, size_t node_idx);
+    void splice(Build_Part &part, size_t offset);
+    void flatten();
+    void flatten_wide();
+    Trace hit_wide(const Ray &ray) const;
+    bool occluded_wide(const Ray &ray) const;
+    template <typename Entry, size_t N>
+    Entry *traversal_stack(Entry (&local)[N], std::vector<Entry> &deep) const;
+
+    std::vector<Build_Node> build_nodes;
     std::vector<Node> nodes;
+    std::vector<Wide_Node> wide_nodes;
+    BVH_Layout node_layout = BVH_Layout::wide;
+    BBox bounds;
     std::vector<Primitive> primitives;
     size_t root_idx = 0;
+    // Stack entries traversal needs at most
+    size_t depth = 0;
 };
 
 } // namespace PT
@@ -0,0 +1,190 @@
+
+#include "denoiser.h"
+
+#include <cmath>
+
+namespace PT {
+
+// Pass k spaces its 5x5 taps 2^k pixels apart, so five passes cover a 125
+// pixel wide footprint at 25 taps per pixel and pass.
+static const int passes = 5;
+// The B3 spline taps, applied along both axes
+static const float kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+// How quickly neighbors stop counting as their brightness differs by more
+// than the noise, and as their depth differs from the local depth slope.
+static const float sigma_luma = 4.0f, sigma_depth = 1.0f;
+// Albedo is clamped to this before dividing it out, so that black surfaces
+// keep their (black) lighting instead of turning into infinities.
+static const float min_albedo = 0.01f;
+static const size_t tile_size = 32;
+
+HDR_Image denoise(const Pathtracer::Checkpoint &render, Thread_Pool *pool) {
+
+    size_t w = render.w, h = render.h;
+    if (!w || !h || !render.whole()) return HDR_Image();
+    HDR_Image ret(w, h);
+
+    struct Guide {
+        Spectrum albedo;
+        Vec3 normal;
+        float depth = 0.0f, depth_slope = 0.0f;
+        bool valid = false;
+    };
+    std::vector<Guide> guide(w * h);
+    std::vector<Spectrum> color[2];
+    std::vector<float> variance[2];
+    for (int i = 0; i < 2; i++) {
+        color[i].resize(w * h);
+        variance[i].resize(w * h);
+    }
+
+    // Every stage reads the previous one's buffers and writes its own, so
+    // pixels can be processed in any order; tiles keep each task's reads local.
+    size_t tiles_x = (w + tile_size - 1) / tile_size;
+    size_t tiles_y = (h + tile_size - 1) / tile_size;
+    auto for_pixels = [&](auto &&fn) {
+        auto run = [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; t++) {
+                size_t x0 = (t % tiles_x) * tile_size, y0 = (t / tiles_x) * tile_size;
+                for (size_t y = y0; y < std::min(y0 + tile_size, h); y++) {
+                    for (size_t x = x0; x < std::min(x0 + tile_size, w); x++) fn(x, y);
+                }
+            }
+        };
+        if (pool) {
+            pool->parallel_for(0, tiles_x * tiles_y, 1, run);
+        } else {
+            run(0, tiles_x * tiles_y);
+        }
+    };
+
+    // Demodulate the lighting, and estimate the variance of each pixel's
+    // mean brightness; with a single sample, assume the error is as large as
+    // the pixel itself.
+    for_pixels([&](size_t x, size_t y) {
+        size_t i = y * w + x;
+        unsigned int n = render.pixel_samples[i];
+        Guide &g = guide[i];
+        if (!n) return;
+
+        g.valid = true;
+        g.albedo = render.albedo_aov[i];
+        g.albedo.r = std::max(g.albedo.r, min_albedo);
+        g.albedo.g = std::max(g.albedo.g, min_albedo);
+        g.albedo.b = std::max(g.albedo.b, min_albedo);
+        float length = render.normal_aov[i].norm();
+        g.normal = length > 0.0f ? render.normal_aov[i] / length : Vec3{};
+        g.depth = render.depth_aov[i];
+
+        Spectrum c = render.accumulator[i];
+        color[0][i] = Spectrum(c.r / g.albedo.r, c.g / g.albedo.g, c.b / g.albedo.b);
+        float luma = color[0][i].luma();
+        variance[0][i] = n > 1 ? render.luma_m2[i] / ((float)(n - 1) * n) /
+                                     (g.albedo.luma() * g.albedo.luma())
+                               : luma * luma;
+    });
+
+    // Depth changes by this much per pixel on the surface, so that slanted
+    // surfaces still blend with themselves.
+    for_pixels([&](size_t x, size_t y) {
+        Guide &g = guide[y * w + x];
+        if (!g.valid || g.normal == Vec3{}) return;
+        auto slope = [&](size_t a, size_t b, float dist) {
+            const Guide &l = guide[a], &r = guide[b];
+            if (!l.valid || !r.valid || l.normal == Vec3{} || r.normal == Vec3{}) return 0.0f;
+            return std::abs(r.depth - l.depth) / dist;
+        };
+        size_t x0 = x ? x - 1 : x, x1 = std::min(x + 1, w - 1);
+        size_t y0 = y ? y - 1 : y, y1 = std::min(y + 1, h - 1);
+        float slope_x = x1 > x0 ? slope(y * w + x0, y * w + x1, (float)(x1 - x0)) : 0.0f;
+        float slope_y = y1 > y0 ? slope(y0 * w + x, y1 * w + x, (float)(y1 - y0)) : 0.0f;
+        g.depth_slope = std::max(slope_x, slope_y);
+    });
+
+    for (int pass = 0; pass < passes; pass++) {
+
+        const std::vector<Spectrum> &in_color = color[pass % 2];
+        const std::vector<float> &in_variance = variance[pass % 2];
+        std::vector<Spectrum> &out_color = color[(pass + 1) % 2];
+        std::vector<float> &out_variance = variance[(pass + 1) % 2];
+        int step = 1 << pass;
+        float dist[5][5];
+        for (int dy = -2; dy <= 2; dy++) {
+            for (int dx = -2; dx <= 2; dx++) {
+                dist[dy + 2][dx + 2] = step * std::sqrt((float)(dx * dx + dy * dy));
+            }
+        }
+
+        for_pixels([&](size_t x, size_t y) {
+            size_t i = y * w + x;
+            const Guide &p = guide[i];
+            if (!p.valid) return;
+
+            // The brightness weight uses a slightly blurred variance, as the
+            // estimate of a single pixel is itself noisy.
+            float blurred = 0.0f, blurred_weight = 0.0f;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    long qx = (long)x + dx, qy = (long)y + dy;
+                    if (qx < 0 || qy < 0 || qx >= (long)w || qy >= (long)h) continue;
+                    size_t q = qy * w + qx;
+                    if (!guide[q].valid) continue;
+                    float k = (dx ? 0.5f : 1.0f) * (dy ? 0.5f : 1.0f);
+                    blurred += k * in_variance[q];
+                    blurred_weight += k;
+                }
+            }
+            float luma_scale = sigma_luma * std::sqrt(blurred / blurred_weight) + 1e-6f;
+            float luma = in_color[i].luma();
+
+            Spectrum sum;
+            float sum_weight = 0.0f, sum_variance = 0.0f;
+            for (int dy = -2; dy <= 2; dy++) {
+                for (int dx = -2; dx <= 2; dx++) {
+                    long qx = (long)x + dx * step, qy = (long)y + dy * step;
+                    if (qx < 0 || qy < 0 || qx >= (long)w || qy >= (long)h) continue;
+                    size_t j = qy * w + qx;
+                    const Guide &q = guide[j];
+                    if (!q.valid) continue;
+
+                    // Normals must nearly agree (cos^128); the background
+                    // (zero normal) only blends with itself.
+                    float w_normal;
+                    if (p.normal == Vec3{} || q.normal == Vec3{}) {
+                        w_normal = p.normal == q.normal ? 1.0f : 0.0f;
+                    } else {
+                        w_normal = std::max(dot(p.normal, q.normal), 0.0f);
+                        for (int k = 0; k < 7; k++) w_normal *= w_normal;
+                    }
+                    if (w_normal == 0.0f) continue;
+
+                    // The depth and brightness weights share one exponential
+                    float depth_scale = sigma_depth * p.depth_slope * dist[dy + 2][dx + 2] +
+                                        1e-3f * p.depth + 1e-6f;
+                    float w_depth_luma =
+                        std::exp(-std::abs(p.depth - q.depth) / depth_scale -
+                                 std::abs(luma - in_color[j].luma()) / luma_scale);
+
+                    float weight =
+                        kernel[std::abs(dx)] * kernel[std::abs(dy)] * w_normal * w_depth_luma;
+                    sum += in_color[j] * weight;
+                    sum_weight += weight;
+                    sum_variance += weight * weight * in_variance[j];
+                }
+            }
+
+            // The pixel itself always has a positive weight
+            out_color[i] = sum * (1.0f / sum_weight);
+            out_variance[i] = sum_variance / (sum_weight * sum_weight);
+        });
+    }
+
+    const std::vector<Spectrum> &result = color[passes % 2];
+    for_pixels([&](size_t x, size_t y) {
+        size_t i = y * w + x;
+        if (guide[i].valid) ret.at(i) = result[i] * guide[i].albedo;
+    });
+    return ret;
+}
+
+} // namespace PT
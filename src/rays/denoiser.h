@@ -0,0 +1,21 @@
+#pragma once
+
+#include "../util/hdr_image.h"
+#include "../util/thread_pool.h"
+
+#include "pathtracer.h"
+
+namespace PT {
+
+// Removes the remaining noise from a render with the edge-avoiding a-trous
+// wavelet filter of Dammertz et al. (2010), weighted as in Schied et al.,
+// "Spatiotemporal Variance-Guided Filtering" (2017). Lighting is divided by
+// the first-hit albedo before filtering so that texture detail is kept, and
+// pixels only blend with neighbors that have a similar normal and depth, and
+// a brightness that differs by no more than their estimated noise. Pixels
+// without samples are left black. The filter runs over tiles on the pool, if
+// given.
+// The checkpoint must cover the whole image (see Checkpoint::expand).
+HDR_Image denoise(const Pathtracer::Checkpoint &render, Thread_Pool *pool = nullptr);
+
+} // namespace PT
@@ -0,0 +1,245 @@
+#include "env_cache.h"
+#include "../lib/log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+
+namespace PT {
+namespace Env_Cache {
+
+namespace fs = std::filesystem;
+
+// Least recently used entries are removed to keep the cache within this many
+// bytes. An 8192x4096 map takes 800 MB.
+static const uintmax_t max_bytes = uintmax_t(8) << 30;
+
+// Cache files start with this tag and a version number, followed by the key,
+// the image size, and then the pixels, the marginal bins and the conditional
+// bins, each as they are laid out in memory.
+static const char cache_tag[4] = {'S', '3', 'D', 'E'};
+static const uint32_t cache_version = 2;
+static const char *cache_extension = ".envcache";
+
+// The key of each image file that load_image read, as it was before reading
+// it. Tables are only cached under that key, so an image edited while it is
+// loaded never gets tables from the other version.
+static std::mutex loaded_lock;
+static std::unordered_map<std::string, std::string> loaded_keys;
+
+struct Entry {
+    fs::path file;
+    std::string key;
+};
+
+// Where the cache entry for an image file goes, and the key that identifies
+// the current version of the file. The path is empty if either is unknown.
+static Entry entry(const std::string &image_file) {
+
+    std::error_code ec;
+    fs::path source = fs::absolute(image_file, ec);
+    uintmax_t size = ec ? 0 : fs::file_size(source, ec);
+    fs::file_time_type time = ec ? fs::file_time_type{} : fs::last_write_time(source, ec);
+    fs::path dir = ec ? fs::path{} : fs::temp_directory_path(ec) / "scotty3d_env_cache";
+    if (image_file.empty() || ec) return {};
+
+    std::string key = source.string() + "|" + std::to_string(size) + "|" +
+                      std::to_string(time.time_since_epoch().count());
+    std::string name = std::to_string(std::hash<std::string>()(source.string()));
+    return {dir / (name + cache_extension), key};
+}
+
+// Opens an entry and reads its header, leaving in at the pixels
+static std::string open(const Entry &entry, std::ifstream &in, size_t &w, size_t &h) {
+
+    in.open(entry.file, std::ios::binary);
+    if (!in.is_open()) return "Failed to open cache file " + entry.file.string() + "!";
+
+    char tag[4] = {};
+    uint32_t version = 0;
+    in.read(tag, sizeof(tag));
+    in.read((char *)&version, sizeof(version));
+    if (!in || std::memcmp(tag, cache_tag, sizeof(tag)) || version != cache_version) {
+        return "File " + entry.file.string() + " is not a supported cache file!";
+    }
+
+    auto get = [&in](auto value) {
+        in.read((char *)&value, sizeof(value));
+        return value;
+    };
+    uint64_t key_size = get(uint64_t(0));
+    if (!in || key_size != entry.key.size()) {
+        return "Cache file " + entry.file.string() + " is out of date!";
+    }
+    std::string key(key_size, '\0');
+    in.read(key.data(), key.size());
+    if (!in || key != entry.key) return "Cache file " + entry.file.string() + " is out of date!";
+
+    w = (size_t)get(uint64_t(0));
+    h = (size_t)get(uint64_t(0));
+    if (!in) return "Cache file " + entry.file.string() + " is truncated!";
+
+    // The rest of the file must be exactly the pixels and tables, checked
+    // before anything is allocated for them
+    std::error_code ec;
+    uintmax_t rest = fs::file_size(entry.file, ec) - (uintmax_t)in.tellg();
+    uintmax_t pixel = sizeof(Spectrum) + sizeof(Samplers::Alias::Bin);
+    uintmax_t row = w * pixel + sizeof(Samplers::Alias::Bin);
+    if (ec || !w || !h || w > rest / pixel || h > rest / row || h * row != rest) {
+        return "Cache file " + entry.file.string() + " has the wrong size!";
+    }
+    return {};
+}
+
+// Marks an entry as just used
+static void touch(const fs::path &file) {
+    std::error_code ec;
+    fs::last_write_time(file, fs::file_time_type::clock::now(), ec);
+}
+
+// Removes the least recently used entries until bytes more would fit within
+// max_bytes. The entry at replacing doesn't count, as it is about to be
+// overwritten.
+static void evict(const fs::path &dir, const fs::path &replacing, uintmax_t bytes) {
+
+    std::error_code ec;
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    uintmax_t total = bytes;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        const fs::path &file = it->path();
+        if (file.extension() != cache_extension || file == replacing) continue;
+        std::error_code file_ec;
+        uintmax_t size = it->file_size(file_ec);
+        fs::file_time_type time = it->last_write_time(file_ec);
+        if (file_ec) continue;
+        total += size;
+        entries.push_back({time, file});
+    }
+
+    std::sort(entries.begin(), entries.end());
+    for (const auto &[time, file] : entries) {
+        if (total <= max_bytes) break;
+        uintmax_t size = fs::file_size(file, ec);
+        if (!ec && fs::remove(file, ec)) total -= size;
+    }
+}
+
+static std::string write(const Entry &entry, const HDR_Image &image,
+                         const Samplers::Sphere::Image &sampler) {
+
+    auto [w, h] = image.dimension();
+    static_assert(std::is_trivially_copyable_v<Spectrum>);
+    static_assert(std::is_trivially_copyable_v<Samplers::Alias::Bin>);
+    uintmax_t bytes = sizeof(cache_tag) + sizeof(cache_version) + 3 * sizeof(uint64_t) +
+                      entry.key.size() + w * h * sizeof(Spectrum) +
+                      (h + w * h) * sizeof(Samplers::Alias::Bin);
+    if (bytes > max_bytes) return "Image is too large to cache.";
+
+    std::error_code err;
+    fs::create_directories(entry.file.parent_path(), err);
+    if (err) return "Failed to create cache directory: " + err.message();
+    evict(entry.file.parent_path(), entry.file, bytes);
+
+    // Written next to the target and then renamed over it, so that a render
+    // running at the same time never loads a partial file.
+    fs::path temp = entry.file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return "Failed to open cache file " + temp.string() + "!";
+
+        auto put = [&out](auto value) { out.write((const char *)&value, sizeof(value)); };
+        out.write(cache_tag, sizeof(cache_tag));
+        put(cache_version);
+        put((uint64_t)entry.key.size());
+        out.write(entry.key.data(), entry.key.size());
+        put((uint64_t)w);
+        put((uint64_t)h);
+
+        out.write((const char *)image.data(), w * h * sizeof(Spectrum));
+        out.write((const char *)sampler.marginal.bins.data(), h * sizeof(Samplers::Alias::Bin));
+        out.write((const char *)sampler.conditional.data(),
+                  w * h * sizeof(Samplers::Alias::Bin));
+        if (!out) {
+            out.close();
+            fs::remove(temp, err);
+            return "Failed to write cache file " + temp.string() + "!";
+        }
+    }
+
+    fs::rename(temp, entry.file, err);
+    if (err) return "Failed to replace cache file " + entry.file.string() + ": " + err.message();
+    return {};
+}
+
+std::string load_image(const std::string &file, HDR_Image &image) {
+
+    Entry cached = entry(file);
+    if (cached.file.empty()) return image.load_from(file);
+
+    std::ifstream in;
+    size_t w = 0, h = 0;
+    if (open(cached, in, w, h).empty()) {
+        // The whole image is read in one go, straight into place
+        std::vector<Spectrum> pixels(w * h);
+        in.read((char *)pixels.data(), pixels.size() * sizeof(Spectrum));
+        if (in) {
+            image.assign(w, h, std::move(pixels), file);
+            touch(cached.file);
+            std::lock_guard<std::mutex> lock(loaded_lock);
+            loaded_keys[file] = cached.key;
+            return {};
+        }
+    }
+
+    std::string err = image.load_from(file);
+    if (err.empty()) {
+        std::lock_guard<std::mutex> lock(loaded_lock);
+        loaded_keys[file] = cached.key;
+    }
+    return err;
+}
+
+Samplers::Sphere::Image sampler(const HDR_Image &image, Thread_Pool *pool) {
+
+    std::string loaded_key;
+    {
+        std::lock_guard<std::mutex> lock(loaded_lock);
+        auto found = loaded_keys.find(image.loaded_from());
+        if (found != loaded_keys.end()) loaded_key = found->second;
+    }
+    Entry cached = loaded_key.empty() ? Entry{} : entry(image.loaded_from());
+    if (cached.file.empty() || cached.key != loaded_key) {
+        return Samplers::Sphere::Image(image, pool);
+    }
+
+    auto [w, h] = image.dimension();
+    std::ifstream in;
+    size_t cached_w = 0, cached_h = 0;
+    if (open(cached, in, cached_w, cached_h).empty() && cached_w == w && cached_h == h) {
+        Samplers::Sphere::Image ret;
+        ret.w = w;
+        ret.h = h;
+        ret.marginal.bins.resize(h);
+        ret.conditional.resize(w * h);
+        in.seekg(w * h * sizeof(Spectrum), std::ios::cur);
+        in.read((char *)ret.marginal.bins.data(), h * sizeof(Samplers::Alias::Bin));
+        in.read((char *)ret.conditional.data(), w * h * sizeof(Samplers::Alias::Bin));
+        if (in) {
+            touch(cached.file);
+            return ret;
+        }
+    }
+
+    Samplers::Sphere::Image ret(image, pool);
+    if (std::string err = write(cached, image, ret); !err.empty()) {
+        warn("Failed to cache environment map: %s", err.c_str());
+    }
+    return ret;
+}
+
+} // namespace Env_Cache
+} // namespace PT
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+#include "../util/hdr_image.h"
+#include "../util/thread_pool.h"
+
+#include "samplers.h"
+
+namespace PT {
+
+// Environment maps loaded from files are cached in the temporary directory,
+// one file per image path holding the decoded pixels and their importance
+// sampling tables, so that later runs can skip decoding the image and
+// building the tables. An entry is only used if the image file still has the
+// size and modification time it had when the entry was written. The cache is
+// kept under a fixed total size by removing the least recently used entries.
+namespace Env_Cache {
+
+// Loads an image like HDR_Image::load_from, but from the cache if it can
+std::string load_image(const std::string &file, HDR_Image &image);
+
+// Sampling tables for an image, from the cache if they are there, else built
+// (on the pool, if given) and added to the cache along with the image. Only
+// images read with load_image are cached.
+Samplers::Sphere::Image sampler(const HDR_Image &image, Thread_Pool *pool = nullptr);
+
+} // namespace Env_Cache
+} // namespace PT
@@ -36,7 +36,10 @@ struct Env_Sphere {
 
 struct Env_Map {
 
-    Env_Map(HDR_Image &&img) : image(std::move(img)), sampler(image) {}
+    Env_Map(HDR_Image &&img, Thread_Pool *pool = nullptr)
+        : image(std::move(img)), sampler(image, pool) {}
+    Env_Map(HDR_Image &&img, Samplers::Sphere::Image &&sampler)
+        : image(std::move(img)), sampler(std::move(sampler)) {}
 
     Light_Sample sample() const;
     Spectrum sample_direction(Vec3 dir) const;
@@ -3,6 +3,9 @@
 
 namespace PT {
 
+const char *Light_Sampling_Names[(int)Light_Sampling::count] = {"All Lights", "By Power",
+                                                                 "Light Tree"};
+
 Light_Sample Directional_Light::sample(Vec3) const {
     Light_Sample ret;
     ret.direction = Vec3(0.0f, -1.0f, 0.0f);
@@ -21,6 +24,8 @@ Light_Sample Point_Light::sample(Vec3 from) const {
     return ret;
 }
 
+float Point_Light::power() const { return 4.0f * PI_F * radiance.luma(); }
+
 Light_Sample Spot_Light::sample(Vec3 from) const {
     Light_Sample ret;
     float angle = std::atan2(Vec2(from.x, from.z).norm(), from.y);
@@ -33,6 +38,12 @@ Light_Sample Spot_Light::sample(Vec3 from) const {
     return ret;
 }
 
+float Spot_Light::power() const {
+    // Solid angle of the cone out to the outer edge of the falloff
+    float cos_outer = std::cos(Radians(angle_bounds.y / 2.0f));
+    return 2.0f * PI_F * (1.0f - cos_outer) * radiance.luma();
+}
+
 Light_Sample Rect_Light::sample(Vec3 from) const {
     Light_Sample ret;
 
@@ -51,4 +62,191 @@ Light_Sample Rect_Light::sample(Vec3 from) const {
     return ret;
 }
 
+float Rect_Light::power(Vec2 scale) const {
+    return PI_F * size.x * scale.x * size.y * scale.y * radiance.luma();
+}
+
+std::optional<Light_Bounds> Light::bounds() const {
+
+    Light_Bounds ret;
+    Vec3 y = trans.rotate(Vec3(0.0f, 1.0f, 0.0f)).unit();
+
+    bool finite = std::visit(
+        overloaded{[](const Directional_Light &) { return false; },
+                   [&](const Point_Light &l) {
+                       ret.box.enclose(trans * Vec3(0.0f));
+                       ret.intensity = l.radiance.luma();
+                       ret.axis = y;
+                       ret.cos_theta_o = -1.0f;
+                       ret.cos_theta_e = 0.0f;
+                       return true;
+                   },
+                   [&](const Spot_Light &l) {
+                       // Spot lights shine along their y axis
+                       ret.box.enclose(trans * Vec3(0.0f));
+                       ret.intensity = l.radiance.luma();
+                       ret.axis = y;
+                       ret.cos_theta_o = 1.0f;
+                       ret.cos_theta_e = std::cos(Radians(l.angle_bounds.y / 2.0f));
+                       return true;
+                   },
+                   [&](const Rect_Light &l) {
+                       // Rect lights face down their y axis
+                       for (float x : {-0.5f, 0.5f}) {
+                           for (float z : {-0.5f, 0.5f}) {
+                               ret.box.enclose(trans * Vec3(x * l.size.x, 0.0f, z * l.size.y));
+                           }
+                       }
+                       ret.power = power(0.0f);
+                       ret.axis = -y;
+                       ret.cos_theta_o = 1.0f;
+                       ret.cos_theta_e = 0.0f;
+                       return true;
+                   }},
+        underlying);
+
+    if (!finite) return std::nullopt;
+    ret.prepare();
+    return ret;
+}
+
+// Rotates v by the given angle around a unit axis (Rodrigues' formula)
+static Vec3 rotate_around(Vec3 v, Vec3 axis, float angle) {
+    float c = std::cos(angle), s = std::sin(angle);
+    return v * c + cross(axis, v) * s + axis * dot(axis, v) * (1.0f - c);
+}
+
+void Light_Bounds::enclose(const Light_Bounds &other) {
+
+    if (box.empty()) {
+        *this = other;
+        return;
+    }
+    if (other.box.empty()) return;
+
+    box.enclose(other.box);
+    power += other.power;
+    intensity += other.intensity;
+    cos_theta_e = std::min(cos_theta_e, other.cos_theta_e);
+    enclose_cone(other.axis, other.cos_theta_o);
+    prepare();
+}
+
+void Light_Bounds::enclose_cone(Vec3 other_axis, float other_cos_theta_o) {
+
+    // Smallest cone around both cones of emitted directions, as in PBRT (4th
+    // ed.), section 12.6.3.
+    float theta_a = std::acos(clamp(cos_theta_o, -1.0f, 1.0f));
+    float theta_b = std::acos(clamp(other_cos_theta_o, -1.0f, 1.0f));
+    float theta_d = std::acos(clamp(dot(axis, other_axis), -1.0f, 1.0f));
+
+    if (std::min(theta_d + theta_b, PI_F) <= theta_a) return;
+    if (std::min(theta_d + theta_a, PI_F) <= theta_b) {
+        axis = other_axis;
+        cos_theta_o = other_cos_theta_o;
+        return;
+    }
+
+    float theta_o = (theta_a + theta_d + theta_b) / 2.0f;
+    Vec3 wr = cross(axis, other_axis);
+    if (theta_o >= PI_F || wr.norm_squared() == 0.0f) {
+        cos_theta_o = -1.0f;
+        return;
+    }
+    axis = rotate_around(axis, wr.unit(), theta_o - theta_a).unit();
+    cos_theta_o = std::cos(theta_o);
+}
+
+void Light_Bounds::prepare() {
+
+    sin_theta_o = std::sqrt(std::max(0.0f, 1.0f - cos_theta_o * cos_theta_o));
+
+    // Of lights shining within less than a hemisphere, only those in a disc
+    // around a point, as seen along the axis, can reach it. The disc's radius
+    // is the distance along the axis times tan(theta_o + theta_e).
+    float sin_theta_e = std::sqrt(std::max(0.0f, 1.0f - cos_theta_e * cos_theta_e));
+    float cos_theta = cos_theta_o * cos_theta_e - sin_theta_o * sin_theta_e;
+    float sin_theta = sin_theta_o * cos_theta_e + cos_theta_o * sin_theta_e;
+    tan_theta_r = cos_theta > 0.0f && sin_theta > 0.0f ? sin_theta / cos_theta : -1.0f;
+
+    // The box seen along the axis is a hexagon
+    Vec3 e = box.max - box.min;
+    area = perimeter = 0.0f;
+    for (int i = 0; i < 3; i++) {
+        float a = std::abs(axis[i]);
+        area += a * e[(i + 1) % 3] * e[(i + 2) % 3];
+        perimeter += 2.0f * e[i] * std::sqrt(std::max(0.0f, 1.0f - a * a));
+    }
+}
+
+float Light_Bounds::reach(Vec3 point) const {
+
+    // Lights all in one place, or shining on at least a hemisphere
+    if (area <= 0.0f && perimeter <= 0.0f) return 1.0f;
+    if (tan_theta_r <= 0.0f) return 1.0f;
+    float h = dot(axis, point - box.center());
+    if (h <= 0.0f) return 1.0f;
+
+    // The fraction of the hexagon covered by the disc, assuming the lights
+    // are spread evenly over it. The hexagon grown by r has area A + P r +
+    // pi r^2 (Steiner's formula).
+    float r = h * tan_theta_r;
+    float disc = PI_F * r * r;
+    return disc / (area + perimeter * r + disc);
+}
+
+float Light_Bounds::importance(Vec3 point, Vec3 n) const {
+
+    if (power <= 0.0f && intensity <= 0.0f) return 0.0f;
+
+    // Distance to the box, clamped to its bounding sphere so that nearby
+    // lights don't blow up
+    float d2 = std::max((point - box.center()).norm_squared(),
+                        (box.max - box.min).norm_squared() / 4.0f);
+
+    // Bounds on the angle between v and the direction from any point in the
+    // box to the point come from the largest projection onto v, over the
+    // smallest distance (or, if every projection is negative, over the
+    // largest). Unlike a bounding sphere, this stays tight for flat boxes,
+    // like a row of lamps, and for points close to or inside the box.
+    Vec3 nearest;
+    for (int i = 0; i < 3; i++) nearest[i] = clamp(point[i], box.min[i], box.max[i]);
+    float near = (point - nearest).norm();
+    auto most = [&](Vec3 v) {
+        float ret = dot(v, point);
+        for (int i = 0; i < 3; i++) ret -= v[i] * (v[i] > 0.0f ? box.min[i] : box.max[i]);
+        return ret;
+    };
+    auto max_cos = [&](float most) {
+        if (most >= 0.0f) return most < near ? most / near : 1.0f;
+        Vec3 farthest;
+        for (int i = 0; i < 3; i++) {
+            farthest[i] = point[i] - box.min[i] > box.max[i] - point[i] ? box.min[i] : box.max[i];
+        }
+        return std::max(most / (point - farthest).norm(), -1.0f);
+    };
+
+    // cos(max(0, a - b)), given sines and cosines
+    auto cos_sub = [](float sin_a, float cos_a, float sin_b, float cos_b) {
+        return cos_a > cos_b ? 1.0f : cos_a * cos_b + sin_a * sin_b;
+    };
+    auto sin_of = [](float cos) { return std::sqrt(std::max(0.0f, 1.0f - cos * cos)); };
+
+    // Smallest angle between an emitted direction and the direction to the
+    // point: the smallest angle to the axis, less the spread of the axes
+    float cos_theta_x = max_cos(most(axis));
+    float cos_theta_p =
+        cos_sub(sin_of(cos_theta_x), cos_theta_x, sin_theta_o, cos_theta_o);
+    if (cos_theta_p <= cos_theta_e) return 0.0f;
+
+    float result = power / d2;
+    if (intensity > 0.0f) result += intensity * reach(point);
+    result *= cos_theta_p;
+
+    // Same for the incident angle at the point, from either side; one of the
+    // two projections is never negative
+    if (n.norm_squared() > 0.0f) result *= max_cos(std::max(most(n), most(-n)));
+    return std::max(result, 0.0f);
+}
+
 } // namespace PT
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <optional>
 #include <variant>
 
 #include "../lib/mathlib.h"
@@ -12,6 +13,45 @@
 
 namespace PT {
 
+// How lights are picked for direct lighting at each shading point. Sampling
+// all of them is the least noisy, but costs a shadow ray per light; on the
+// street scene in bench_lights, picking one with the tree only wins at equal
+// time from about two thousand lights on.
+enum class Light_Sampling : int { all, power, tree, count };
+extern const char *Light_Sampling_Names[(int)Light_Sampling::count];
+
+// Bounds on the light emitted by a set of lights: where it comes from, how
+// much there is, and in which directions it goes. Every light emits within
+// theta_e of some direction that is within theta_o of the axis. Point and
+// spot lights don't fall off with distance, so rather than power they count
+// the intensity they give any point they reach.
+struct Light_Bounds {
+
+    BBox box;
+    Vec3 axis;
+    float cos_theta_o = 1.0f, cos_theta_e = 1.0f;
+    float power = 0.0f, intensity = 0.0f;
+
+    // Derived from the above by prepare(), which enclose() calls, so that
+    // importance() doesn't work them out again for every point: the sine of
+    // theta_o, tan(theta_o + theta_e) (or -1 unless that is strictly between
+    // 0 and a right angle), and the area and perimeter of the box seen along
+    // the axis.
+    float sin_theta_o = 0.0f, tan_theta_r = -1.0f, area = 0.0f, perimeter = 0.0f;
+
+    void enclose(const Light_Bounds &other);
+    void prepare();
+    // An estimate of how much of this light reaches a point with unit normal
+    // n (or zero, to leave the normal out). Conservative: it is only zero if
+    // none of the light can reach the point.
+    float importance(Vec3 point, Vec3 n) const;
+    // Roughly what fraction of the lights can reach the point
+    float reach(Vec3 point) const;
+
+private:
+    void enclose_cone(Vec3 other_axis, float other_cos_theta_o);
+};
+
 struct Light_Sample {
 
     Spectrum radiance;
@@ -37,6 +77,7 @@ struct Point_Light {
     Point_Light(Spectrum r) : radiance(r), sampler(Vec3(0.0f)) {}
 
     Light_Sample sample(Vec3 from) const;
+    float power() const;
 
     Spectrum radiance;
     Samplers::Point sampler;
@@ -47,6 +88,7 @@ struct Spot_Light {
     Spot_Light(Spectrum r, Vec2 a) : radiance(r), angle_bounds(a), sampler(Vec3(0.0f)) {}
 
     Light_Sample sample(Vec3 from) const;
+    float power() const;
 
     Spectrum radiance;
     Vec2 angle_bounds;
@@ -58,6 +100,7 @@ struct Rect_Light {
     Rect_Light(Spectrum r, Vec2 s) : radiance(r), size(s), sampler(size) {}
 
     Light_Sample sample(Vec3 from) const;
+    float power(Vec2 scale) const;
 
     Spectrum radiance;
     Vec2 size;
@@ -106,6 +149,27 @@ public:
                           underlying);
     }
 
+    // Estimate of the total power the light emits, used to decide how often
+    // to sample it. Directional lights are taken to cover a disk as wide as
+    // the scene.
+    float power(float scene_radius) const {
+        return std::visit(
+            overloaded{[&](const Directional_Light &l) {
+                           return PI_F * scene_radius * scene_radius * l.radiance.luma();
+                       },
+                       [](const Point_Light &l) { return l.power(); },
+                       [](const Spot_Light &l) { return l.power(); },
+                       [&](const Rect_Light &l) {
+                           return l.power(Vec2(trans.rotate(Vec3(1.0f, 0.0f, 0.0f)).norm(),
+                                               trans.rotate(Vec3(0.0f, 0.0f, 1.0f)).norm()));
+                       }},
+            underlying);
+    }
+
+    // Bounds for the light tree. Directional lights are infinitely far away,
+    // so they have none.
+    std::optional<Light_Bounds> bounds() const;
+
     Scene_ID id() const { return _id; }
     void set_trans(const Mat4 &T) {
         trans = T;
@@ -0,0 +1,213 @@
+
+
+#include "light_tree.h"
+#include "../util/rand.h"
+
+#include <algorithm>
+
+namespace PT {
+
+// Number of buckets the lights are sorted into along each axis when splitting
+static const int n_buckets = 12;
+
+// Area lights fall off with distance, point and spot lights don't, and point
+// lights shine every way while spot lights shine in a cone
+static int kind_of(const Light_Bounds &bounds) {
+    if (bounds.power > 0.0f) return 0;
+    return bounds.cos_theta_o < 0.0f ? 1 : 2;
+}
+
+// The cost of a node in the surface area orientation heuristic, from Conty
+// Estevez and Kulla, as in PBRT (4th ed.), section 12.6.3
+static float split_cost(const Light_Bounds &bounds) {
+    float theta_o = std::acos(clamp(bounds.cos_theta_o, -1.0f, 1.0f));
+    float theta_e = std::acos(clamp(bounds.cos_theta_e, -1.0f, 1.0f));
+    float theta_w = std::min(theta_o + theta_e, PI_F);
+    float sin_theta_o = std::sin(theta_o);
+    float m_omega = 2.0f * PI_F * (1.0f - bounds.cos_theta_o) +
+                    PI_F / 2.0f *
+                        (2.0f * theta_w * sin_theta_o - std::cos(theta_o - 2.0f * theta_w) -
+                         2.0f * theta_o * sin_theta_o + bounds.cos_theta_o);
+    return (bounds.power + bounds.intensity) * m_omega * bounds.box.surface_area();
+}
+
+void Light_Tree::Kind_Bounds::enclose(const Light_Bounds &bounds) {
+    kinds[kind_of(bounds)].enclose(bounds);
+}
+
+void Light_Tree::Kind_Bounds::enclose(const Kind_Bounds &other) {
+    for (int k = 0; k < count; k++) kinds[k].enclose(other.kinds[k]);
+}
+
+bool Light_Tree::Kind_Bounds::empty() const {
+    for (const Light_Bounds &kind : kinds) {
+        if (!kind.box.empty()) return false;
+    }
+    return true;
+}
+
+float Light_Tree::Kind_Bounds::split_cost() const {
+    float cost = 0.0f;
+    for (const Light_Bounds &kind : kinds) {
+        if (!kind.box.empty()) cost += PT::split_cost(kind);
+    }
+    return cost;
+}
+
+float Light_Tree::Kind_Bounds::importance(Vec3 point, Vec3 n) const {
+    float sum = 0.0f;
+    for (const Light_Bounds &kind : kinds) {
+        if (!kind.box.empty()) sum += kind.importance(point, n);
+    }
+    return sum;
+}
+
+Light_Tree::Light_Tree(const std::vector<Light> &lights) { build(lights); }
+
+void Light_Tree::clear() {
+    nodes.clear();
+    infinite.clear();
+}
+
+void Light_Tree::build(const std::vector<Light> &lights) {
+
+    clear();
+
+    std::vector<Item> items;
+    for (size_t i = 0; i < lights.size(); i++) {
+        if (auto bounds = lights[i].bounds()) {
+            items.push_back({bounds.value(), (unsigned int)i});
+        } else {
+            infinite.push_back((unsigned int)i);
+        }
+    }
+
+    if (!items.empty()) {
+        nodes.reserve(2 * items.size() - 1);
+        recursive_build(items, 0, items.size());
+    }
+}
+
+unsigned int Light_Tree::recursive_build(std::vector<Item> &items, size_t begin, size_t end) {
+
+    unsigned int idx = (unsigned int)nodes.size();
+    nodes.emplace_back();
+
+    if (end - begin == 1) {
+        nodes[idx].bounds.enclose(items[begin].bounds);
+        nodes[idx].index = items[begin].light;
+        nodes[idx].leaf = true;
+        return idx;
+    }
+
+    size_t mid = split(items, begin, end);
+    unsigned int l = recursive_build(items, begin, mid);
+    unsigned int r = recursive_build(items, mid, end);
+
+    Kind_Bounds bounds = nodes[l].bounds;
+    bounds.enclose(nodes[r].bounds);
+    nodes[idx].bounds = bounds;
+    nodes[idx].index = r;
+    nodes[idx].leaf = false;
+    return idx;
+}
+
+size_t Light_Tree::split(std::vector<Item> &items, size_t begin, size_t end) {
+
+    // Split with the surface area orientation heuristic: the cost of a node
+    // grows with its power, its surface area and the solid angle of its cone
+    // of emitted directions, so lights that shine different ways are kept
+    // apart as well as lights that are far apart.
+    BBox centers;
+    for (size_t i = begin; i < end; i++) centers.enclose(items[i].bounds.box.center());
+    Vec3 extent = centers.max - centers.min;
+    float max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+
+    auto bucket_of = [&](const Item &item, int axis) {
+        float t = (item.bounds.box.center()[axis] - centers.min[axis]) / extent[axis];
+        return std::min((int)(t * n_buckets), n_buckets - 1);
+    };
+
+    float best_cost = FLT_MAX;
+    int best_axis = 0, best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.0f) continue;
+
+        Kind_Bounds buckets[n_buckets];
+        for (size_t i = begin; i < end; i++) {
+            buckets[bucket_of(items[i], axis)].enclose(items[i].bounds);
+        }
+
+        // Bounds of buckets [b, n_buckets)
+        Kind_Bounds right[n_buckets];
+        for (int b = n_buckets - 1; b > 0; b--) {
+            right[b] = buckets[b];
+            if (b + 1 < n_buckets) right[b].enclose(right[b + 1]);
+        }
+
+        // Thin slices are penalized, as splitting across them does little
+        Kind_Bounds left;
+        for (int b = 1; b < n_buckets; b++) {
+            left.enclose(buckets[b - 1]);
+            if (left.empty() || right[b].empty()) continue;
+            float cost = (max_extent / extent[axis]) * (left.split_cost() + right[b].split_cost());
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    // All centers coincide, so split the lights in half
+    if (best_cost == FLT_MAX) return begin + (end - begin) / 2;
+
+    auto goes_left = [&](const Item &item) { return bucket_of(item, best_axis) < best_split; };
+    return std::partition(items.begin() + begin, items.begin() + end, goes_left) - items.begin();
+}
+
+bool Light_Tree::sample(Vec3 point, Vec3 n, size_t &light, float &pmf) const {
+
+    // The tree as a whole counts as one more light next to the infinite ones
+    float p_infinite = (float)infinite.size() / (infinite.size() + !nodes.empty());
+    float u = RNG::unit();
+
+    if (u < p_infinite) {
+        size_t i = std::min((size_t)(u / p_infinite * infinite.size()), infinite.size() - 1);
+        light = infinite[i];
+        pmf = p_infinite / infinite.size();
+        return true;
+    }
+    if (nodes.empty()) return false;
+
+    // The same random number is rescaled at each level to pick a child
+    u = std::min((u - p_infinite) / (1.0f - p_infinite), 1.0f - FLT_EPSILON);
+    pmf = 1.0f - p_infinite;
+
+    if (n.norm_squared() > 0.0f) n = n.unit();
+
+    size_t idx = 0;
+    while (!nodes[idx].leaf) {
+
+        size_t l = idx + 1, r = nodes[idx].index;
+        float i_l = nodes[l].bounds.importance(point, n);
+        float i_r = nodes[r].bounds.importance(point, n);
+        if (i_l <= 0.0f && i_r <= 0.0f) return false;
+
+        float p_l = i_l / (i_l + i_r);
+        if (u < p_l) {
+            idx = l;
+            pmf *= p_l;
+            u = std::min(u / p_l, 1.0f - FLT_EPSILON);
+        } else {
+            idx = r;
+            pmf *= 1.0f - p_l;
+            u = std::min((u - p_l) / (1.0f - p_l), 1.0f - FLT_EPSILON);
+        }
+    }
+
+    light = nodes[idx].index;
+    return true;
+}
+
+} // namespace PT
@@ -0,0 +1,67 @@
+
+#pragma once
+
+#include "../lib/mathlib.h"
+
+#include "light.h"
+
+namespace PT {
+
+// A bounding volume hierarchy over lights, used to pick lights in proportion
+// to how much they are likely to contribute at a given shading point, as in
+// Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive
+// Tree Splitting" (2018). Each node bounds the position, power and emitted
+// directions of the lights below it; sampling walks down from the root,
+// choosing a child at random in proportion to its importance.
+class Light_Tree {
+public:
+    Light_Tree() = default;
+    Light_Tree(const std::vector<Light> &lights);
+
+    void build(const std::vector<Light> &lights);
+    void clear();
+
+    // Picks one of the lights for a point with normal n, and the probability
+    // of having picked it. Returns false when no light can reach the point.
+    bool sample(Vec3 point, Vec3 n, size_t &light, float &pmf) const;
+
+private:
+    struct Item {
+        Light_Bounds bounds;
+        unsigned int light;
+    };
+
+    // Bounds on area lights, point lights and spot lights, kept apart as
+    // bounds around lights of more than one kind describe none of them well
+    struct Kind_Bounds {
+        static const int count = 3;
+        Light_Bounds kinds[count];
+
+        void enclose(const Light_Bounds &bounds);
+        void enclose(const Kind_Bounds &other);
+        bool empty() const;
+        float importance(Vec3 point, Vec3 n) const;
+        // Cost of a node with these bounds, for choosing where to split
+        float split_cost() const;
+    };
+
+    class Node {
+        Kind_Bounds bounds;
+        // Leaves hold a light; the left child of an inner node is always the
+        // node right after it, so only the right child is stored.
+        unsigned int index;
+        bool leaf;
+
+        friend class Light_Tree;
+    };
+
+    unsigned int recursive_build(std::vector<Item> &items, size_t begin, size_t end);
+    // Partitions items [begin, end) in two, returning where the second half starts
+    static size_t split(std::vector<Item> &items, size_t begin, size_t end);
+
+    std::vector<Node> nodes;
+    // Lights without bounds (directional lights), which are picked uniformly
+    std::vector<unsigned int> infinite;
+};
+
+} // namespace PT
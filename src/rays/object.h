@@ -3,6 +3,7 @@
 
 #include "../lib/mathlib.h"
 #include "../scene/object.h"
+#include <memory>
 #include <variant>
 
 #include "bvh.h"
@@ -20,6 +21,13 @@ public:
         has_trans = trans != Mat4::I;
     }
     Object(Tri_Mesh &&tri_mesh, Scene_ID id, unsigned int m = 0, const Mat4 &T = Mat4::I)
+        : trans(T), itrans(T.inverse()), _id(id), material(m),
+          underlying(std::make_shared<const Tri_Mesh>(std::move(tri_mesh))) {
+        has_trans = trans != Mat4::I;
+    }
+    // An instance of a mesh that may be shared with other objects
+    Object(std::shared_ptr<const Tri_Mesh> tri_mesh, Scene_ID id, unsigned int m = 0,
+           const Mat4 &T = Mat4::I)
         : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(tri_mesh)) {
         has_trans = trans != Mat4::I;
     }
@@ -38,31 +46,49 @@ public:
     Object(Object &&src) = default;
 
     BBox bbox() const {
-        BBox box = std::visit(overloaded{[](const auto &o) { return o.bbox(); }}, underlying);
+        BBox box = std::visit(overloaded{[](const Mesh_Ref &mesh) { return mesh->bbox(); },
+                                         [](const auto &o) { return o.bbox(); }},
+                              underlying);
         if (has_trans)
             box.transform(trans);
         return box;
     }
 
     Trace hit(Ray ray) const {
-        if (has_trans)
+        if (has_trans) {
             ray.transform(itrans);
-        Trace ret =
-            std::visit(overloaded{[&ray](const auto &o) { return o.hit(ray); }}, underlying);
+            COUNT_TRAVERSAL(transforms, 1);
+        }
+        Trace ret = std::visit(overloaded{[&ray](const Mesh_Ref &mesh) { return mesh->hit(ray); },
+                                          [&ray](const auto &o) { return o.hit(ray); }},
+                               underlying);
         if (ret.hit) {
             ret.material = material;
-            if (has_trans)
+            if (has_trans) {
                 ret.transform(trans, itrans.T());
+                COUNT_TRAVERSAL(transforms, 1);
+            }
         }
         return ret;
     }
 
+    bool occluded(Ray ray) const {
+        if (has_trans) {
+            ray.transform(itrans);
+            COUNT_TRAVERSAL(transforms, 1);
+        }
+        return std::visit(
+            overloaded{[&ray](const Mesh_Ref &mesh) { return mesh->occluded(ray); },
+                       [&ray](const auto &o) { return o.occluded(ray); }},
+            underlying);
+    }
+
     size_t visualize(GL::Lines &lines, GL::Lines &active, size_t level, const Mat4 &vtrans) const {
         Mat4 next = has_trans ? vtrans * trans : vtrans;
         return std::visit(
             overloaded{
                 [&](const BVH<Object> &bvh) { return bvh.visualize(lines, active, level, next); },
-                [&](const Tri_Mesh &mesh) { return mesh.visualize(lines, active, level, next); },
+                [&](const Mesh_Ref &mesh) { return mesh->visualize(lines, active, level, next); },
                 [](const auto &) { return size_t(0); }},
             underlying);
     }
@@ -75,11 +101,13 @@ public:
     }
 
 private:
+    using Mesh_Ref = std::shared_ptr<const Tri_Mesh>;
+
     bool has_trans;
     Mat4 trans, itrans;
     unsigned int material;
     Scene_ID _id;
-    std::variant<Tri_Mesh, Shape, BVH<Object>, List<Object>> underlying;
+    std::variant<Mesh_Ref, Shape, BVH<Object>, List<Object>> underlying;
 };
 
 } // namespace PT
\ No newline at end of file
@@ -2,23 +2,96 @@
 #include "pathtracer.h"
 #include "../geometry/util.h"
 #include "../gui/render.h"
+#include "../util/exr.h"
+#include "denoiser.h"
+#include "env_cache.h"
 
 #include <SDL2/SDL.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <thread>
 
 namespace PT {
 
+const char *AOV_Names[(int)AOV::count] = {"depth", "normal", "albedo", "samples", "variance"};
+const char *BVH_Layout_Names[(int)BVH_Layout::count] = {"Binary", "4-Wide"};
+
+thread_local Pathtracer::Ray_Counts Pathtracer::ray_counts;
+
+// Tiles are square and at most this many pixels wide
+static const size_t tile_size = 32;
+// Samples are split into at most this many passes over the image, so that the
+// render refines progressively instead of finishing tile by tile.
+static const size_t max_passes = 16;
+// With adaptive sampling, a pixel may take at most this many times its even
+// share of a pass, so that a few very noisy pixels can't eat a whole tile.
+static const size_t max_boost = 8;
+// Added to a pixel's brightness when computing its relative error, so that
+// nearly black pixels don't keep sampling forever.
+static const float noise_floor = 0.001f;
+
+// Content hash of a mesh's geometry, used to find objects that can share one
+// Tri_Mesh. Vertex ids are left out, as they differ between copies.
+static size_t mesh_hash(const GL::Mesh &mesh) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto mix = [&h](uint32_t word) { h = (h ^ word) * 0x100000001b3ull; };
+    auto mix_vec = [&mix](Vec3 v) {
+        for (int i = 0; i < 3; i++) {
+            uint32_t word;
+            std::memcpy(&word, &v[i], sizeof(word));
+            mix(word);
+        }
+    };
+    mix((uint32_t)mesh.verts().size());
+    for (const GL::Mesh::Vert &v : mesh.verts()) {
+        mix_vec(v.pos);
+        mix_vec(v.norm);
+    }
+    for (GL::Mesh::Index i : mesh.indices()) mix(i);
+    return (size_t)h;
+}
+
+// Whether two meshes with the same hash really have the same geometry
+static bool same_mesh(const GL::Mesh &a, const GL::Mesh &b) {
+    if (&a == &b) return true;
+    if (a.verts().size() != b.verts().size() || a.indices() != b.indices()) return false;
+    for (size_t i = 0; i < a.verts().size(); i++) {
+        const GL::Mesh::Vert &va = a.verts()[i], &vb = b.verts()[i];
+        if (va.pos != vb.pos || va.norm != vb.norm) return false;
+    }
+    return true;
+}
+
 Pathtracer::Pathtracer(Gui::Widget_Render &gui, Vec2 screen_dim)
-    : thread_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim) {
-    accumulator_samples = 0;
-    total_epochs = 0;
-    completed_epochs = 0;
+    : thread_pool(std::thread::hardware_concurrency()), render_group(thread_pool), gui(gui),
+      camera(screen_dim) {
+    next_tile = 0;
+    completed_tiles = 0;
+    total_passes = 0;
+    completed_passes = 0;
+    primary_rays = secondary_rays = shadow_rays = 0;
+    reset_traversal_totals();
     out_w = out_h = 0;
     n_samples = 0;
     n_area_samples = 0;
+    n_light_samples = 0;
+    light_mode = Light_Sampling::all;
+    sequence = RNG::Sequence::random;
+    frame = 0;
+    samples_per_pass = 0;
+    n_passes = 0;
+    region_pixels = 0;
+    noise_target = 0.0f;
+    adaptive_warmup = 0;
+    traced_samples = 0;
 }
 
-Pathtracer::~Pathtracer() { thread_pool.stop(); }
+Pathtracer::~Pathtracer() {
+    render_group.cancel();
+    render_group.wait();
+    thread_pool.stop();
+}
 
 void Pathtracer::build_lights(Scene &layout_scene, std::vector<Object> &objs) {
 
@@ -37,7 +110,9 @@ void Pathtracer::build_lights(Scene &layout_scene, std::vector<Object> &objs) {
             } break;
             case Light_Type::sphere: {
                 if (light.opt.has_emissive_map) {
-                    env_light = Env_Light(Env_Map(light.emissive_copy()));
+                    HDR_Image image = light.emissive_copy();
+                    Samplers::Sphere::Image sampler = Env_Cache::sampler(image, &thread_pool);
+                    env_light = Env_Light(Env_Map(std::move(image), std::move(sampler)));
                 } else {
                     env_light = Env_Light(Env_Sphere(r));
                 }
@@ -75,6 +150,17 @@ void Pathtracer::build_lights(Scene &layout_scene, std::vector<Object> &objs) {
             }
         }
     });
+
+    // Lights are picked in proportion to their power, so the scene's size is
+    // needed to give directional lights a comparable power.
+    BBox bounds;
+    for (const Object &obj : objs) bounds.enclose(obj.bbox());
+    float radius = bounds.empty() ? 1.0f : (bounds.max - bounds.min).norm() / 2.0f;
+
+    std::vector<float> power;
+    for (const Light &light : lights) power.push_back(light.power(radius));
+    light_select = Samplers::Alias(power);
+    light_tree.build(lights);
 }
 
 void Pathtracer::build_scene(Scene &layout_scene) {
@@ -87,13 +173,25 @@ void Pathtracer::build_scene(Scene &layout_scene) {
     // of a deal, as BVH building should take at most a few seconds
     // even with many big meshes.
 
-    // We could also do instancing instead of duplicating the bvh
-    // for big meshes, but that's something to add in the future
+    // Objects with the same mesh contents share one Tri_Mesh (and its BVH),
+    // so many copies of a mesh only cost one BVH plus a transform each.
+    // Meshes are found by content hash, and the contents are compared before
+    // one is shared. Meshes also outlive the build: objects whose mesh
+    // generation hasn't changed since the last build keep the mesh they used
+    // then, and meshes that are still in use aren't rebuilt.
+    struct Instance {
+        Scene_Object *obj;
+        unsigned int material;
+        size_t hash;
+        std::shared_ptr<Tri_Mesh> mesh;
+    };
 
     // Yeah this could just be a list of futures but future wanted a
     // default constructor for Object so whatever
     std::mutex obj_mut;
     std::vector<Object> obj_list;
+    std::vector<Instance> instances;
+    Task_Group build_group(thread_pool);
     materials.clear();
     mat_cache.clear();
 
@@ -124,133 +222,955 @@ void Pathtracer::build_scene(Scene &layout_scene) {
                 return;
             }
 
-            thread_pool.enqueue([&, idx]() {
-                if (obj.is_shape()) {
-                    Shape shape(obj.opt.shape);
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        Object(std::move(shape), obj.id(), idx, obj.pose.transform()));
-                } else {
-                    Tri_Mesh mesh(obj.posed_mesh());
-                    std::lock_guard<std::mutex> lock(obj_mut);
-                    obj_list.push_back(
-                        Object(std::move(mesh), obj.id(), idx, obj.pose.transform()));
-                }
+            if (!obj.is_shape()) {
+                instances.push_back({&obj, idx, 0, nullptr});
+                return;
+            }
+
+            build_group.run([&, idx]() {
+                Shape shape(obj.opt.shape);
+                std::lock_guard<std::mutex> lock(obj_mut);
+                obj_list.push_back(Object(std::move(shape), obj.id(), idx, obj.pose.transform()));
             });
         }
     });
 
-    thread_pool.wait();
+    if (mesh_layout != bvh_layout) {
+        mesh_cache.clear();
+        mesh_instances.clear();
+        mesh_layout = bvh_layout;
+    }
+    std::unordered_map<Scene_ID, Mesh_Entry> next_cache;
+    for (Instance &inst : instances) {
+        auto entry = mesh_cache.find(inst.obj->id());
+        if (entry != mesh_cache.end() && entry->second.generation == inst.obj->mesh_generation()) {
+            inst.hash = entry->second.hash;
+            inst.mesh = entry->second.mesh;
+        } else {
+            build_group.run([&inst]() { inst.hash = mesh_hash(inst.obj->posed_mesh()); });
+        }
+    }
+    build_group.wait();
+
+    // Each new mesh is built on the pool
+    struct Mesh_Build {
+        Tri_Mesh *mesh;
+        Scene_Object *obj;
+    };
+    std::vector<Mesh_Build> builds;
+    std::unordered_map<const Tri_Mesh *, size_t> built;
+    // The meshes used by this build, each with the geometry of an object
+    // that uses it to compare against
+    struct Shared_Mesh {
+        std::shared_ptr<Tri_Mesh> mesh;
+        const GL::Mesh *source;
+    };
+    std::unordered_multimap<size_t, Shared_Mesh> next_meshes;
+    mesh_bvhs.clear();
+    for (Instance &inst : instances) {
+        const GL::Mesh &posed = inst.obj->posed_mesh();
+        auto [first, last] = next_meshes.equal_range(inst.hash);
+        auto shared = std::find_if(first, last, [&](const auto &entry) {
+            return inst.mesh ? entry.second.mesh == inst.mesh
+                             : same_mesh(*entry.second.source, posed);
+        });
+        if (shared != last) {
+            inst.mesh = shared->second.mesh;
+        } else {
+            if (!inst.mesh) {
+                auto [prev_first, prev_last] = mesh_instances.equal_range(inst.hash);
+                auto prev = std::find_if(prev_first, prev_last, [&](const auto &entry) {
+                    return entry.second->matches(posed);
+                });
+                if (prev != prev_last) inst.mesh = prev->second;
+            }
+            if (!inst.mesh) {
+                inst.mesh = std::make_shared<Tri_Mesh>();
+                built[inst.mesh.get()] = builds.size();
+                builds.push_back({inst.mesh.get(), inst.obj});
+                mesh_bvhs.push_back({inst.obj->opt.name});
+            }
+            next_meshes.emplace(inst.hash, Shared_Mesh{inst.mesh, &posed});
+        }
+        next_cache[inst.obj->id()] = {inst.obj->mesh_generation(), inst.hash, inst.mesh};
+    }
+    for (Instance &inst : instances) {
+        auto entry = built.find(inst.mesh.get());
+        if (entry != built.end()) mesh_bvhs[entry->second].instances++;
+    }
+    Uint64 mesh_start = SDL_GetPerformanceCounter();
+    std::vector<Work_Timer> timers(builds.size());
+    for (size_t i = 0; i < builds.size(); i++) {
+        build_group.run([this, i, build = builds[i], timer = &timers[i]]() {
+            Work_Timer::Scope scope(timer);
+            const GL::Mesh &posed = build.obj->posed_mesh();
+            build.mesh->build(posed, bvh_layout, &thread_pool);
+            mesh_bvhs[i].triangles = posed.indices().size() / 3;
+        });
+    }
+    build_group.wait();
+    mesh_bvh_time = SDL_GetPerformanceCounter() - mesh_start;
+    for (size_t i = 0; i < builds.size(); i++) {
+        mesh_bvhs[i].build_seconds = (float)timers[i].seconds();
+    }
+
+    for (Instance &inst : instances) {
+        obj_list.push_back(
+            Object(inst.mesh, inst.obj->id(), inst.material, inst.obj->pose.transform()));
+    }
+    mesh_cache = std::move(next_cache);
+    mesh_instances.clear();
+    for (auto &[hash, shared] : next_meshes) mesh_instances.emplace(hash, shared.mesh);
+
     build_lights(layout_scene, obj_list);
 
-    scene.build(std::move(obj_list));
+    Uint64 start = SDL_GetPerformanceCounter();
+    scene.build(std::move(obj_list), 1, bvh_layout, &thread_pool);
+    scene_bvh_time = SDL_GetPerformanceCounter() - start;
 }
 
-void Pathtracer::set_sizes(size_t w, size_t h, size_t samples, size_t area_samples, size_t depth) {
+void Pathtracer::set_sizes(size_t w, size_t h, size_t samples, size_t area_samples,
+                           Light_Sampling light, size_t light_samples, RNG::Sequence seq,
+                           size_t depth, float noise, size_t warmup) {
     out_w = w;
     out_h = h;
     n_samples = samples;
     n_area_samples = area_samples;
+    n_light_samples = std::max(light_samples, size_t(1));
+    light_mode = light;
+    sequence = seq;
     max_depth = depth;
-    accumulator.resize(out_w, out_h);
+    noise_target = noise;
+    adaptive_warmup = std::max(warmup, size_t(2));
+    accumulator.clear();
+    accumulator.resize(out_w * out_h);
+    luma_m2.clear();
+    luma_m2.resize(out_w * out_h);
+    pixel_samples.clear();
+    pixel_samples.resize(out_w * out_h);
+    pixel_traced.clear();
+    pixel_traced.resize(out_w * out_h);
+    albedo_aov.clear();
+    albedo_aov.resize(out_w * out_h);
+    normal_aov.clear();
+    normal_aov.resize(out_w * out_h);
+    depth_aov.clear();
+    depth_aov.resize(out_w * out_h);
+    snapshot_buffer = {};
+    snapshots = false;
+    output.resize(out_w, out_h);
+    tiles.clear();
+    region = {};
+}
+
+void Pathtracer::set_region(const Region &r) { region = r; }
+
+void Pathtracer::set_bvh_layout(BVH_Layout layout) { bvh_layout = layout; }
+
+void Pathtracer::enable_snapshots(bool enable) { snapshots = enable; }
+
+size_t Pathtracer::n_tiles() const {
+    return ((out_w + tile_size - 1) / tile_size) * ((out_h + tile_size - 1) / tile_size);
+}
+
+std::vector<Pathtracer::Rect> Pathtracer::layout_tiles(const Region &region) const {
+
+    // The region's crop is given from the top of the image, while rows of
+    // the output are stored from the bottom.
+    size_t cx0 = std::min(region.x, out_w), cx1 = cx0 + std::min(region.w, out_w - cx0);
+    size_t top = std::min(region.y, out_h), bottom = top + std::min(region.h, out_h - top);
+    size_t cy0 = out_h - bottom, cy1 = out_h - top;
+
+    size_t tiles_x = (out_w + tile_size - 1) / tile_size;
+    size_t tiles_y = (out_h + tile_size - 1) / tile_size;
+
+    std::vector<Rect> rects;
+    for (size_t t = region.first_tile; t < std::min(region.last_tile, tiles_x * tiles_y); t++) {
+        size_t i = t % tiles_x, j = t / tiles_x;
+        Rect rect;
+        rect.x0 = std::max(i * tile_size, cx0);
+        rect.y0 = std::max(j * tile_size, cy0);
+        rect.x1 = std::min(std::min((i + 1) * tile_size, out_w), cx1);
+        rect.y1 = std::min(std::min((j + 1) * tile_size, out_h), cy1);
+        if (rect.x0 < rect.x1 && rect.y0 < rect.y1) rects.push_back(rect);
+    }
+    return rects;
+}
+
+Pathtracer::Rect Pathtracer::bounds(const std::vector<Rect> &rects) {
+    if (rects.empty()) return {};
+    Rect ret = rects[0];
+    for (const Rect &rect : rects) {
+        ret.x0 = std::min(ret.x0, rect.x0);
+        ret.y0 = std::min(ret.y0, rect.y0);
+        ret.x1 = std::max(ret.x1, rect.x1);
+        ret.y1 = std::max(ret.y1, rect.y1);
+    }
+    return ret;
 }
 
 void Pathtracer::log_ray(const Ray &ray, float t, Spectrum color) { gui.log_ray(ray, t, color); }
 
-void Pathtracer::accumulate(const HDR_Image &sample) {
+void Pathtracer::build_tiles() {
 
-    std::lock_guard<std::mutex> lock(accumulator_mut);
+    std::vector<Rect> rects = layout_tiles(region);
 
-    accumulator_samples++;
-    for (size_t j = 0; j < out_h; j++) {
-        for (size_t i = 0; i < out_w; i++) {
-            Spectrum &s = accumulator.at(i, j);
-            const Spectrum &n = sample.at(i, j);
-            s += (n - s) * (1.0f / accumulator_samples);
+    // Tiles hold a mutex, so the vector is replaced rather than resized
+    tiles = std::vector<Tile>(rects.size());
+    region_pixels = 0;
+    for (size_t t = 0; t < rects.size(); t++) {
+        static_cast<Rect &>(tiles[t]) = rects[t];
+        region_pixels += (rects[t].x1 - rects[t].x0) * (rects[t].y1 - rects[t].y0);
+    }
+
+    samples_per_pass = std::max(size_t(1), n_samples / max_passes);
+    n_passes = n_samples / samples_per_pass + !!(n_samples % samples_per_pass);
+
+    std::fill(accumulator.begin(), accumulator.end(), Spectrum{});
+    std::fill(luma_m2.begin(), luma_m2.end(), 0.0f);
+    std::fill(pixel_samples.begin(), pixel_samples.end(), 0);
+    std::fill(pixel_traced.begin(), pixel_traced.end(), 0);
+    std::fill(albedo_aov.begin(), albedo_aov.end(), Spectrum{});
+    std::fill(normal_aov.begin(), normal_aov.end(), Vec3{});
+    std::fill(depth_aov.begin(), depth_aov.end(), 0.0f);
+    output.clear({});
+    traced_samples = 0;
+    primary_rays = 0;
+    secondary_rays = 0;
+    shadow_rays = 0;
+    reset_traversal_totals();
+    next_tile = 0;
+    completed_tiles = 0;
+    completed_passes = 0;
+    total_passes = tiles.size() * n_passes;
+
+    if (resume_from) {
+        resume_from->expand();
+        accumulator = std::move(resume_from->accumulator);
+        luma_m2 = std::move(resume_from->luma_m2);
+        pixel_samples = std::move(resume_from->pixel_samples);
+        pixel_traced = std::move(resume_from->pixel_traced);
+        albedo_aov = std::move(resume_from->albedo_aov);
+        normal_aov = std::move(resume_from->normal_aov);
+        depth_aov = std::move(resume_from->depth_aov);
+        traced_samples = resume_from->traced_samples;
+        for (size_t t = 0; t < tiles.size(); t++) {
+            tiles[t].samples = resume_from->tiles[t].first;
+            tiles[t].passes = resume_from->tiles[t].second;
+            tiles[t].updated = true;
+            completed_passes += tiles[t].passes;
+            if (tiles[t].passes == n_passes) completed_tiles++;
+        }
+        resume_from.reset();
+    }
+    if (snapshots) snapshot_buffer = accumulator;
+}
+
+void Pathtracer::trace_tiles() {
+
+    // Threads walk the tiles round-robin from a shared counter and skip any
+    // tile that another thread is currently tracing, so no thread ever waits
+    // on a lock. Walking in order means every tile gets its n-th pass before
+    // any tile gets its (n+1)-th, unless there are fewer tiles than threads.
+    size_t n_tiles = tiles.size();
+    size_t misses = 0;
+
+    while (!render_group.cancelled() && completed_tiles.load() < n_tiles) {
+
+        Tile &tile = tiles[next_tile++ % n_tiles];
+        std::unique_lock<std::mutex> lock(tile.mut, std::try_to_lock);
+
+        if (!lock || tile.passes == n_passes) {
+            if (++misses >= n_tiles) {
+                misses = 0;
+                std::this_thread::yield();
+            }
+            continue;
+        }
+        misses = 0;
+
+        bool converged = do_trace(tile, std::min(samples_per_pass, n_samples - tile.samples));
+        if (render_group.cancelled()) return;
+
+        // A tile where every pixel reached the noise target is done early
+        size_t passes = converged ? n_passes - tile.passes : 1;
+        tile.passes += passes;
+        tile.updated = true;
+        if (snapshots) publish(tile);
+
+        if (completed_passes.fetch_add(passes) + passes == total_passes.load()) {
+            Uint64 done = SDL_GetPerformanceCounter();
+            render_time = done - render_time;
         }
+        if (tile.passes == n_passes) completed_tiles++;
     }
 }
 
-void Pathtracer::do_trace(size_t samples) {
+bool Pathtracer::converged(size_t idx) const {
+
+    unsigned int n = pixel_samples[idx];
+    if (noise_target <= 0.0f || n < adaptive_warmup) return false;
+
+    // Relative standard error of the pixel's mean brightness
+    float variance = luma_m2[idx] / (n - 1);
+    float error = std::sqrt(variance / n) / (accumulator[idx].luma() + noise_floor);
+    return error < noise_target;
+}
+
+bool Pathtracer::do_trace(Tile &tile, size_t samples) {
+
+    size_t tile_pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    tile.samples += samples;
+    ray_counts = {};
+    if (traversal_stats_enabled) traversal_stats = {};
+
+    // Without adaptive sampling, every pixel gets the same number of samples.
+    // Otherwise, pixels that already reached the noise target are skipped and
+    // the pass's budget for the tile is spread over the rest.
+    size_t per_pixel = samples, extra = 0;
+    if (noise_target > 0.0f) {
+
+        size_t active = 0;
+        for (size_t j = tile.y0; j < tile.y1; j++) {
+            for (size_t i = tile.x0; i < tile.x1; i++) {
+                if (!converged(j * out_w + i)) active++;
+            }
+        }
+        if (!active) return true;
+
+        size_t budget = samples * tile_pixels;
+        per_pixel = std::min(budget / active, samples * max_boost);
+        if (per_pixel < samples * max_boost) extra = budget % active;
+    }
+
+    size_t traced = 0;
+    for (size_t j = tile.y0; j < tile.y1; j++) {
+        for (size_t i = tile.x0; i < tile.x1; i++) {
+
+            size_t idx = j * out_w + i;
+            if (noise_target > 0.0f && converged(idx)) continue;
 
-    HDR_Image sample(out_w, out_h);
-    for (size_t j = 0; j < out_h; j++) {
-        for (size_t i = 0; i < out_w; i++) {
+            size_t count = per_pixel;
+            if (extra) {
+                count++;
+                extra--;
+            }
 
+            // Welford's running mean and variance over this pass's samples. Each
+            // sample continues the pixel's sequence from the samples it already
+            // traced, so samples that came out invalid don't repeat an index.
+            Spectrum mean;
+            float luma_mean = 0.0f, m2 = 0.0f;
+            Features features_mean{Spectrum{}, Vec3{}, 0.0f};
             size_t sampled = 0;
-            for (size_t s = 0; s < samples; s++) {
+            for (size_t s = 0; s < count; s++) {
+
+                // Polled per sample so that cancelling returns promptly
+                // even when a single pass over the tile is expensive
+                if (render_group.cancelled()) return false;
 
-                Spectrum p = trace_pixel(i, j);
+                RNG::begin_sample(sequence, (uint32_t)frame, (uint32_t)i, (uint32_t)j,
+                                  (uint32_t)(pixel_traced[idx] + s));
+                Features features;
+                Spectrum p = trace_pixel(i, j, features);
+                RNG::end_sample();
+                traced++;
                 if (p.valid()) {
-                    sample.at(i, j) += p;
                     sampled++;
+                    float weight = 1.0f / sampled;
+                    mean += (p - mean) * weight;
+                    features_mean.albedo += (features.albedo - features_mean.albedo) * weight;
+                    features_mean.normal += (features.normal - features_mean.normal) * weight;
+                    features_mean.depth += (features.depth - features_mean.depth) * weight;
+                    float delta = p.luma() - luma_mean;
+                    luma_mean += delta / sampled;
+                    m2 += delta * (p.luma() - luma_mean);
                 }
             }
-            sample.at(i, j) *= (1.0f / sampled);
+            pixel_traced[idx] += (unsigned int)count;
+            if (!sampled) continue;
+
+            // Merge the pass into the pixel (Chan et al.'s parallel variance)
+            unsigned int &n = pixel_samples[idx];
+            float total = (float)(n + sampled);
+            float delta = luma_mean - accumulator[idx].luma();
+            luma_m2[idx] += m2 + delta * delta * n * sampled / total;
+            accumulator[idx] += (mean - accumulator[idx]) * (sampled / total);
+            albedo_aov[idx] += (features_mean.albedo - albedo_aov[idx]) * (sampled / total);
+            normal_aov[idx] += (features_mean.normal - normal_aov[idx]) * (sampled / total);
+            depth_aov[idx] += (features_mean.depth - depth_aov[idx]) * (sampled / total);
+            n += (unsigned int)sampled;
+        }
+    }
+
+    traced_samples += traced;
+    primary_rays += ray_counts.primary;
+    secondary_rays += ray_counts.secondary;
+    shadow_rays += ray_counts.shadow;
+    if (traversal_stats_enabled) traversal_totals.add(traversal_stats);
+    return false;
+}
+
+void Pathtracer::publish(Tile &tile) {
+
+    // Called while holding the tile. If a snapshot is reading the tile, the
+    // pass is published with the next one (or by the snapshot after it).
+    std::unique_lock<std::mutex> lock(tile.snapshot_mut, std::try_to_lock);
+    if (!lock) {
+        tile.unpublished = true;
+        return;
+    }
+    for (size_t j = tile.y0; j < tile.y1; j++) {
+        size_t row = j * out_w;
+        std::copy(accumulator.begin() + row + tile.x0, accumulator.begin() + row + tile.x1,
+                  snapshot_buffer.begin() + row + tile.x0);
+    }
+    tile.unpublished = false;
+}
+
+HDR_Image Pathtracer::snapshot() {
+
+    if (!snapshots) return HDR_Image();
+    HDR_Image ret(out_w, out_h);
+    for (Tile &tile : tiles) {
+
+        // A tile that missed publishing its last pass is published here,
+        // unless it is being traced again, in which case that pass will be.
+        if (tile.unpublished) {
+            std::unique_lock<std::mutex> lock(tile.mut, std::try_to_lock);
+            if (lock) publish(tile);
+        }
+
+        std::lock_guard<std::mutex> lock(tile.snapshot_mut);
+        for (size_t j = tile.y0; j < tile.y1; j++) {
+            for (size_t i = tile.x0; i < tile.x1; i++) {
+                ret.at(i, j) = snapshot_buffer[j * out_w + i];
+            }
         }
     }
-    accumulate(sample);
+    return ret;
 }
 
-bool Pathtracer::in_progress() const { return completed_epochs.load() < total_epochs.load(); }
+void Pathtracer::sync_output(bool block) {
+
+    // Copy every tile that received samples since the last sync into the
+    // output image. When not blocking, tiles that are currently being traced
+    // are left for the next sync, so the render threads are never stalled.
+    for (Tile &tile : tiles) {
+
+        std::unique_lock<std::mutex> lock(tile.mut, std::defer_lock);
+        if (block) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            continue;
+        }
+        if (!tile.updated) continue;
+
+        for (size_t j = tile.y0; j < tile.y1; j++) {
+            for (size_t i = tile.x0; i < tile.x1; i++) {
+                output.at(i, j) = accumulator[j * out_w + i];
+            }
+        }
+        tile.updated = false;
+    }
+}
+
+Pathtracer::Checkpoint Pathtracer::checkpoint() {
+
+    Checkpoint ret;
+    ret.w = out_w;
+    ret.h = out_h;
+    ret.samples = n_samples;
+    ret.area_samples = n_area_samples;
+    ret.light_samples = n_light_samples;
+    ret.light_mode = light_mode;
+    ret.sequence = sequence;
+    ret.depth = max_depth;
+    ret.warmup = adaptive_warmup;
+    ret.noise = noise_target;
+    ret.region = region;
+    ret.traced_samples = traced_samples.load();
+
+    // Only the pixels covered by the region's tiles are kept
+    Rect rect = bounds(std::vector<Rect>(tiles.begin(), tiles.end()));
+    ret.x0 = rect.x0;
+    ret.y0 = rect.y0;
+    ret.x1 = rect.x1;
+    ret.y1 = rect.y1;
+    size_t w = rect.x1 - rect.x0, n = w * (rect.y1 - rect.y0);
+    ret.accumulator.resize(n);
+    ret.luma_m2.resize(n);
+    ret.pixel_samples.resize(n);
+    ret.pixel_traced.resize(n);
+    ret.albedo_aov.resize(n);
+    ret.normal_aov.resize(n);
+    ret.depth_aov.resize(n);
+
+    // Tiles that aren't being traced are copied first, and the others are
+    // waited on at the end, so that the copy holds up as few passes as it can.
+    ret.tiles.resize(tiles.size());
+    std::vector<size_t> busy;
+    auto copy_tile = [&](size_t t) {
+        Tile &tile = tiles[t];
+        ret.tiles[t] = {tile.samples, tile.passes};
+        for (size_t j = tile.y0; j < tile.y1; j++) {
+            auto copy_row = [&](const auto &from, auto &to) {
+                size_t row = j * out_w, to_row = (j - rect.y0) * w;
+                std::copy(from.begin() + row + tile.x0, from.begin() + row + tile.x1,
+                          to.begin() + to_row + (tile.x0 - rect.x0));
+            };
+            copy_row(accumulator, ret.accumulator);
+            copy_row(luma_m2, ret.luma_m2);
+            copy_row(pixel_samples, ret.pixel_samples);
+            copy_row(pixel_traced, ret.pixel_traced);
+            copy_row(albedo_aov, ret.albedo_aov);
+            copy_row(normal_aov, ret.normal_aov);
+            copy_row(depth_aov, ret.depth_aov);
+        }
+    };
+    for (size_t t = 0; t < tiles.size(); t++) {
+        std::unique_lock<std::mutex> lock(tiles[t].mut, std::try_to_lock);
+        if (lock) {
+            copy_tile(t);
+        } else {
+            busy.push_back(t);
+        }
+    }
+    for (size_t t : busy) {
+        std::lock_guard<std::mutex> lock(tiles[t].mut);
+        copy_tile(t);
+    }
+    return ret;
+}
+
+std::string Pathtracer::resume(Checkpoint &&from) {
+
+    if (from.w != out_w || from.h != out_h || from.samples != n_samples ||
+        from.area_samples != n_area_samples || from.light_samples != n_light_samples ||
+        from.light_mode != light_mode || from.sequence != sequence || from.depth != max_depth ||
+        from.warmup != adaptive_warmup || from.noise != noise_target) {
+        return "Checkpoint render settings do not match!";
+    }
+    std::vector<Rect> rects = layout_tiles(from.region);
+    Rect rect = bounds(rects);
+    size_t n = (from.x1 - from.x0) * (from.y1 - from.y0);
+    if (from.tiles.size() != rects.size() || from.x0 != rect.x0 || from.y0 != rect.y0 ||
+        from.x1 != rect.x1 || from.y1 != rect.y1 || from.accumulator.size() != n ||
+        from.luma_m2.size() != n || from.pixel_samples.size() != n ||
+        from.pixel_traced.size() != n || from.albedo_aov.size() != n ||
+        from.normal_aov.size() != n || from.depth_aov.size() != n) {
+        return "Checkpoint does not match the output size!";
+    }
+
+    region = from.region;
+    resume_from = std::move(from);
+    return {};
+}
+
+// Checkpoint files start with this tag and a version number, followed by the
+// render settings, the progress of each tile, and the raw per-pixel state of
+// the pixels the tiles cover.
+static const char checkpoint_tag[4] = {'S', '3', 'D', 'C'};
+static const uint32_t checkpoint_version = 8;
+
+std::string Pathtracer::Checkpoint::save(const std::string &file) const {
+
+    // Written next to the target and then renamed over it, so that a render
+    // killed while saving still leaves the previous checkpoint intact.
+    std::string temp = file + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return "Failed to open checkpoint file " + temp + "!";
+
+        auto put = [&out](auto value) { out.write((const char *)&value, sizeof(value)); };
+        out.write(checkpoint_tag, sizeof(checkpoint_tag));
+        put(checkpoint_version);
+        put((uint32_t)w);
+        put((uint32_t)h);
+        put((uint32_t)samples);
+        put((uint32_t)area_samples);
+        put((uint32_t)light_samples);
+        put((uint32_t)light_mode);
+        put((uint32_t)sequence);
+        put((uint32_t)depth);
+        put((uint32_t)warmup);
+        put(noise);
+        put((uint64_t)region.x);
+        put((uint64_t)region.y);
+        put((uint64_t)region.w);
+        put((uint64_t)region.h);
+        put((uint64_t)region.first_tile);
+        put((uint64_t)region.last_tile);
+        put((uint64_t)traced_samples);
+        put((uint32_t)tiles.size());
+        for (auto [tile_samples, tile_passes] : tiles) {
+            put((uint32_t)tile_samples);
+            put((uint32_t)tile_passes);
+        }
+        put((uint32_t)x0);
+        put((uint32_t)y0);
+        put((uint32_t)x1);
+        put((uint32_t)y1);
+
+        static_assert(sizeof(Spectrum) == 3 * sizeof(float));
+        static_assert(sizeof(Vec3) == 3 * sizeof(float));
+        out.write((const char *)accumulator.data(), accumulator.size() * sizeof(Spectrum));
+        out.write((const char *)luma_m2.data(), luma_m2.size() * sizeof(float));
+        out.write((const char *)pixel_samples.data(), pixel_samples.size() * sizeof(unsigned int));
+        out.write((const char *)pixel_traced.data(), pixel_traced.size() * sizeof(unsigned int));
+        out.write((const char *)albedo_aov.data(), albedo_aov.size() * sizeof(Spectrum));
+        out.write((const char *)normal_aov.data(), normal_aov.size() * sizeof(Vec3));
+        out.write((const char *)depth_aov.data(), depth_aov.size() * sizeof(float));
+        if (!out) return "Failed to write checkpoint file " + temp + "!";
+    }
+
+    std::error_code err;
+    std::filesystem::rename(temp, file, err);
+    if (err) return "Failed to replace checkpoint file " + file + ": " + err.message();
+    return {};
+}
+
+std::string Pathtracer::Checkpoint::load(const std::string &file) {
+
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) return "Failed to open checkpoint file " + file + "!";
+    size_t file_size = (size_t)in.tellg();
+    in.seekg(0);
+
+    char tag[4] = {};
+    uint32_t version = 0;
+    in.read(tag, sizeof(tag));
+    in.read((char *)&version, sizeof(version));
+    if (!in || std::memcmp(tag, checkpoint_tag, sizeof(tag)) || version != checkpoint_version) {
+        return "File " + file + " is not a supported checkpoint!";
+    }
+
+    auto get = [&in](auto value) {
+        in.read((char *)&value, sizeof(value));
+        return value;
+    };
+    w = get(uint32_t(0));
+    h = get(uint32_t(0));
+    samples = get(uint32_t(0));
+    area_samples = get(uint32_t(0));
+    light_samples = get(uint32_t(0));
+    light_mode = (Light_Sampling)get(uint32_t(0));
+    sequence = (RNG::Sequence)get(uint32_t(0));
+    depth = get(uint32_t(0));
+    warmup = get(uint32_t(0));
+    noise = get(0.0f);
+    region.x = (size_t)get(uint64_t(0));
+    region.y = (size_t)get(uint64_t(0));
+    region.w = (size_t)get(uint64_t(0));
+    region.h = (size_t)get(uint64_t(0));
+    region.first_tile = (size_t)get(uint64_t(0));
+    region.last_tile = (size_t)get(uint64_t(0));
+    traced_samples = (size_t)get(uint64_t(0));
+    size_t n_tiles = get(uint32_t(0));
+    if (!in) return "Checkpoint file " + file + " is truncated!";
+
+    // Sizes are checked before anything is allocated for them, so that a
+    // corrupt file is reported as such rather than running out of memory
+    size_t max_tiles = ((w + tile_size - 1) / tile_size) * ((h + tile_size - 1) / tile_size);
+    if (!w || !h || n_tiles > max_tiles) return "Checkpoint file " + file + " is corrupt!";
+    if (n_tiles * 2 * sizeof(uint32_t) > file_size - (size_t)in.tellg()) {
+        return "Checkpoint file " + file + " is truncated!";
+    }
+
+    tiles.resize(n_tiles);
+    for (auto &[tile_samples, tile_passes] : tiles) {
+        tile_samples = get(uint32_t(0));
+        tile_passes = get(uint32_t(0));
+    }
+    x0 = get(uint32_t(0));
+    y0 = get(uint32_t(0));
+    x1 = get(uint32_t(0));
+    y1 = get(uint32_t(0));
+    if (!in) return "Checkpoint file " + file + " is truncated!";
+    if (x0 > x1 || y0 > y1 || x1 > w || y1 > h) {
+        return "Checkpoint file " + file + " is corrupt!";
+    }
+
+    size_t n = (x1 - x0) * (y1 - y0);
+    size_t pixel_size = 3 * sizeof(Spectrum) + 2 * sizeof(float) + 2 * sizeof(unsigned int);
+    size_t left = file_size - (size_t)in.tellg();
+    if (n * pixel_size > left) return "Checkpoint file " + file + " is truncated!";
+    if (n * pixel_size < left) return "Checkpoint file " + file + " is corrupt!";
+    accumulator.resize(n);
+    luma_m2.resize(n);
+    pixel_samples.resize(n);
+    pixel_traced.resize(n);
+    albedo_aov.resize(n);
+    normal_aov.resize(n);
+    depth_aov.resize(n);
+    in.read((char *)accumulator.data(), accumulator.size() * sizeof(Spectrum));
+    in.read((char *)luma_m2.data(), luma_m2.size() * sizeof(float));
+    in.read((char *)pixel_samples.data(), pixel_samples.size() * sizeof(unsigned int));
+    in.read((char *)pixel_traced.data(), pixel_traced.size() * sizeof(unsigned int));
+    in.read((char *)albedo_aov.data(), albedo_aov.size() * sizeof(Spectrum));
+    in.read((char *)normal_aov.data(), normal_aov.size() * sizeof(Vec3));
+    in.read((char *)depth_aov.data(), depth_aov.size() * sizeof(float));
+    if (!in) return "Checkpoint file " + file + " is truncated!";
+
+    return {};
+}
+
+std::string Pathtracer::Checkpoint::merge(const Checkpoint &other) {
+
+    if (other.w != w || other.h != h) return "Cannot merge renders of different sizes!";
+    if (other.samples != samples || other.area_samples != area_samples ||
+        other.light_samples != light_samples || other.light_mode != light_mode ||
+        other.sequence != sequence || other.depth != depth || other.warmup != warmup ||
+        other.noise != noise) {
+        return "Cannot merge renders with different settings!";
+    }
+
+    // A sample's random numbers only depend on its pixel and index, so two
+    // renders that both traced a pixel traced the very same samples there.
+    // Counting them twice would understate the pixel's variance.
+    size_t rect_w = x1 - x0, other_w = other.x1 - other.x0;
+    for (size_t y = std::max(y0, other.y0); y < std::min(y1, other.y1); y++) {
+        for (size_t x = std::max(x0, other.x0); x < std::min(x1, other.x1); x++) {
+            size_t i = (y - y0) * rect_w + (x - x0), o = (y - other.y0) * other_w + (x - other.x0);
+            if (pixel_traced[i] && other.pixel_traced[o]) {
+                return "Cannot merge renders that both traced pixel (" + std::to_string(x) + ", " +
+                       std::to_string(h - 1 - y) + ")!";
+            }
+        }
+    }
+
+    // The other render's pixels are placed by the offset of its rectangle
+    expand();
+    for (size_t y = other.y0; y < other.y1; y++) {
+        for (size_t x = other.x0; x < other.x1; x++) {
+            size_t i = y * w + x, o = (y - other.y0) * other_w + (x - other.x0);
+            if (!other.pixel_traced[o]) continue;
+            accumulator[i] = other.accumulator[o];
+            luma_m2[i] = other.luma_m2[o];
+            pixel_samples[i] = other.pixel_samples[o];
+            pixel_traced[i] = other.pixel_traced[o];
+            albedo_aov[i] = other.albedo_aov[o];
+            normal_aov[i] = other.normal_aov[o];
+            depth_aov[i] = other.depth_aov[o];
+        }
+    }
+
+    // The result no longer corresponds to a single region's tiles
+    traced_samples += other.traced_samples;
+    region = {};
+    tiles.clear();
+    return {};
+}
+
+void Pathtracer::Checkpoint::expand() {
+
+    if (whole()) return;
+    size_t rect_w = x1 - x0;
+    auto spread = [&](auto &pixels) {
+        std::decay_t<decltype(pixels)> full(w * h);
+        for (size_t y = y0; y < y1; y++) {
+            auto row = pixels.begin() + (y - y0) * rect_w;
+            std::copy(row, row + rect_w, full.begin() + y * w + x0);
+        }
+        pixels = std::move(full);
+    };
+    spread(accumulator);
+    spread(luma_m2);
+    spread(pixel_samples);
+    spread(pixel_traced);
+    spread(albedo_aov);
+    spread(normal_aov);
+    spread(depth_aov);
+    x0 = y0 = 0;
+    x1 = w;
+    y1 = h;
+}
+
+HDR_Image Pathtracer::Checkpoint::image() const {
+    HDR_Image ret(w, h);
+    size_t rect_w = x1 - x0;
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t x = x0; x < x1; x++) {
+            ret.at(x, y) = accumulator[(y - y0) * rect_w + (x - x0)];
+        }
+    }
+    return ret;
+}
+
+// The per-pixel buffers of a render, as they are written to EXR files
+struct EXR_Buffers {
+    size_t w, h;
+    const Spectrum *color, *albedo;
+    const Vec3 *normal;
+    const float *depth, *luma_m2;
+    const unsigned int *samples;
+};
+
+static std::string save_layers(const std::string &file, const EXR_Buffers &b,
+                               const std::vector<AOV> &aovs, Thread_Pool *pool) {
+
+    static_assert(sizeof(Spectrum) == 3 * sizeof(float));
+    static_assert(sizeof(Vec3) == 3 * sizeof(float));
+    size_t w = b.w, h = b.h;
+
+    std::vector<EXR::Channel> channels;
+    auto add_vec = [&](const std::string &layer, const void *data, const char *names) {
+        for (size_t c = 0; c < 3; c++) {
+            channels.push_back(EXR::channel(layer + names[c], (const float *)data, w, h, 3, c));
+        }
+    };
+    add_vec("", b.color, "RGB");
+
+    for (int i = 0; i < (int)AOV::count; i++) {
+        AOV aov = (AOV)i;
+        if (std::find(aovs.begin(), aovs.end(), aov) == aovs.end()) continue;
+
+        std::string layer = std::string(AOV_Names[i]) + ".";
+        switch (aov) {
+        case AOV::depth: {
+            channels.push_back(EXR::channel(layer + "Z", b.depth, w, h));
+        } break;
+        case AOV::normal: {
+            add_vec(layer, b.normal, "XYZ");
+        } break;
+        case AOV::albedo: {
+            add_vec(layer, b.albedo, "RGB");
+        } break;
+        case AOV::samples: {
+            channels.push_back({layer + "Y", [b](size_t x, size_t y, size_t n, float *out) {
+                                    const unsigned int *row = b.samples + (b.h - y - 1) * b.w + x;
+                                    for (size_t j = 0; j < n; j++) out[j] = (float)row[j];
+                                }});
+        } break;
+        case AOV::variance: {
+            channels.push_back({layer + "Y", [b](size_t x, size_t y, size_t n, float *out) {
+                                    size_t row = (b.h - y - 1) * b.w + x;
+                                    for (size_t j = 0; j < n; j++) {
+                                        unsigned int s = b.samples[row + j];
+                                        out[j] = s > 1 ? b.luma_m2[row + j] / ((s - 1.0f) * s)
+                                                       : 0.0f;
+                                    }
+                                }});
+        } break;
+        default: break;
+        }
+    }
+
+    return EXR::write(file, w, h, std::move(channels), pool);
+}
+
+std::string Pathtracer::Checkpoint::save_exr(const std::string &file,
+                                             const std::vector<AOV> &aovs, Thread_Pool *pool,
+                                             const HDR_Image *color) const {
+    if (!whole()) return "Checkpoint only holds part of the image!";
+    if (color && color->dimension() != std::make_pair(w, h)) {
+        return "Image does not match the render size!";
+    }
+    return save_layers(file,
+                       {w, h, color ? color->data() : accumulator.data(), albedo_aov.data(),
+                        normal_aov.data(), depth_aov.data(), luma_m2.data(),
+                        pixel_samples.data()},
+                       aovs, pool);
+}
+
+std::string Pathtracer::save_exr(const std::string &file, const std::vector<AOV> &aovs,
+                                 const HDR_Image *color) {
+    if (in_progress()) return "Cannot write a render that is still in progress!";
+    if (color && color->dimension() != std::make_pair(out_w, out_h)) {
+        return "Image does not match the render size!";
+    }
+    return save_layers(file,
+                       {out_w, out_h, color ? color->data() : accumulator.data(),
+                        albedo_aov.data(), normal_aov.data(), depth_aov.data(), luma_m2.data(),
+                        pixel_samples.data()},
+                       aovs, &thread_pool);
+}
+
+bool Pathtracer::in_progress() const { return completed_tiles.load() < tiles.size(); }
 
 std::pair<float, float> Pathtracer::completion_time() const {
     double freq = (double)SDL_GetPerformanceFrequency();
     return {(float)(build_time / freq), (float)(render_time / freq)};
 }
 
+void Pathtracer::reset_traversal_totals() { traversal_totals.reset(); }
+
+Pathtracer::Stats Pathtracer::stats() const {
+    double freq = (double)SDL_GetPerformanceFrequency();
+    Stats ret;
+    ret.mesh_bvhs = mesh_bvhs;
+    ret.mesh_bvh_seconds = (float)(mesh_bvh_time / freq);
+    ret.scene_bvh_seconds = (float)(scene_bvh_time / freq);
+    std::tie(ret.build_seconds, ret.render_seconds) = completion_time();
+    ret.primary_rays = primary_rays.load();
+    ret.secondary_rays = secondary_rays.load();
+    ret.shadow_rays = shadow_rays.load();
+    ret.traversal = traversal_totals.load();
+    ret.bvh_layout = bvh_layout;
+    ret.w = out_w;
+    ret.h = out_h;
+    ret.threads = thread_pool.size();
+    ret.samples_per_pixel = average_samples();
+    return ret;
+}
+
+float Pathtracer::average_samples() const {
+    return region_pixels ? (float)traced_samples.load() / region_pixels : 0.0f;
+}
+
 float Pathtracer::progress() const {
-    return (float)completed_epochs.load() / (float)total_epochs.load();
+    return (float)completed_passes.load() / (float)total_passes.load();
 }
 
 size_t Pathtracer::visualize_bvh(GL::Lines &lines, GL::Lines &active, size_t depth) {
     return scene.visualize(lines, active, depth, Mat4::I);
 }
 
-void Pathtracer::begin_render(Scene &layout_scene, const Camera &cam) {
-
-    size_t n_threads = std::thread::hardware_concurrency();
-    size_t samples_per_epoch = std::max(size_t(1), n_samples / (n_threads * 10));
+void Pathtracer::begin_render(Scene &layout_scene, const Camera &cam, size_t frame_index) {
 
     cancel();
 
-    accumulator.clear({});
-    total_epochs = n_samples / samples_per_epoch + !!(n_samples % samples_per_epoch);
-
     build_time = SDL_GetPerformanceCounter();
     build_scene(layout_scene);
     render_time = SDL_GetPerformanceCounter();
     build_time = render_time - build_time;
 
     camera = cam;
+    frame = frame_index;
+    build_tiles();
 
-    for (size_t s = 0; s < n_samples; s += samples_per_epoch) {
-        size_t samples = (s + samples_per_epoch) > n_samples ? n_samples - s : samples_per_epoch;
-        thread_pool.enqueue([samples, this]() {
-            do_trace(samples);
-            completed_epochs++;
-            if (completed_epochs.load() == total_epochs.load()) {
-                Uint64 done = SDL_GetPerformanceCounter();
-                render_time = done - render_time;
-            }
-        });
+    for (size_t t = 0; t < thread_pool.size(); t++) {
+        render_group.run([this]() { trace_tiles(); });
     }
 }
 
 void Pathtracer::cancel() {
-    thread_pool.clear();
+    render_group.cancel();
+    render_group.wait();
+    render_group.reset();
     render_time = 0;
     build_time = 0;
-    accumulator_samples = 0;
-    completed_epochs = 0;
-    total_epochs = 0;
+    tiles.clear();
+    next_tile = 0;
+    completed_tiles = 0;
+    completed_passes = 0;
+    total_passes = 0;
 }
 
-const HDR_Image &Pathtracer::get_output() { return accumulator; }
+const HDR_Image &Pathtracer::get_output() {
+    sync_output(true);
+    return output;
+}
+
+HDR_Image Pathtracer::denoised() {
+    Checkpoint render = checkpoint();
+    render.expand();
+    return denoise(render, in_progress() ? nullptr : &thread_pool);
+}
 
 const GL::Tex2D &Pathtracer::get_output_texture(float exposure) {
-    std::lock_guard<std::mutex> lock(accumulator_mut);
-    return accumulator.get_texture(exposure);
+    sync_output(false);
+    return output.get_texture(exposure);
 }
 
 } // namespace PT
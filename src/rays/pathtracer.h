@@ -2,17 +2,22 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
 
 #include "../lib/mathlib.h"
 #include "../scene/scene.h"
 #include "../util/hdr_image.h"
+#include "../util/rand.h"
 #include "../util/thread_pool.h"
 
 #include "bsdf.h"
 #include "env_light.h"
 #include "light.h"
+#include "light_tree.h"
 #include "object.h"
 
 namespace Gui {
@@ -21,52 +26,269 @@ class Widget_Render;
 
 namespace PT {
 
+// Per-pixel render data that can be written as extra layers of an EXR, named
+// after the layer: the mean first-hit distance, normal and albedo, the number
+// of samples, and the variance of the pixel's mean brightness.
+enum class AOV : int { depth, normal, albedo, samples, variance, count };
+extern const char *AOV_Names[(int)AOV::count];
+
 class Pathtracer {
 public:
+    // The part of the image to trace, so that one frame can be split across
+    // several processes: the pixels of the crop rectangle (in image
+    // coordinates, from the top left) that lie in tiles [first_tile,
+    // last_tile). Tiles are numbered in the order they are traced.
+    struct Region {
+        size_t x = 0, y = 0, w = SIZE_MAX, h = SIZE_MAX;
+        size_t first_tile = 0, last_tile = SIZE_MAX;
+
+        bool whole() const {
+            return !x && !y && w == SIZE_MAX && h == SIZE_MAX && !first_tile &&
+                   last_tile == SIZE_MAX;
+        }
+    };
+
+    // A copy of the render state that can be written to and read back from a
+    // checkpoint file, so that a render can be resumed where it stopped.
+    struct Checkpoint {
+        size_t w = 0, h = 0, samples = 0, area_samples = 0, light_samples = 0, depth = 0;
+        size_t warmup = 0;
+        Light_Sampling light_mode = Light_Sampling::all;
+        RNG::Sequence sequence = RNG::Sequence::random;
+        float noise = 0.0f;
+        Region region;
+        size_t traced_samples = 0;
+        // Samples and passes done in each tile
+        std::vector<std::pair<size_t, size_t>> tiles;
+        // The pixels the per-pixel buffers below hold, [x0, x1) x [y0, y1)
+        // with rows counted from the bottom: the bounds of the region's
+        // tiles, so that shards only store their part of the image.
+        size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+        std::vector<Spectrum> accumulator;
+        std::vector<float> luma_m2;
+        std::vector<unsigned int> pixel_samples;
+        // Samples traced per pixel, including invalid ones that weren't kept
+        std::vector<unsigned int> pixel_traced;
+        // Mean albedo, normal and distance of what each pixel's camera rays
+        // first hit; a zero normal means they saw the background.
+        std::vector<Spectrum> albedo_aov;
+        std::vector<Vec3> normal_aov;
+        std::vector<float> depth_aov;
+
+        std::string save(const std::string &file) const;
+        std::string load(const std::string &file);
+        // Combines the pixels of another render of the same frame with the
+        // same settings, e.g. a shard of a different region. The renders
+        // must not have traced any of the same pixels. The result covers
+        // the whole image.
+        std::string merge(const Checkpoint &other);
+        // Spreads the buffers out over the whole image; pixels outside the
+        // region are left without samples.
+        void expand();
+        bool whole() const { return !x0 && !y0 && x1 == w && y1 == h; }
+        HDR_Image image() const;
+        // Writes the image and the given AOVs as one float EXR, encoding
+        // tiles on the pool if given. The color may be replaced, e.g. by a
+        // denoised copy. Only for checkpoints of the whole image.
+        std::string save_exr(const std::string &file, const std::vector<AOV> &aovs,
+                             Thread_Pool *pool = nullptr, const HDR_Image *color = nullptr) const;
+    };
+
+    // Where the time of the last render went, for benchmarks
+    struct Stats {
+        // Each distinct mesh built for the render gets one BVH, shared by all
+        // of its instances; meshes reused from the previous render aren't listed.
+        // Mesh BVHs are built concurrently on the shared pool, so each one's
+        // build_seconds is the time threads spent on it, summed over threads.
+        struct Mesh_BVH {
+            std::string name;
+            size_t triangles = 0, instances = 0;
+            float build_seconds = 0.0f;
+        };
+        std::vector<Mesh_BVH> mesh_bvhs;
+        // The wall time of building all mesh BVHs, and the scene BVH
+        float mesh_bvh_seconds = 0.0f, scene_bvh_seconds = 0.0f;
+        float build_seconds = 0.0f, render_seconds = 0.0f;
+        // Camera rays, rays continuing a path, and rays towards lights
+        uint64_t primary_rays = 0, secondary_rays = 0, shadow_rays = 0;
+        // Zero unless built with SCOTTY3D_TRAVERSAL_STATS
+        Traversal_Stats traversal;
+        BVH_Layout bvh_layout = BVH_Layout::wide;
+        size_t w = 0, h = 0, threads = 0;
+        float samples_per_pixel = 0.0f;
+    };
+
     Pathtracer(Gui::Widget_Render &gui, Vec2 screen_dim);
     ~Pathtracer();
 
-    void set_sizes(size_t w, size_t h, size_t pixel_samples, size_t area_samples, size_t depth);
+    // With noise > 0, pixel_samples is the average per-pixel budget for adaptive
+    // sampling: after warmup samples, pixels stop receiving samples once their
+    // relative error drops below noise, and their share goes to noisier pixels.
+    // Unless light_mode is all, each shading point samples light_samples
+    // lights picked at random (by power or with the light tree) instead of
+    // sampling every light. Each pixel sample draws its numbers from the given
+    // sequence.
+    void set_sizes(size_t w, size_t h, size_t pixel_samples, size_t area_samples,
+                   Light_Sampling light_mode, size_t light_samples, RNG::Sequence sequence,
+                   size_t depth, float noise, size_t warmup);
+    // Only trace part of the image. Reset to the whole image by set_sizes.
+    void set_region(const Region &region);
+    // How the BVHs of the next scene build are laid out for traversal
+    void set_bvh_layout(BVH_Layout layout);
+    // Keep the buffer that snapshot() reads from. Reset to off by set_sizes.
+    void enable_snapshots(bool enable);
+    size_t n_tiles() const;
+    // The render threads, which may be borrowed for other work between renders
+    Thread_Pool &pool() { return thread_pool; }
 
     const HDR_Image &get_output();
+    // Filters the render so far with the denoiser, so it may be called while
+    // rendering as well as after. While rendering, the filter runs on the
+    // calling thread rather than competing with the render for the pool.
+    HDR_Image denoised();
+    // The image as of each tile's last finished pass. Render threads publish
+    // their tiles to a second buffer after each pass, so taking a snapshot
+    // from another thread neither waits on nor holds up the tiles being traced.
+    // Empty unless snapshots were enabled for the render.
+    HDR_Image snapshot();
+    // Same as Checkpoint::save_exr, but written straight from the render's
+    // buffers, so it can only be used once rendering is done.
+    std::string save_exr(const std::string &file, const std::vector<AOV> &aovs,
+                         const HDR_Image *color = nullptr);
     const GL::Tex2D &get_output_texture(float exposure);
     size_t visualize_bvh(GL::Lines &lines, GL::Lines &active, size_t level);
 
-    void begin_render(Scene &scene, const Camera &camera);
+    // Renders of different animation frames use different random numbers
+    void begin_render(Scene &scene, const Camera &camera, size_t frame = 0);
+
+    // Copies the render state one tile at a time, so it may be called from
+    // another thread while rendering; tiles being traced are waited on after
+    // all others are copied, and the render threads simply skip tiles that
+    // are being copied.
+    Checkpoint checkpoint();
+    // Makes the next begin_render continue from a checkpoint rather than
+    // start from scratch. The checkpoint's settings must match set_sizes.
+    std::string resume(Checkpoint &&from);
     void cancel();
     bool in_progress() const;
     float progress() const;
+    float average_samples() const;
     std::pair<float, float> completion_time() const;
+    Stats stats() const;
 
 private:
+    // Pixels [x0, x1) x [y0, y1) of the output image
+    struct Rect {
+        size_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    };
+
+    // A rectangle of the output image that is traced by one thread at a time.
+    // Each pass over a tile adds samples_per_pass samples to all of its pixels.
+    struct Tile : Rect {
+        size_t samples = 0, passes = 0;
+        bool updated = false;
+        std::mutex mut;
+        // Guards the tile's pixels in the snapshot buffer. Set when a finished
+        // pass could not be published because a snapshot was reading the tile.
+        std::mutex snapshot_mut;
+        std::atomic<bool> unpublished{false};
+    };
+
     // Internal
     void build_scene(Scene &scene);
     void build_lights(Scene &scene, std::vector<Object> &objs);
-    void do_trace(size_t samples);
-    void accumulate(const HDR_Image &sample);
+    std::vector<Rect> layout_tiles(const Region &region) const;
+    static Rect bounds(const std::vector<Rect> &rects);
+    void build_tiles();
+    void trace_tiles();
+    bool do_trace(Tile &tile, size_t samples);
+    void publish(Tile &tile);
+    void reset_traversal_totals();
+    bool converged(size_t pixel) const;
+    void sync_output(bool block);
     bool tonemap();
 
     Gui::Widget_Render &gui;
     unsigned long long render_time, build_time;
     Thread_Pool thread_pool;
+    Task_Group render_group;
+
+    // The accumulator is only written by the thread holding the pixel's tile.
+    // The output image is a copy of it that is only touched by the caller.
+    // Next to each pixel's mean, we keep the number of valid samples and the
+    // sum of squared deviations of their brightness for variance estimates,
+    // as well as the mean first-hit features that guide the denoiser. Pixels
+    // also count every sample they traced, valid or not, which is where their
+    // sequence continues.
+    // Snapshots read a copy of the accumulator that tiles are published to.
+    std::vector<Spectrum> accumulator;
+    std::vector<float> luma_m2;
+    std::vector<unsigned int> pixel_samples;
+    std::vector<unsigned int> pixel_traced;
+    std::vector<Spectrum> albedo_aov;
+    std::vector<Vec3> normal_aov;
+    std::vector<float> depth_aov;
+    // Only allocated and published to when snapshots are enabled
+    std::vector<Spectrum> snapshot_buffer;
+    bool snapshots = false;
+    HDR_Image output;
+    std::vector<Tile> tiles;
+    Region region;
+    size_t region_pixels;
+    size_t samples_per_pass, n_passes;
+    std::atomic<size_t> next_tile, completed_tiles, total_passes, completed_passes;
+    std::atomic<size_t> traced_samples;
+
+    // Rays are counted per thread while tracing a tile, and added to the
+    // totals once the pass is done.
+    struct Ray_Counts {
+        uint64_t primary = 0, secondary = 0, shadow = 0;
+    };
+    static thread_local Ray_Counts ray_counts;
+    std::atomic<uint64_t> primary_rays, secondary_rays, shadow_rays;
+    // Traversal work is counted the same way, but only when it is enabled
+    Traversal_Totals traversal_totals;
+    std::vector<Stats::Mesh_BVH> mesh_bvhs;
+    unsigned long long mesh_bvh_time = 0, scene_bvh_time = 0;
 
-    HDR_Image accumulator;
-    std::mutex accumulator_mut;
-    std::atomic<size_t> accumulator_samples, total_epochs, completed_epochs;
+    // What a camera ray first hit, used to guide the denoiser
+    struct Features {
+        Spectrum albedo = Spectrum{1.0f};
+        Vec3 normal;
+        float depth = 0.0f;
+    };
 
     /// Relevant to student
-    Spectrum trace_pixel(size_t x, size_t y);
-    Spectrum trace_ray(const Ray &ray);
+    Spectrum trace_pixel(size_t x, size_t y, Features &features);
+    Spectrum trace_ray(const Ray &ray, Features *features = nullptr);
     void log_ray(const Ray &ray, float t, Spectrum color = Spectrum{1.0f});
 
     BVH<Object> scene;
     std::vector<Light> lights;
+    Samplers::Alias light_select;
+    Light_Tree light_tree;
     std::vector<BSDF> materials;
     std::optional<Env_Light> env_light; // only one of these per scene
     std::unordered_map<Scene_ID, size_t> mat_cache;
+    // The mesh generation, content hash and shared mesh each object had in
+    // the last build, and the meshes that build used, keyed by content hash.
+    struct Mesh_Entry {
+        size_t generation, hash;
+        std::shared_ptr<Tri_Mesh> mesh;
+    };
+    std::unordered_map<Scene_ID, Mesh_Entry> mesh_cache;
+    std::unordered_multimap<size_t, std::shared_ptr<Tri_Mesh>> mesh_instances;
+    // Meshes are only reused while the layout they were built with is kept
+    BVH_Layout bvh_layout = BVH_Layout::wide, mesh_layout = BVH_Layout::wide;
 
     Camera camera;
-    size_t out_w, out_h, n_samples, n_area_samples, max_depth;
+    size_t out_w, out_h, n_samples, n_area_samples, n_light_samples, max_depth;
+    Light_Sampling light_mode;
+    RNG::Sequence sequence;
+    size_t frame;
+    size_t adaptive_warmup;
+    float noise_target;
+    std::optional<Checkpoint> resume_from;
 };
 
 } // namespace PT
@@ -0,0 +1,83 @@
+
+#include "samplers.h"
+#include "../util/rand.h"
+
+namespace Samplers {
+
+Alias::Alias(const std::vector<float> &weights) {
+    bins.resize(weights.size());
+    build(weights.data(), weights.size(), bins.data());
+}
+
+void Alias::build(const float *weights, size_t n, Bin *bins) {
+
+    if (!n) return;
+
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++) total += std::max(weights[i], 0.0f);
+
+    // Scale the weights so that they average to one; the bins with less
+    // than one are then topped up by bins with more than one. Small bins are
+    // queued from the front of work and large ones from the back. The scratch
+    // space is kept per thread, as many tables may be built in a row.
+    static thread_local std::vector<double> scaled;
+    static thread_local std::vector<unsigned int> work;
+    scaled.resize(n);
+    work.resize(n);
+    size_t n_small = 0, n_large = 0;
+    for (size_t i = 0; i < n; i++) {
+        double pmf = total > 0.0 ? std::max(weights[i], 0.0f) / total : 1.0 / n;
+        bins[i].pmf = (float)pmf;
+        scaled[i] = pmf * n;
+        if (scaled[i] < 1.0) {
+            work[n_small++] = (unsigned int)i;
+        } else {
+            work[n - ++n_large] = (unsigned int)i;
+        }
+    }
+
+    while (n_small && n_large) {
+        unsigned int s = work[--n_small], l = work[n - n_large];
+        bins[s].prob = (float)scaled[s];
+        bins[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            n_large--;
+            work[n_small++] = l;
+        }
+    }
+
+    // Whatever is left over is (up to rounding) exactly full
+    for (size_t k = 0; k < n_small; k++) bins[work[k]] = {1.0f, bins[work[k]].pmf, work[k]};
+    for (size_t k = n - n_large; k < n; k++) bins[work[k]] = {1.0f, bins[work[k]].pmf, work[k]};
+}
+
+size_t Alias::sample(float &pmf) const {
+    float u_remap;
+    return sample(bins.data(), bins.size(), RNG::unit(), pmf, u_remap);
+}
+
+size_t Alias::sample(const Bin *bins, size_t n, float u, float &pmf, float &u_remap) {
+
+    float x = std::min(u * n, std::nextafter((float)n, 0.0f));
+    size_t i = std::min((size_t)x, n - 1);
+    const Bin &bin = bins[i];
+
+    // Where u fell within the part of the bin that was picked, which is
+    // itself uniformly distributed
+    float f = x - i;
+    size_t ret;
+    if (f < bin.prob) {
+        ret = i;
+        u_remap = f / bin.prob;
+    } else {
+        ret = bin.alias;
+        u_remap = (f - bin.prob) / (1.0f - bin.prob);
+    }
+    u_remap = std::min(u_remap, std::nextafter(1.0f, 0.0f));
+
+    pmf = bins[ret].pmf;
+    return ret;
+}
+
+} // namespace Samplers
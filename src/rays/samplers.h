@@ -4,6 +4,8 @@
 #include "../lib/mathlib.h"
 #include "../util/hdr_image.h"
 
+class Thread_Pool;
+
 namespace Samplers {
 
 // These samplers are discrete. Note they output a probability _mass_ function
@@ -25,6 +27,32 @@ struct Two_Points {
 using Direction = Point;
 using Two_Directions = Two_Points;
 
+// Picks index i with probability weights[i] / sum(weights) in constant time,
+// using Walker's alias method (as constructed by Vose). If no weight is
+// positive, indices are picked uniformly.
+struct Alias {
+    Alias() = default;
+    Alias(const std::vector<float> &weights);
+
+    size_t sample(float &pmf) const;
+    float pmf(size_t i) const { return bins[i].pmf; }
+    size_t size() const { return bins.size(); }
+
+    // Each bin is picked uniformly, and then either keeps its own index with
+    // probability prob, or gives its alias
+    struct Bin {
+        float prob, pmf;
+        unsigned int alias;
+    };
+    std::vector<Bin> bins;
+
+    // The same over n bins stored elsewhere, so that many tables can share
+    // one array. Sampling takes a uniform u in [0,1), and also returns a new
+    // uniform number u_remap from what is left of u after picking the bin.
+    static void build(const float *weights, size_t n, Bin *bins);
+    static size_t sample(const Bin *bins, size_t n, float u, float &pmf, float &u_remap);
+};
+
 // These are continuous. Note they output a probabilty _density_ function
 namespace Rect {
 
@@ -59,16 +87,16 @@ struct Uniform {
 };
 
 struct Image {
-    Image(const HDR_Image &image);
+    Image() = default;
+    // If given a pool, the rows are set up in parallel on it
+    Image(const HDR_Image &image, Thread_Pool *pool = nullptr);
     Vec3 sample(float &pdf) const;
 
     size_t w = 0, h = 0;
-    std::vector<float> marginal_func;
-    std::vector<float> marginal_cdf;
-    std::vector<std::vector<float>> conditional_func;
-    std::vector<std::vector<float>> conditional_cdf;
-
-    float marginal_I = 0.0f;
+    // A row is picked from the marginal table, and then a pixel from that
+    // row's w bins, which are stored one row after another in conditional.
+    Alias marginal;
+    std::vector<Alias::Bin> conditional;
 };
 
 } // namespace Sphere
@@ -17,6 +17,7 @@ public:
 
     BBox bbox() const;
     Trace hit(const Ray &ray) const;
+    bool occluded(const Ray &ray) const;
 
     float radius = 1.0f;
 
@@ -41,6 +42,11 @@ public:
         return std::visit(overloaded{[&ray](const auto &o) { return o.hit(ray); }}, underlying);
     }
 
+    bool occluded(const Ray &ray) const {
+        return std::visit(overloaded{[&ray](const auto &o) { return o.occluded(ray); }},
+                          underlying);
+    }
+
     template <typename T> T &get() { return std::get<T>(underlying); }
 
     template <typename T> const T &get() const { return std::get<T>(underlying); }
@@ -3,8 +3,54 @@
 
 #include "../lib/mathlib.h"
 
+#include <atomic>
+#include <cstdint>
+
 namespace PT {
 
+// The work done to trace rays, to tell a poor BVH from simply too many rays:
+// BVH nodes visited, ray-box and ray-primitive tests, primitive hits, and
+// rays or hits moved between object and world space. The hit functions only
+// count when built with SCOTTY3D_TRAVERSAL_STATS, and otherwise COUNT_TRAVERSAL
+// compiles to nothing. Each thread counts into its own traversal_stats.
+struct Traversal_Stats {
+    uint64_t nodes = 0, box_tests = 0, primitive_tests = 0, hits = 0, transforms = 0;
+};
+
+// Totals of many threads' Traversal_Stats, which threads add to without locking
+struct Traversal_Totals {
+    std::atomic<uint64_t> nodes = 0, box_tests = 0, primitive_tests = 0, hits = 0, transforms = 0;
+
+    void add(const Traversal_Stats &s) {
+        nodes.fetch_add(s.nodes, std::memory_order_relaxed);
+        box_tests.fetch_add(s.box_tests, std::memory_order_relaxed);
+        primitive_tests.fetch_add(s.primitive_tests, std::memory_order_relaxed);
+        hits.fetch_add(s.hits, std::memory_order_relaxed);
+        transforms.fetch_add(s.transforms, std::memory_order_relaxed);
+    }
+    Traversal_Stats load() const {
+        return {nodes.load(), box_tests.load(), primitive_tests.load(), hits.load(),
+                transforms.load()};
+    }
+    void reset() {
+        nodes = 0;
+        box_tests = 0;
+        primitive_tests = 0;
+        hits = 0;
+        transforms = 0;
+    }
+};
+
+inline thread_local Traversal_Stats traversal_stats;
+
+#ifdef SCOTTY3D_TRAVERSAL_STATS
+inline constexpr bool traversal_stats_enabled = true;
+#define COUNT_TRAVERSAL(counter, n) (void)(PT::traversal_stats.counter += (n))
+#else
+inline constexpr bool traversal_stats_enabled = false;
+#define COUNT_TRAVERSAL(counter, n) (void)0
+#endif
+
 struct Trace {
 
     bool hit = false;
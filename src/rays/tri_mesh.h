@@ -18,6 +18,7 @@ class Triangle {
 public:
     BBox bbox() const;
     Trace hit(const Ray &ray) const;
+    bool occluded(const Ray &ray) const;
 
     size_t visualize(GL::Lines &, GL::Lines &, size_t, const Mat4 &) const { return size_t(0); }
 
@@ -36,13 +37,18 @@ public:
 
     BBox bbox() const;
     Trace hit(const Ray &ray) const;
+    bool occluded(const Ray &ray) const;
 
     size_t visualize(GL::Lines &lines, GL::Lines &active, size_t level, const Mat4 &trans) const;
 
-    void build(const GL::Mesh &mesh);
+    void build(const GL::Mesh &mesh, BVH_Layout layout = BVH_Layout::wide,
+               Thread_Pool *pool = nullptr);
+    // Whether this was built from a mesh with the same geometry
+    bool matches(const GL::Mesh &mesh) const;
 
 private:
     std::vector<Tri_Mesh_Vert> verts;
+    std::vector<GL::Mesh::Index> indices;
     BVH<Triangle> triangles;
 };
 
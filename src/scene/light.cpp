@@ -2,6 +2,7 @@
 #include "light.h"
 
 #include "../geometry/util.h"
+#include "../rays/env_cache.h"
 #include "renderer.h"
 
 #include <sstream>
@@ -35,7 +36,7 @@ void Scene_Light::emissive_clear() { opt.has_emissive_map = false; }
 HDR_Image Scene_Light::emissive_copy() const { return _emissive.copy(); }
 
 std::string Scene_Light::emissive_load(std::string file) {
-    std::string err = _emissive.load_from(file);
+    std::string err = PT::Env_Cache::load_image(file, _emissive);
     if (err.empty()) {
         opt.has_emissive_map = true;
     }
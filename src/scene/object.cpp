@@ -60,6 +60,7 @@ void Scene_Object::try_make_editable(PT::Shape_Type prev) {
 
     mesh_dirty = true;
     skel_dirty = true;
+    generation = next_generation++;
 }
 
 bool Scene_Object::is_shape() const { return opt.shape_type != PT::Shape_Type::none; }
@@ -125,6 +126,7 @@ void Scene_Object::sync_anim_mesh() {
 void Scene_Object::flip_normals() {
     halfedge.flip();
     mesh_dirty = true;
+    generation = next_generation++;
 }
 
 void Scene_Object::sync_mesh() {
@@ -137,11 +139,15 @@ void Scene_Object::sync_mesh() {
     }
 }
 
-void Scene_Object::set_pose_dirty() { pose_dirty = true; }
+void Scene_Object::set_pose_dirty() {
+    pose_dirty = true;
+    generation = next_generation++;
+}
 
 void Scene_Object::set_skel_dirty() {
     skel_dirty = true;
     pose_dirty = true;
+    generation = next_generation++;
 }
 
 void Scene_Object::set_mesh_dirty() {
@@ -149,6 +155,7 @@ void Scene_Object::set_mesh_dirty() {
     mesh_dirty = true;
     skel_dirty = true;
     pose_dirty = true;
+    generation = next_generation++;
 }
 
 BBox Scene_Object::bbox() {
@@ -55,6 +55,11 @@ public:
     void set_skel_dirty();
     void set_pose_dirty();
 
+    // Changes whenever the (posed) mesh may have changed. Values are never
+    // reused, but an object moved into another carries its value (and mesh)
+    // along, so caches of derived data should key on the id as well.
+    size_t mesh_generation() const { return generation; }
+
     static const inline int max_name_len = 256;
     struct Options {
         char name[max_name_len] = {};
@@ -81,6 +86,9 @@ private:
     mutable bool editable = true;
     mutable bool mesh_dirty = false;
     mutable bool skel_dirty = false, pose_dirty = false;
+
+    static inline size_t next_generation = 0;
+    size_t generation = next_generation++;
 };
 
 bool operator!=(const Scene_Object::Options &l, const Scene_Object::Options &r);
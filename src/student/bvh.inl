@@ -1,6 +1,9 @@
 
 #include "../rays/bvh.h"
+#include "../util/thread_pool.h"
 #include "debug.h"
+#include <algorithm>
+#include <optional>
 #include <stack>
 
 namespace PT {
@@ -8,57 +11,25 @@ namespace PT {
 const size_t nBuckets = 16;
 
 // Bucket
-template <typename Primitive>
 struct Bucket {
     BBox bbox;
-    float max_t;
-    std::vector<Primitive*> prims;
+    size_t count = 0;
 };
 
-// Initialize buckets.
-template <typename Primitive>
-std::vector<Bucket<Primitive>> initBuckets(size_t ax, const std::vector<Primitive> &prims,
-const size_t start, const size_t size) {
-    // Range of primitives' box
-    float min_r = FLT_MAX, max_r = -FLT_MAX;
-
-    // Get range
-    for (size_t i = start; i < size; i++) {
-        float min = prims[i].bbox().min[int(ax)];
-        float max = prims[i].bbox().max[int(ax)];
-
-        if (min < min_r) min_r = min;
-        else if (max > max_r) max_r = max;
-    }
-
-    // Width of each bucket
-    float width = (max_r - min_r) / nBuckets;
-
-    // Set buckets' range
-    std::vector<Bucket<Primitive>> buckets; 
-    for (size_t i = 0; i < nBuckets; i++) {
-        Bucket<Primitive> b;
-        b.max_t = min_r + (i + 1)*width;
-        buckets.push_back(b);
-    }
-    
-    return buckets;
-    // return std::move(buckets); // moving a local object in a return statement prevents copy ellision
-}
+// Buckets along each axis
+struct Bins {
+    Bucket buckets[3][nBuckets];
+};
 
-// Compute index of bucket
-template <typename Primitive>
-size_t computeBucket(float centroid, const std::vector<Bucket<Primitive>> &buckets) {
-    size_t i = 0;
-    for (auto buck: buckets) {
-        if (centroid < buck.max_t) return i;
-        else i++;
-    }
-    return (i - 1 > 0) ? i - 1 : 0; // unlikely
-}
+// Nodes with at least parallel_size primitives are binned and partitioned
+// in chunks of chunk_size primitives, and subtrees of at least fork_size
+// primitives are built by tasks of their own. These are fixed so that the
+// tree doesn't depend on how many threads build it.
+const size_t parallel_size = 1 << 16, chunk_size = 1 << 14, fork_size = 1 << 12;
 
 template <typename Primitive>
-void BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size) {
+void BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size,
+                           BVH_Layout layout, Thread_Pool *pool) {
     // NOTE (PathTracer):
     // This BVH is parameterized on the type of the primitive it contains. This allows
     // us to build a BVH over any type that defines a certain interface. Specifically,
@@ -74,147 +45,490 @@ void BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size)
     // contain pointers to children, but rather indicies. This is because instead
     // of allocating each node individually, the BVH class contains a vector that
     // holds all of the nodes. Hence, to get the child of a node, you have to
-    // look up the child index in this vector (e.g. nodes[node.l]). Similarly,
+    // look up the child index in this vector (e.g. build_nodes[node.l]). Similarly,
     // to create a new node, don't allocate one yourself - use BVH::new_node, which
-    // returns the index of a newly added node.
+    // returns the index of a newly added node in the part of the tree being built.
+    // Once built, the tree is flattened into the compact nodes that are
+    // traversed, binary or wide per the layout.
 
     // Keep these
+    build_nodes.clear();
     nodes.clear();
+    wide_nodes.clear();
+    node_layout = layout;
     primitives = std::move(prims);
     // do not dereference prims now. it has no value. rvalue reference is used to transfer ownership
     // without copying. used commonly in explicit constructors
 
     // TODO (PathTracer): Task 3
     // Construct a BVH from the given vector of primitives and maximum leaf
-    // size configuration. The starter code builds a BVH with a
-    // single leaf node (which is also the root) that encloses all the
-    // primitives.
-
-    // Replace these (I think not?)
+    // size configuration.
+
+    // Each primitive's bounds and centroid are computed once up front, and
+    // the build sorts these references rather than the primitives themselves.
+    // Tasks of the build count towards the timer of the thread starting it
+    Work_Timer *timer = Work_Timer::current();
+    std::vector<Build_Ref> refs(primitives.size());
+    size_t chunks = (primitives.size() + chunk_size - 1) / chunk_size;
+    std::vector<BBox> chunk_boxes(chunks);
+    auto init_refs = [&](size_t b, size_t e) {
+        for (size_t c = b; c < e; c++) {
+            size_t end = std::min((c + 1) * chunk_size, primitives.size());
+            for (size_t i = c * chunk_size; i < end; i++) {
+                refs[i].bbox = primitives[i].bbox();
+                refs[i].center = refs[i].bbox.center();
+                refs[i].index = i;
+                chunk_boxes[c].enclose(refs[i].bbox);
+            }
+        }
+    };
+    if (pool) {
+        pool->parallel_for(0, chunks, 1, [&](size_t b, size_t e) {
+            Work_Timer::Scope scope(timer);
+            init_refs(b, e);
+        });
+    } else {
+        init_refs(0, chunks);
+    }
     BBox box;
-    for (const Primitive &prim : primitives)
-        box.enclose(prim.bbox());
-    new_node(box, 0, primitives.size(), 0, 0);
-    root_idx = 0;
+    for (const BBox &chunk_box : chunk_boxes) box.enclose(chunk_box);
 
-    recursive_build(root_idx, max_leaf_size);
+    Build_Part root;
+    new_node(root, box, 0, primitives.size(), 0, 0);
+    root_idx = 0;
+    bounds = box;
+
+    std::optional<Task_Group> group;
+    if (pool) group.emplace(*pool);
+    Build_State state = {refs, std::max(max_leaf_size, size_t(1)), pool,
+                         group ? &*group : nullptr, timer};
+    recursive_build(state, root, root_idx);
+    if (group) group->wait();
+
+    build_nodes = std::move(root.nodes);
+    splice(root, 0);
+
+    // Move the primitives into the order the leaves refer to them in
+    std::vector<Primitive> sorted;
+    sorted.reserve(primitives.size());
+    for (const Build_Ref &ref : refs) sorted.push_back(std::move(primitives[ref.index]));
+    primitives = std::move(sorted);
+
+    if (node_layout == BVH_Layout::wide) {
+        flatten_wide();
+    } else {
+        flatten();
+    }
+    build_nodes.clear();
+    build_nodes.shrink_to_fit();
 }
 
-// Recursively build BVH
-template <typename Primitive> void BVH<Primitive>::recursive_build(const size_t node_idx,
-const size_t max_leaf_size) {
-    // Recursively build BVH
-    Node* n = &nodes[node_idx];
-
-    // Keep track of min-cost partition and it's data for the current node
-    float minCost = FLT_MAX;
-    BBox leftBox, rightBox;
-    std::vector<Primitive*> leftPrims, rightPrims;
-
-    // Find min cost amongst all partitions, all planes
-    for (size_t axis = 0; axis < 3; axis++) {
-        std::vector<Bucket<Primitive>> buckets = initBuckets(axis, primitives, n->start, n->size);
-
-        // Bucket the primitives
-        for (size_t p = n->start; p < n->start + n->size; p++) {
-            Primitive* prim = &primitives[p];
-            float centroid = (prim->bbox().min[int(axis)] + prim->bbox().max[int(axis)]) / 2.f;
-            size_t b = computeBucket(centroid, buckets);
-            buckets[b].bbox.enclose(prim->bbox());
-            buckets[b].prims.push_back(prim);
+// Splits a node's primitives where the surface area heuristic is lowest,
+// trying the boundaries between nBuckets equal buckets of centroid positions
+// along each axis. Bucket bounds and counts are swept from both ends, so each
+// node costs time linear in its primitives, which are then partitioned in
+// place. The smaller half is recursed into (or forked, if it is big enough)
+// and the larger one split next, which keeps the recursion shallow however
+// lopsided the tree gets.
+template <typename Primitive>
+void BVH<Primitive>::recursive_build(const Build_State &state, Build_Part &part,
+                                     size_t node_idx) {
+
+    std::vector<Build_Ref> &refs = state.refs;
+
+    while (part.nodes[node_idx].size > state.max_leaf_size) {
+
+        size_t start = part.nodes[node_idx].start, size = part.nodes[node_idx].size;
+        auto first = refs.begin() + start, last = first + size;
+
+        // Large nodes are processed chunk by chunk, on the pool if there is
+        // one. Chunk results are merged in order, and bounds and counts come
+        // out the same however they are grouped.
+        size_t chunks = size >= parallel_size ? (size + chunk_size - 1) / chunk_size : 1;
+        auto for_chunks = [&](auto &&fn) {
+            auto run = [&](size_t b, size_t e) {
+                for (size_t c = b; c < e; c++) {
+                    fn(c, first + c * chunk_size, first + std::min((c + 1) * chunk_size, size));
+                }
+            };
+            if (state.pool && chunks > 1) {
+                state.pool->parallel_for(0, chunks, 1, [&](size_t b, size_t e) {
+                    Work_Timer::Scope scope(state.timer);
+                    run(b, e);
+                });
+            } else {
+                run(0, chunks);
+            }
+        };
+
+        BBox centers;
+        if (chunks == 1) {
+            for (auto ref = first; ref != last; ref++) centers.enclose(ref->center);
+        } else {
+            std::vector<BBox> chunk_centers(chunks);
+            for_chunks([&](size_t c, auto b, auto e) {
+                for (auto ref = b; ref != e; ref++) chunk_centers[c].enclose(ref->center);
+            });
+            for (const BBox &chunk : chunk_centers) centers.enclose(chunk);
         }
 
-        // Partition B - 1 times
-        for (size_t b = 0; b < nBuckets - 1; b++) {
-            std::vector<Primitive*> lp , rp; // Left and Right Primitive Vectors
-            BBox lb, rb; // Left and Right Boxes
+        float scale[3];
+        for (size_t axis = 0; axis < 3; axis++) {
+            float extent = centers.max[(int)axis] - centers.min[(int)axis];
+            scale[axis] = extent > 0.0f ? nBuckets / extent : 0.0f;
+        }
+        auto bucket_of = [&](const Build_Ref &ref, size_t axis) {
+            int b = (int)((ref.center[(int)axis] - centers.min[(int)axis]) * scale[axis]);
+            return (size_t)std::min(b, (int)nBuckets - 1);
+        };
+
+        // Bin along all three axes in one pass over the primitives
+        auto bin = [&](auto b, auto e, Bins &bins) {
+            for (auto ref = b; ref != e; ref++) {
+                for (size_t axis = 0; axis < 3; axis++) {
+                    Bucket &bucket = bins.buckets[axis][bucket_of(*ref, axis)];
+                    bucket.bbox.enclose(ref->bbox);
+                    bucket.count++;
+                }
+            }
+        };
+        Bins bins;
+        if (chunks == 1) {
+            bin(first, last, bins);
+        } else {
+            std::vector<Bins> chunk_bins(chunks);
+            for_chunks([&](size_t c, auto b, auto e) { bin(b, e, chunk_bins[c]); });
+            for (const Bins &chunk : chunk_bins) {
+                for (size_t axis = 0; axis < 3; axis++) {
+                    for (size_t b = 0; b < nBuckets; b++) {
+                        bins.buckets[axis][b].bbox.enclose(chunk.buckets[axis][b].bbox);
+                        bins.buckets[axis][b].count += chunk.buckets[axis][b].count;
+                    }
+                }
+            }
+        }
 
-            for (size_t i = 0; i <= b; i++) { // Left Side
-                lb.enclose(buckets[i].bbox);
-                lp.insert(lp.end(), buckets[i].prims.begin(), buckets[i].prims.end());
+        // Split before bucket best_split on best_axis
+        float best_cost = FLT_MAX;
+        size_t best_axis = 0, best_split = 0;
+        BBox left_box, right_box;
+
+        for (size_t axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0.0f) continue;
+            const Bucket *buckets = bins.buckets[axis];
+
+            // Bounds and counts of buckets [b, nBuckets)
+            BBox right[nBuckets];
+            size_t right_count[nBuckets] = {};
+            BBox acc;
+            size_t count = 0;
+            for (size_t b = nBuckets - 1; b > 0; b--) {
+                acc.enclose(buckets[b].bbox);
+                count += buckets[b].count;
+                right[b] = acc;
+                right_count[b] = count;
             }
 
-            for (size_t i = b + 1; i < nBuckets; i++) { // Right Side
-                rb.enclose(buckets[i].bbox);
-                rp.insert(rp.end(), buckets[i].prims.begin(), buckets[i].prims.end());
+            // Costs are proportional to the SAH; the parent's area is the same
+            // for every split, so it is left out
+            acc = BBox();
+            count = 0;
+            for (size_t b = 1; b < nBuckets; b++) {
+                acc.enclose(buckets[b - 1].bbox);
+                count += buckets[b - 1].count;
+                if (!count || !right_count[b]) continue;
+                float cost = acc.surface_area() * count + right[b].surface_area() * right_count[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                    left_box = acc;
+                    right_box = right[b];
+                }
             }
+        }
 
-            // Evaluate cost
-            float cost = lb.surface_area()/n->bbox.surface_area()*lp.size() +
-             rb.surface_area()/n->bbox.surface_area()*rp.size();
-            
-            // Update minimum
-            if (cost < minCost) {
-                leftBox = std::move(lb);
-                rightBox = std::move(rb);
-                leftPrims = std::move(lp);
-                rightPrims = std::move(rp);
-                cost = minCost;
+        size_t n_left;
+        auto goes_left = [&](const Build_Ref &ref) {
+            return bucket_of(ref, best_axis) < best_split;
+        };
+        if (best_cost == FLT_MAX) {
+            // All centroids coincide, so split the primitives in half
+            n_left = size / 2;
+            for (auto ref = first; ref != first + n_left; ref++) left_box.enclose(ref->bbox);
+            for (auto ref = first + n_left; ref != last; ref++) right_box.enclose(ref->bbox);
+        } else if (chunks == 1) {
+            n_left = std::partition(first, last, goes_left) - first;
+        } else {
+            // Each chunk counts its primitives on either side, and then moves
+            // them to where the chunks before it leave off, keeping their order
+            std::vector<size_t> lefts(chunks), rights(chunks);
+            for_chunks([&](size_t c, auto b, auto e) {
+                lefts[c] = std::count_if(b, e, goes_left);
+                rights[c] = (e - b) - lefts[c];
+            });
+            n_left = 0;
+            for (size_t c = 0; c < chunks; c++) n_left += lefts[c];
+            for (size_t c = 0, l = 0, r = n_left; c < chunks; c++) {
+                size_t n_l = lefts[c], n_r = rights[c];
+                lefts[c] = l;
+                rights[c] = r;
+                l += n_l;
+                r += n_r;
             }
+            std::vector<Build_Ref> sorted(size);
+            for_chunks([&](size_t c, auto b, auto e) {
+                for (auto ref = b; ref != e; ref++) {
+                    sorted[goes_left(*ref) ? lefts[c]++ : rights[c]++] = *ref;
+                }
+            });
+            for_chunks([&](size_t c, auto b, auto e) {
+                std::copy(sorted.begin() + (b - first), sorted.begin() + (e - first), b);
+            });
+        }
 
-            // clear!
-            lp.clear();
-            rp.clear();
+        size_t l = new_node(part, left_box, start, n_left, 0, 0);
+        size_t r = new_node(part, right_box, start + n_left, size - n_left, 0, 0);
+        part.nodes[node_idx].l = l;
+        part.nodes[node_idx].r = r;
+
+        if (n_left > size - n_left) std::swap(l, r);
+        if (state.group && part.nodes[l].size >= fork_size) {
+            part.forks.push_back({l, std::make_unique<Build_Part>()});
+            Build_Part *fork = part.forks.back().second.get();
+            new_node(*fork, part.nodes[l].bbox, part.nodes[l].start, part.nodes[l].size, 0, 0);
+            state.group->run([this, &state, fork]() {
+                Work_Timer::Scope scope(state.timer);
+                recursive_build(state, *fork, 0);
+            });
+        } else {
+            recursive_build(state, part, l);
         }
-        // clear !
-        buckets.clear();
+        node_idx = r;
     }
+}
 
-    // Tie-breaker
-    bool recalcBound = false;
-    if (leftPrims.size() == 0) {
-        leftPrims.assign(rightPrims.begin(), rightPrims.begin() + rightPrims.size()/2);
-        rightPrims.erase(rightPrims.begin(), rightPrims.begin() + rightPrims.size()/2);
-        recalcBound = true;
-    } else if (rightPrims.size() == 0) {
-        rightPrims.assign(leftPrims.begin(), leftPrims.begin() + leftPrims.size()/2);
-        leftPrims.erase(leftPrims.begin(), leftPrims.begin() + leftPrims.size()/2);
-        recalcBound = true;
-    }
-    if (recalcBound) {
-        BBox new_rb, new_lb;
-        for (size_t i = 0; i < rightPrims.size(); i++) {
-            new_rb.enclose((*rightPrims[i]).bbox());
-        }
-        for (size_t i = 0; i < leftPrims.size(); i++) {
-            new_lb.enclose((*leftPrims[i]).bbox()); 
+// Appends the nodes of the parts forked from a part (whose own nodes start
+// at offset), in the order they were forked, and links each in place of the
+// node it was forked from
+template <typename Primitive> void BVH<Primitive>::splice(Build_Part &part, size_t offset) {
+    for (auto &[idx, fork] : part.forks) {
+        size_t at = build_nodes.size();
+        for (Build_Node n : fork->nodes) {
+            if (!n.is_leaf()) {
+                n.l += at;
+                n.r += at;
+            }
+            build_nodes.push_back(n);
         }
-        rightBox = std::move(new_rb);
-        leftBox = std::move(new_lb);
+        build_nodes[offset + idx] = build_nodes[at];
+        splice(*fork, at);
     }
+}
 
-    // Create child nodes using best partition; Assign to current node
-    size_t leftChild = new_node(leftBox, n->start, leftPrims.size(), 0, 0);
-    n = &nodes[node_idx];
-    size_t rightChild = new_node(rightBox, n->start + leftPrims.size(), rightPrims.size(), 0, 0);
-    n = &nodes[node_idx];
-    n->l = leftChild;
-    n->r = rightChild;
-
-    // Rearrange primitives
-    std::vector<Primitive> temp_prims;
-    for (size_t i = 0; i < leftPrims.size(); i++) {
-        temp_prims.push_back(std::move(*leftPrims[i]));
+// Copies the tree into compact nodes in depth-first order, so that each
+// interior node is followed by its left child and the nodes visited by a
+// ray tend to share cache lines.
+template <typename Primitive> void BVH<Primitive>::flatten() {
+
+    assert(primitives.size() < Node::leaf_bit);
+    nodes.clear();
+    nodes.reserve(build_nodes.size());
+    depth = 0;
+
+    // Build nodes to copy, with the depth and the flat index of the parent
+    // whose right child they are (or SIZE_MAX)
+    struct Todo {
+        size_t idx, parent, level;
+    };
+    std::vector<Todo> todo = {{root_idx, SIZE_MAX, 1}};
+    while (!todo.empty()) {
+
+        Todo next = todo.back();
+        todo.pop_back();
+        const Build_Node &b = build_nodes[next.idx];
+        uint32_t flat = (uint32_t)nodes.size();
+        if (next.parent != SIZE_MAX) nodes[next.parent].offset = flat;
+        depth = std::max(depth, next.level);
+
+        Node node;
+        node.min = b.bbox.min;
+        node.max = b.bbox.max;
+        if (b.is_leaf()) {
+            node.offset = (uint32_t)b.start;
+            node.info = Node::leaf_bit | (uint32_t)b.size;
+        } else {
+            // Split along the axis that separates the children the most
+            Vec3 gap = build_nodes[b.r].bbox.center() - build_nodes[b.l].bbox.center();
+            gap = Vec3(std::abs(gap.x), std::abs(gap.y), std::abs(gap.z));
+            node.offset = 0;
+            node.info = gap.x >= gap.y && gap.x >= gap.z ? 0 : gap.y >= gap.z ? 1 : 2;
+            todo.push_back({b.r, flat, next.level + 1});
+            todo.push_back({b.l, SIZE_MAX, next.level + 1});
+        }
+        nodes.push_back(node);
     }
-    for (size_t i = 0; i < rightPrims.size(); i++) {
-        temp_prims.push_back(std::move(*rightPrims[i]));
+}
+
+// Collapses the binary tree into four-wide nodes. Each wide node stands in
+// for a binary one and adopts its descendants until it has four children,
+// always opening up the interior child with the largest surface area, as
+// that is the one rays are most likely to enter.
+template <typename Primitive> void BVH<Primitive>::flatten_wide() {
+
+    assert(primitives.size() < Node::leaf_bit);
+    wide_nodes.clear();
+    wide_nodes.reserve(build_nodes.size() / 3 + 1);
+    size_t levels = 0;
+
+    // Build nodes to collapse, with their wide node and depth
+    struct Todo {
+        size_t idx;
+        uint32_t wide;
+        size_t level;
+    };
+    std::vector<Todo> todo = {{root_idx, 0, 1}};
+    wide_nodes.emplace_back();
+    while (!todo.empty()) {
+
+        Todo next = todo.back();
+        todo.pop_back();
+        levels = std::max(levels, next.level);
+
+        // A root that is a leaf still gets a node above it
+        const Build_Node &b = build_nodes[next.idx];
+        size_t kids[4] = {next.idx}, n_kids = 1;
+        if (!b.is_leaf()) {
+            kids[0] = b.l;
+            kids[1] = b.r;
+            n_kids = 2;
+        }
+        while (n_kids < 4) {
+            size_t open = n_kids;
+            float area = -1.0f;
+            for (size_t i = 0; i < n_kids; i++) {
+                const Build_Node &k = build_nodes[kids[i]];
+                if (!k.is_leaf() && k.bbox.surface_area() > area) {
+                    open = i;
+                    area = k.bbox.surface_area();
+                }
+            }
+            if (open == n_kids) break;
+            const Build_Node &k = build_nodes[kids[open]];
+            kids[open] = k.l;
+            kids[n_kids++] = k.r;
+        }
+
+        Wide_Node node;
+        for (size_t i = 0; i < 4; i++) {
+            BBox box;
+            uint32_t child = 0, info = Node::leaf_bit;
+            if (i < n_kids) {
+                const Build_Node &k = build_nodes[kids[i]];
+                box = k.bbox;
+                if (k.is_leaf()) {
+                    child = (uint32_t)k.start;
+                    info |= (uint32_t)k.size;
+                } else {
+                    child = (uint32_t)wide_nodes.size();
+                    info = 0;
+                    wide_nodes.emplace_back();
+                    todo.push_back({kids[i], child, next.level + 1});
+                }
+            }
+            node.min_x[i] = box.min.x;
+            node.min_y[i] = box.min.y;
+            node.min_z[i] = box.min.z;
+            node.max_x[i] = box.max.x;
+            node.max_y[i] = box.max.y;
+            node.max_z[i] = box.max.z;
+            node.child[i] = child;
+            node.info[i] = info;
+        }
+        wide_nodes[next.wide] = node;
     }
 
-    // Write back primitives
-    std::move(temp_prims.begin(), temp_prims.begin() + temp_prims.size(), primitives.begin() + n->start);
+    // Each node visited replaces its stack entry with up to four children
+    depth = 3 * levels + 1;
+}
 
-    // Clear!
-    temp_prims.clear();
+template <typename Primitive> BVH<Primitive>::Box_Ray::Box_Ray(const Ray &ray) : point(ray.point) {
+    inv_dir = Vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+    for (int i = 0; i < 3; i++) negative[i] = inv_dir[i] < 0.0f;
+}
 
-    // recurse
-    if (leftPrims.size() > max_leaf_size)  {
-        leftPrims.clear();
-        recursive_build(leftChild, max_leaf_size);
-    }
-    if (rightPrims.size() > max_leaf_size) {
-        rightPrims.clear();
-        recursive_build(rightChild, max_leaf_size);
+template <typename Primitive>
+bool BVH<Primitive>::Box_Ray::hit(const Node &node, float &t_min, float &t_max) const {
+    // The slab test, choosing each axis' entry plane by the ray's direction.
+    // A ray parallel to a slab and starting on its boundary gives NaN, which
+    // fails the comparisons and so leaves the interval as it is.
+    auto slab = [&](float min, float max, float point, float inv_dir, bool negative) {
+        float near = ((negative ? max : min) - point) * inv_dir;
+        float far = ((negative ? min : max) - point) * inv_dir;
+        t_min = near > t_min ? near : t_min;
+        t_max = far < t_max ? far : t_max;
+    };
+    slab(node.min.x, node.max.x, point.x, inv_dir.x, negative[0]);
+    slab(node.min.y, node.max.y, point.y, inv_dir.y, negative[1]);
+    slab(node.min.z, node.max.z, point.z, inv_dir.z, negative[2]);
+    // Rounding may place the exit just short of the entry for a ray that
+    // grazes the box
+    t_max *= 1.0f + 4.0f * FLT_EPSILON;
+    return t_min <= t_max;
+}
+
+template <typename Primitive>
+int BVH<Primitive>::Box_Ray::hit(const Wide_Node &node, float t_min, float t_max,
+                                 float (&enter)[4]) const {
+#ifdef SCOTTY3D_BVH_SSE
+    // The same test as above on all four children at once. Given a NaN, SSE
+    // min and max return their second operand, so NaNs again leave the
+    // interval as it is.
+    __m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+    auto slab = [&](const float *min, const float *max, float point, float inv_dir,
+                    bool negative) {
+        __m128 p = _mm_set1_ps(point), inv = _mm_set1_ps(inv_dir);
+        __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(negative ? max : min), p), inv);
+        __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(negative ? min : max), p), inv);
+        lo = _mm_max_ps(near, lo);
+        hi = _mm_min_ps(far, hi);
+    };
+    slab(node.min_x, node.max_x, point.x, inv_dir.x, negative[0]);
+    slab(node.min_y, node.max_y, point.y, inv_dir.y, negative[1]);
+    slab(node.min_z, node.max_z, point.z, inv_dir.z, negative[2]);
+    hi = _mm_mul_ps(hi, _mm_set1_ps(1.0f + 4.0f * FLT_EPSILON));
+    _mm_storeu_ps(enter, lo);
+    return _mm_movemask_ps(_mm_cmple_ps(lo, hi));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; i++) {
+        float lo = t_min, hi = t_max;
+        auto slab = [&](float min, float max, float point, float inv_dir, bool negative) {
+            float near = ((negative ? max : min) - point) * inv_dir;
+            float far = ((negative ? min : max) - point) * inv_dir;
+            lo = near > lo ? near : lo;
+            hi = far < hi ? far : hi;
+        };
+        slab(node.min_x[i], node.max_x[i], point.x, inv_dir.x, negative[0]);
+        slab(node.min_y[i], node.max_y[i], point.y, inv_dir.y, negative[1]);
+        slab(node.min_z[i], node.max_z[i], point.z, inv_dir.z, negative[2]);
+        hi *= 1.0f + 4.0f * FLT_EPSILON;
+        enter[i] = lo;
+        if (lo <= hi) mask |= 1 << i;
     }
+    return mask;
+#endif
+}
+
+// Traversal keeps a stack of nodes still to visit, which fits on the program
+// stack unless the tree is unusually deep. Otherwise it goes in a vector owned
+// by the call, as traversals nest (a scene BVH's objects have BVHs of their own).
+template <typename Primitive>
+template <typename Entry, size_t N>
+Entry *BVH<Primitive>::traversal_stack(Entry (&local)[N], std::vector<Entry> &deep) const {
+    if (depth <= N) return local;
+    deep.resize(depth);
+    return deep.data();
 }
 
 template <typename Primitive> Trace BVH<Primitive>::hit(const Ray &ray) const {
@@ -224,82 +538,210 @@ template <typename Primitive> Trace BVH<Primitive>::hit(const Ray &ray) const {
     // with a BVH aggregate if and only if it intersects a primitive in
     // the BVH that is not an aggregate.
 
-    // The starter code simply iterates through all the primitives.
-    // Again, remember you can use hit() on any Primitive value.
+    if (node_layout == BVH_Layout::wide) return hit_wide(ray);
 
     Trace ret;
-    ret.time = FLT_MAX;
-    find_closest_hit(ray, 0, ret);
+    if (nodes.empty()) return ret;
+
+    Box_Ray box_ray(ray);
+    uint32_t local[64];
+    std::vector<uint32_t> deep;
+    uint32_t *stack = traversal_stack(local, deep);
+    size_t top = 0;
+    uint32_t idx = 0;
+    float closest = ray.time_bounds.y;
+
+    while (true) {
+        const Node &n = nodes[idx];
+        float t_min = ray.time_bounds.x, t_max = closest;
+        COUNT_TRAVERSAL(nodes, 1);
+        COUNT_TRAVERSAL(box_tests, 1);
+
+        if (box_ray.hit(n, t_min, t_max)) {
+            if (n.is_leaf()) {
+                for (uint32_t i = n.offset; i < n.offset + n.count(); i++) {
+                    Trace trc = primitives[i].hit(ray);
+                    if (trc.hit && (!ret.hit || trc.time < ret.time)) {
+                        ret = trc;
+                        closest = std::min(closest, trc.time);
+                    }
+                }
+            } else {
+                // Visit the child on the near side of the split first; the
+                // other is skipped later if the closest hit is already nearer.
+                uint32_t first = idx + 1, second = n.offset;
+                if (box_ray.negative[n.info]) std::swap(first, second);
+                stack[top++] = second;
+                idx = first;
+                continue;
+            }
+        }
+        if (!top) break;
+        idx = stack[--top];
+    }
     return ret;
 }
 
-template <typename Primitive> void BVH<Primitive>::find_closest_hit(const Ray &ray, const size_t nodeIdx,
-Trace &closest) const {
-    Node n = nodes[nodeIdx];
-    Vec2 times = Vec2(ray.time_bounds.x, ray.time_bounds.y);
-    bool hitBox = n.bbox.hit(ray, times);
-    if (!hitBox || (times.x > closest.time)) return;
-
-    if (n.is_leaf()) {
-        for (size_t i = n.start; i < n.start + n.size; i++) {
-            Trace trc = primitives[i].hit(ray);
-            closest = Trace::min(closest, trc);
-            // If neither hits, Trace::min() returns a default Trace. Set the time again.
-            if (closest.time == 0.f && !closest.hit) closest.time = FLT_MAX;
+template <typename Primitive> bool BVH<Primitive>::occluded(const Ray &ray) const {
+
+    // Any hit will do, so children are visited in no particular order and
+    // the search stops at the first primitive that blocks the ray.
+    if (node_layout == BVH_Layout::wide) return occluded_wide(ray);
+    if (nodes.empty()) return false;
+
+    Box_Ray box_ray(ray);
+    uint32_t local[64];
+    std::vector<uint32_t> deep;
+    uint32_t *stack = traversal_stack(local, deep);
+    size_t top = 0;
+    uint32_t idx = 0;
+
+    while (true) {
+        const Node &n = nodes[idx];
+        float t_min = ray.time_bounds.x, t_max = ray.time_bounds.y;
+        COUNT_TRAVERSAL(nodes, 1);
+        COUNT_TRAVERSAL(box_tests, 1);
+
+        if (box_ray.hit(n, t_min, t_max)) {
+            if (n.is_leaf()) {
+                for (uint32_t i = n.offset; i < n.offset + n.count(); i++) {
+                    if (primitives[i].occluded(ray)) return true;
+                }
+            } else {
+                stack[top++] = n.offset;
+                idx++;
+                continue;
+            }
         }
-    } else {
-        // Times for left and right child node bbox hits
-        Vec2 timeL = Vec2(ray.time_bounds.x, ray.time_bounds.y);
-        Vec2 timeR = Vec2(ray.time_bounds.x, ray.time_bounds.y);
-
-        // Don't really need the booleans
-        nodes[n.l].bbox.hit(ray, timeL);
-        nodes[n.r].bbox.hit(ray, timeR);
-
-        // Determine which child node was hit first
-        bool isLeftFirst = timeL.x <= timeR.x;
-        size_t firstIdx = (isLeftFirst) ? n.l : n.r;
-        size_t secondIdx = (isLeftFirst) ? n.r : n.l;
-        float secondHitTime = (isLeftFirst) ? timeR.x : timeL.x;
-
-        // Try nearer node first. Then try further node in-case
-        find_closest_hit(ray, firstIdx, closest);
-        if (secondHitTime < closest.time) find_closest_hit(ray, secondIdx, closest);
+        if (!top) return false;
+        idx = stack[--top];
+    }
+}
+
+template <typename Primitive> Trace BVH<Primitive>::hit_wide(const Ray &ray) const {
+
+    Trace ret;
+    if (wide_nodes.empty()) return ret;
+
+    Box_Ray box_ray(ray);
+    Wide_Entry local[64];
+    std::vector<Wide_Entry> deep;
+    Wide_Entry *stack = traversal_stack(local, deep);
+    size_t top = 0;
+    float closest = ray.time_bounds.y;
+    stack[top++] = {0, 0, ray.time_bounds.x};
+
+    while (top) {
+        Wide_Entry next = stack[--top];
+        // Skip children the ray only enters beyond a hit found since
+        if (next.t > closest) continue;
+        COUNT_TRAVERSAL(nodes, 1);
+
+        if (next.info & Node::leaf_bit) {
+            uint32_t end = next.child + (next.info & ~Node::leaf_bit);
+            for (uint32_t i = next.child; i < end; i++) {
+                Trace trc = primitives[i].hit(ray);
+                if (trc.hit && (!ret.hit || trc.time < ret.time)) {
+                    ret = trc;
+                    closest = std::min(closest, trc.time);
+                }
+            }
+            continue;
+        }
+
+        const Wide_Node &n = wide_nodes[next.child];
+        COUNT_TRAVERSAL(box_tests, 4);
+        float enter[4];
+        int mask = box_ray.hit(n, ray.time_bounds.x, closest, enter);
+
+        // Push the children hit from far to near, so the nearest is visited next
+        Wide_Entry hits[4];
+        size_t n_hits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i))) continue;
+            Wide_Entry child = {n.child[i], n.info[i], enter[i]};
+            size_t j = n_hits++;
+            for (; j > 0 && hits[j - 1].t < child.t; j--) hits[j] = hits[j - 1];
+            hits[j] = child;
+        }
+        for (size_t i = 0; i < n_hits; i++) stack[top++] = hits[i];
     }
+    return ret;
 }
 
+template <typename Primitive> bool BVH<Primitive>::occluded_wide(const Ray &ray) const {
+
+    if (wide_nodes.empty()) return false;
+
+    Box_Ray box_ray(ray);
+    Wide_Entry local[64];
+    std::vector<Wide_Entry> deep;
+    Wide_Entry *stack = traversal_stack(local, deep);
+    size_t top = 0;
+    stack[top++] = {0, 0, ray.time_bounds.x};
+
+    while (top) {
+        Wide_Entry next = stack[--top];
+        COUNT_TRAVERSAL(nodes, 1);
+
+        if (next.info & Node::leaf_bit) {
+            uint32_t end = next.child + (next.info & ~Node::leaf_bit);
+            for (uint32_t i = next.child; i < end; i++) {
+                if (primitives[i].occluded(ray)) return true;
+            }
+            continue;
+        }
+
+        const Wide_Node &n = wide_nodes[next.child];
+        COUNT_TRAVERSAL(box_tests, 4);
+        float enter[4];
+        int mask = box_ray.hit(n, ray.time_bounds.x, ray.time_bounds.y, enter);
+        for (int i = 0; i < 4; i++) {
+            if (mask & (1 << i)) stack[top++] = {n.child[i], n.info[i], enter[i]};
+        }
+    }
+    return false;
+}
 
 template <typename Primitive>
-BVH<Primitive>::BVH(std::vector<Primitive> &&prims, size_t max_leaf_size) {
+BVH<Primitive>::BVH(std::vector<Primitive> &&prims, size_t max_leaf_size, BVH_Layout layout) {
     // Dont think anybody calls this constructor
-    build(std::move(prims), max_leaf_size); // transfer ownership to build()
+    build(std::move(prims), max_leaf_size, layout); // transfer ownership to build()
 }
 
-template <typename Primitive> bool BVH<Primitive>::Node::is_leaf() const {
+template <typename Primitive> bool BVH<Primitive>::Build_Node::is_leaf() const {
     return l == 0 && r == 0;
 }
 
 template <typename Primitive>
-size_t BVH<Primitive>::new_node(BBox box, size_t start, size_t size, size_t l, size_t r) {
-    Node n;
+size_t BVH<Primitive>::new_node(Build_Part &part, BBox box, size_t start, size_t size, size_t l,
+                                size_t r) {
+    Build_Node n;
     n.bbox = box;
     n.start = start;
     n.size = size;
     n.l = l;
     n.r = r;
-    nodes.push_back(n);
-    return nodes.size() - 1;
+    part.nodes.push_back(n);
+    return part.nodes.size() - 1;
 }
 
-template <typename Primitive> BBox BVH<Primitive>::bbox() const { return nodes[root_idx].bbox; }
+template <typename Primitive> BBox BVH<Primitive>::bbox() const {
+    return bounds;
+}
 
 template <typename Primitive> std::vector<Primitive> BVH<Primitive>::destructure() {
     nodes.clear();
+    wide_nodes.clear();
+    bounds = BBox();
     return std::move(primitives);
 }
 
 template <typename Primitive> void BVH<Primitive>::clear() {
+    build_nodes.clear();
     nodes.clear();
+    wide_nodes.clear();
+    bounds = BBox();
     primitives.clear();
 }
 
@@ -308,23 +750,13 @@ size_t BVH<Primitive>::visualize(GL::Lines &lines, GL::Lines &active, size_t lev
                                  const Mat4 &trans) const {
 
     std::stack<std::pair<size_t, size_t>> tstack;
-    tstack.push({root_idx, 0});
+    tstack.push({0, 0});
     size_t max_level = 0;
 
-    if (nodes.empty())
-        return max_level;
-
-    while (!tstack.empty()) {
-
-        auto [idx, lvl] = tstack.top();
-        max_level = std::max(max_level, lvl);
-        const Node &node = nodes[idx];
-        tstack.pop();
-
+    auto draw = [&](BBox box, size_t lvl) {
         Vec3 color = lvl == level ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(1.0f);
         GL::Lines &add = lvl == level ? active : lines;
 
-        BBox box = node.bbox;
         box.transform(trans);
         Vec3 min = box.min, max = box.max;
 
@@ -342,14 +774,59 @@ size_t BVH<Primitive>::visualize(GL::Lines &lines, GL::Lines &active, size_t lev
         edge(Vec3{min.x, min.y, max.z}, Vec3{min.x, max.y, max.z});
         edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, max.y, min.z});
         edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, min.y, max.z});
+    };
+
+    if (node_layout == BVH_Layout::wide) {
+
+        // Wide nodes hold no bounds of their own, so each level shows the
+        // boxes of the children of the nodes one level up
+        if (wide_nodes.empty()) return max_level;
+        draw(bounds, 0);
+
+        while (!tstack.empty()) {
+
+            auto [idx, lvl] = tstack.top();
+            const Wide_Node &node = wide_nodes[idx];
+            tstack.pop();
+
+            for (size_t i = 0; i < 4; i++) {
+                if (node.info[i] == Node::leaf_bit) continue;
+                max_level = std::max(max_level, lvl + 1);
+                draw(BBox(Vec3(node.min_x[i], node.min_y[i], node.min_z[i]),
+                          Vec3(node.max_x[i], node.max_y[i], node.max_z[i])),
+                     lvl + 1);
+
+                if (!(node.info[i] & Node::leaf_bit)) {
+                    tstack.push({node.child[i], lvl + 1});
+                    continue;
+                }
+                uint32_t end = node.child[i] + (node.info[i] & ~Node::leaf_bit);
+                for (size_t j = node.child[i]; j < end; j++) {
+                    size_t c = primitives[j].visualize(lines, active, level - lvl - 1, trans);
+                    max_level = std::max(c, max_level);
+                }
+            }
+        }
+        return max_level;
+    }
+
+    if (nodes.empty())
+        return max_level;
+
+    while (!tstack.empty()) {
+
+        auto [idx, lvl] = tstack.top();
+        max_level = std::max(max_level, lvl);
+        const Node &node = nodes[idx];
+        tstack.pop();
 
-        if (node.l)
-            tstack.push({node.l, lvl + 1});
-        if (node.r)
-            tstack.push({node.r, lvl + 1});
+        draw(BBox(node.min, node.max), lvl);
 
-        if (!node.l && !node.r) {
-            for (size_t i = node.start; i < node.start + node.size; i++) {
+        if (!node.is_leaf()) {
+            tstack.push({idx + 1, lvl + 1});
+            tstack.push({node.offset, lvl + 1});
+        } else {
+            for (size_t i = node.offset; i < node.offset + node.count(); i++) {
                 size_t c = primitives[i].visualize(lines, active, level - lvl, trans);
                 max_level = std::max(c, max_level);
             }
@@ -6,7 +6,7 @@
 
 namespace PT {
 
-Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
+Spectrum Pathtracer::trace_pixel(size_t x, size_t y, Features &features) {
 
     Vec2 xy((float)x, (float)y); // Raster/Image space [0, w];[0, h]
     Vec2 wh((float)out_w, (float)out_h);
@@ -28,133 +28,174 @@ Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
 
     Ray out = camera.generate_ray(xy / wh); // NDC space ([0, 1] instead of [-1, 1])
 
-    if (RNG::coin_flip(0.0005f)) log_ray(out, 10.0f); // log .05% of rays, at timestep 10
-    return trace_ray(out);
+    // log .05% of rays, at timestep 10 (without using up a dimension of the sample)
+    if (RNG::independent_unit() < 0.0005f) log_ray(out, 10.0f);
+    return trace_ray(out, &features);
 }
 
-Spectrum Pathtracer::trace_ray(const Ray &ray) {
-    // This path cannot bounce anymore.
-    if (ray.depth > max_depth) return Spectrum();
+// Paths are only considered for Russian roulette after this many bounces
+static const size_t rr_min_depth = 3;
 
-    // Trace ray into scene. If nothing is hit, sample the environment
-    Trace hit = scene.hit(ray);
-    if (!hit.hit) {
-        if (env_light.has_value()) {
-            return env_light.value().sample_direction(ray.dir);
-        }
-        return Spectrum(0.f);
-    }
+// Orthonormal shading frame where the surface normal becomes {0, 1, 0}.
+// Built without branches or matrices, following Duff et al., "Building an
+// Orthonormal Basis, Revisited" (JCGT 2017).
+struct Shading_Frame {
 
-    // If we're using a two-sided material, treat back-faces the same as front-faces
-    const BSDF &bsdf = materials[hit.material];
-    if(!bsdf.is_sided() && dot(hit.normal, ray.dir) > 0.0f) {
-        hit.normal = -hit.normal;
+    explicit Shading_Frame(Vec3 n) : normal(n.unit()) {
+        float sign = std::copysign(1.0f, normal.z);
+        float a = -1.0f / (sign + normal.z);
+        float b = normal.x * normal.y * a;
+        bitangent = Vec3(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+        tangent = Vec3(b, sign + normal.y * normal.y * a, -normal.y);
     }
 
-    // Set up a coordinate frame at the hit point, where the surface normal becomes {0, 1, 0}
-    // This gives us out_dir and later in_dir in object space, where computations involving the
-    // normal become much easier. For example, cos(theta) = dot(N,dir) = dir.y!
-    Mat4 object_to_world = Mat4::rotate_to(hit.normal);
-    Mat4 world_to_object = object_to_world.T();
-    Vec3 out_dir = world_to_object.rotate(ray.point - hit.position).unit(); // towards camera, but ray is out from camera
-
-    // Debugging: if the normal colors flag is set, return the normal color
-    if(debug_data.normal_colors)
-        return Spectrum::direction(hit.normal);
-
-    // Now we can compute the rendering equation at this point.
-    // We split it into two stages: sampling lighting (i.e. directly connecting
-    // the current path to each light in the scene), then sampling the BSDF
-    // to create a new path segment.
-
-    // TODO (PathTracer): Task 5
-    // The starter code sets radiance_out to (0.5,0.5,0.5) so that you can test your geometry
-    // queries before you implement path tracing. You should change this to (0,0,0) and accumulate
-    // the direct and indirect lighting computed below.
-    BSDF_Sample bsdf_sample = bsdf.sample(out_dir);
-    Spectrum radiance_out = bsdf_sample.emissive;
-    
-    auto sample_light = [&](const auto &light) {
-        // If the light is discrete (e.g. a point light), then we only need
-        // one sample, as all samples will be equivalent
-        int samples = light.is_discrete() ? 1 : (int)n_area_samples;
-        for (int i = 0; i < samples; i++) {
-
-            Light_Sample sample = light.sample(hit.position);
-            Vec3 in_dir = world_to_object.rotate(sample.direction);
-
-            // If the light is below the horizon, ignore it
-            float cos_theta = in_dir.y;
-            if (cos_theta <= 0.0f) continue;
-
-            // If the BSDF has 0 throughput in this direction, ignore it
-            // This is another opportunity to do Russian roulette on low-throughput rays,
-            // which would allow us to skip the shadow ray cast, increasing efficiency.
-            Spectrum absorbsion = bsdf.evaluate(out_dir, in_dir);
-            if (absorbsion.luma() == 0.0f) continue;
-
-            // TODO (PathTracer): Task 4
-            // Construct a shadow ray and compute whether the intersected surface is
-            // in shadow. Only accumulate light if not in shadow.
-            Ray shadow_ray(hit.position, sample.direction);
-            shadow_ray.time_bounds = Vec2(EPS_F, sample.distance/sample.direction.norm() - EPS_F);
-
-            Trace shadow_hit = scene.hit(shadow_ray);
-            if (shadow_hit.hit) continue;
-
-            // Tip: when making your ray, you will want to slightly offset it from the
-            // surface it starts on, lest it intersect at time=0. Similarly, you may want
-            // to limit the ray slightly before it would hit the light itself.
-
-            // Note: that along with the typical cos_theta, pdf factors, we divide by samples.
-            // This is because we're  doing another monte-carlo estimate of the lighting from
-            // area lights.
-            radiance_out += (cos_theta / (samples * sample.pdf)) * sample.radiance * absorbsion;
+    Vec3 to_local(Vec3 v) const { return Vec3(dot(v, tangent), dot(v, normal), dot(v, bitangent)); }
+    Vec3 to_world(Vec3 v) const { return v.x * tangent + v.y * normal + v.z * bitangent; }
 
-        }
-    };
-
-    // If the BSDF is discrete (i.e. uses dirac deltas/if statements), then we are never
-    // going to hit the exact right direction by sampling lights, so ignore them.
-    if (!bsdf.is_discrete()) {
-        for (const auto &light : lights)
-            sample_light(light);
-        if (env_light.has_value())
-            sample_light(env_light.value());
-    }
+    Vec3 tangent, normal, bitangent;
+};
+
+Spectrum Pathtracer::trace_ray(const Ray &camera_ray, Features *features) {
 
+    // Paths are traced iteratively: radiance collects the light found at each
+    // bounce, weighted by the throughput of the path segments leading to it.
+    Ray ray = camera_ray;
+    Spectrum radiance, throughput(1.0f);
 
-    // TODO (PathTracer): Task 5
-    // Compute an indirect lighting estimate using pathtracing with Monte Carlo.
+    // This path cannot bounce anymore.
+    while (ray.depth <= max_depth) {
+
+        // Trace ray into scene. If nothing is hit, sample the environment
+        // Rays are counted by kind for benchmarks
+        Trace hit = scene.hit(ray);
+        if (ray.depth) {
+            ray_counts.secondary++;
+        } else {
+            ray_counts.primary++;
+        }
+        if (!hit.hit) {
+            if (env_light.has_value()) {
+                radiance += throughput * env_light.value().sample_direction(ray.dir);
+            }
+            break;
+        }
 
-    // (1) Ray objects have a depth field; you should use this to avoid
-    // traveling down one path forever.
+        // If we're using a two-sided material, treat back-faces the same as front-faces
+        const BSDF &bsdf = materials[hit.material];
+        if (!bsdf.is_sided() && dot(hit.normal, ray.dir) > 0.0f) {
+            hit.normal = -hit.normal;
+        }
 
-    // (2) randomly select a new ray direction (it may be reflection or transmittence
-    // ray depending on surface type) using bsdf.sample()
+        // Record what the camera ray hit first for the denoiser
+        if (features) {
+            features->albedo = bsdf.albedo();
+            features->normal = hit.normal;
+            features->depth = (hit.position - ray.point).norm();
+            features = nullptr;
+        }
 
-    // (3) potentially terminate path (using Russian roulette). You can make this
-    // a function of the bsdf attenuation or track overall ray throughput
+        // Debugging: if the normal colors flag is set, return the normal color
+        if (debug_data.normal_colors) return Spectrum::direction(hit.normal);
+
+        // Set up a coordinate frame at the hit point, where the surface normal becomes {0, 1, 0}
+        // This gives us out_dir and later in_dir in object space, where computations involving
+        // the normal become much easier. For example, cos(theta) = dot(N,dir) = dir.y!
+        Shading_Frame frame(hit.normal);
+        Vec3 out_dir = frame.to_local(ray.point - hit.position).unit();
+
+        // Now we can compute the rendering equation at this point.
+        // We split it into two stages: sampling lighting (i.e. directly connecting
+        // the current path to each light in the scene), then sampling the BSDF
+        // to create a new path segment.
+        BSDF_Sample bsdf_sample = bsdf.sample(out_dir);
+        Spectrum radiance_out = bsdf_sample.emissive;
+
+        // Lights may be picked at random rather than all sampled; the chance of
+        // having picked this one is given as light_pmf.
+        auto sample_light = [&](const auto &light, float light_pmf) {
+            // If the light is discrete (e.g. a point light), then we only need
+            // one sample, as all samples will be equivalent
+            int samples = light.is_discrete() ? 1 : (int)n_area_samples;
+            for (int i = 0; i < samples; i++) {
+
+                Light_Sample sample = light.sample(hit.position);
+                Vec3 in_dir = frame.to_local(sample.direction);
+
+                // If the light is below the horizon, ignore it
+                float cos_theta = in_dir.y;
+                if (cos_theta <= 0.0f) continue;
+
+                // If the BSDF has 0 throughput in this direction, ignore it
+                Spectrum absorbsion = bsdf.evaluate(out_dir, in_dir);
+                if (absorbsion.luma() == 0.0f) continue;
+
+                // Construct a shadow ray, slightly offset from both the surface and
+                // the light, and only accumulate light if it is not in shadow.
+                Ray shadow_ray(hit.position, sample.direction);
+                shadow_ray.time_bounds =
+                    Vec2(EPS_F, sample.distance / sample.direction.norm() - EPS_F);
+
+                // Any hit blocks the light, so the closest one isn't needed
+                ray_counts.shadow++;
+                if (scene.occluded(shadow_ray)) continue;
+
+                // Note: that along with the typical cos_theta, pdf factors, we divide by
+                // samples. This is because we're doing another monte-carlo estimate of the
+                // lighting from area lights.
+                radiance_out += (cos_theta / (samples * sample.pdf * light_pmf)) *
+                                sample.radiance * absorbsion;
+            }
+        };
+
+        // If the BSDF is discrete (i.e. uses dirac deltas/if statements), then we are never
+        // going to hit the exact right direction by sampling lights, so ignore them.
+        // With many lights, sampling each of them would make every bounce cost as
+        // much as the number of lights, so instead we can pick a few, either in
+        // proportion to their power or to how much they matter at this point
+        // (using the light tree), and weight them by the chance of picking them.
+        if (!bsdf.is_discrete()) {
+            if (light_mode == Light_Sampling::all) {
+                for (const auto &light : lights)
+                    sample_light(light, 1.0f);
+            } else if (!lights.empty()) {
+                for (size_t i = 0; i < n_light_samples; i++) {
+                    float pmf;
+                    size_t l;
+                    if (light_mode == Light_Sampling::power) {
+                        l = light_select.sample(pmf);
+                    } else if (!light_tree.sample(hit.position, hit.normal, l, pmf)) {
+                        continue;
+                    }
+                    sample_light(lights[l], n_light_samples * pmf);
+                }
+            }
+            if (env_light.has_value())
+                sample_light(env_light.value(), 1.0f);
+        }
 
-    // (4) create new scene-space ray and cast it to get incoming light
+        radiance += throughput * radiance_out;
 
-    // (5) add contribution due to incoming light with proper weighting
+        // Continue the path in the sampled direction, carrying its weight in the throughput
+        if (bsdf_sample.pdf <= 0.0f) break;
+        throughput *= bsdf_sample.attenuation *
+                      (std::abs(bsdf_sample.direction.y) / bsdf_sample.pdf);
 
-    // if attenuation/reflection is low, more likely to terminate
-    // Terminate 50% of all contributions if Luma < 0.3
-    float pRR = 1.f;
-    if (bsdf_sample.attenuation.luma() < 0.3f) pRR = 0.5f;
-    if (RNG::unit() > pRR) return radiance_out;
-  
-    // Create bounced-ray
-    Ray bounced_ray(hit.position, object_to_world.rotate(bsdf_sample.direction));
-    bounced_ray.time_bounds.x = EPS_F;
-    bounced_ray.depth = ray.depth + 1;
+        // Russian roulette: once the path is long enough, terminate it with a probability
+        // that grows as its throughput falls, and re-weight the survivors to stay unbiased.
+        if (ray.depth + 1 >= rr_min_depth) {
+            float p_continue = std::min(throughput.luma(), 1.0f);
+            if (p_continue <= 0.0f || RNG::unit() > p_continue) break;
+            throughput *= 1.0f / p_continue;
+        }
 
-    Spectrum absorbsion = bsdf_sample.attenuation;
-    radiance_out += absorbsion * trace_ray(bounced_ray) * std::abs(bsdf_sample.direction.y) / (bsdf_sample.pdf * pRR);
+        // Create bounced-ray
+        Ray bounced_ray(hit.position, frame.to_world(bsdf_sample.direction));
+        bounced_ray.time_bounds.x = EPS_F;
+        bounced_ray.depth = ray.depth + 1;
+        ray = bounced_ray;
+    }
 
-    return radiance_out;
+    return radiance;
 }
 
 } // namespace PT
@@ -1,6 +1,7 @@
 
 #include "../rays/samplers.h"
 #include "../util/rand.h"
+#include "../util/thread_pool.h"
 #include "debug.h"
 
 namespace Samplers {
@@ -47,7 +48,7 @@ Vec3 Sphere::Uniform::sample(float &pdf) const {
     return dir;
 }
 
-Sphere::Image::Image(const HDR_Image &image) {
+Sphere::Image::Image(const HDR_Image &image, Thread_Pool *pool) {
 
     // TODO (PathTracer): Task 7
     // Set up importance sampling for a spherical environment map image.
@@ -58,45 +59,32 @@ Sphere::Image::Image(const HDR_Image &image) {
     const auto [_w, _h] = image.dimension();
     w = _w;
     h = _h;
-
-    // Conditional
-    for (size_t j = 0; j < h; j++) {
-        float sin_theta = sin(PI_F*(j + 0.5f)/h);
-
-        std::vector<float> cond_func; // func at row v
-        std::vector<float> cond_cdf; // cdf at row v
-
-        float funcInt = 0.f;
-        for (size_t i = 0; i < w; i++) {
-            // 0.5f at the pixel center. Else we never sample top and bottom rows
-            float Lsintheta = image.at(i, j).luma() * sin_theta;
-
-            cond_func.push_back(Lsintheta);
-            cond_cdf.push_back(funcInt); // cdf does NOT include itself ie. cdf[0] = 0
-            funcInt += Lsintheta/w; // cdf[i] = cdf[i - 1] + func[i - 1]/n;
+    conditional.resize(w * h);
+
+    // Each row is weighted by luma * sin(theta), at the pixel centers (else we
+    // would never sample the top and bottom rows). The rows don't depend on
+    // each other, so their tables are built in parallel.
+    std::vector<float> row_totals(h);
+    auto build_rows = [&](size_t begin, size_t end) {
+        std::vector<float> func(w);
+        for (size_t j = begin; j < end; j++) {
+            float sin_theta = std::sin(PI_F * (j + 0.5f) / h);
+            float total = 0.0f;
+            for (size_t i = 0; i < w; i++) {
+                func[i] = image.at(i, j).luma() * sin_theta;
+                total += func[i];
+            }
+            Alias::build(func.data(), w, conditional.data() + j * w);
+            row_totals[j] = total;
         }
-        cond_cdf.push_back(funcInt); // cdf has n + 1 elements
-
-        // actually normalize the cdf
-        for (size_t i = 0; i < w + 1; i++) {
-            cond_cdf[i] /= funcInt; // cdf[i]/funcInt
-        }
-
-        // save p[u|v] and cdf[u|v]
-        conditional_func.push_back(cond_func);
-        conditional_cdf.push_back(cond_cdf);
-
-        marginal_func.push_back(funcInt); // marginalFunc.push_back(pConditionalV[v]->funcInt);
-        marginal_cdf.push_back(marginal_I);
-        marginal_I += funcInt/h; // the funcInt (total) of all funcInts (totals)
-    }
-    marginal_cdf.push_back(marginal_I); // cdf has n + 1 elements
-    
-    // actually normalize the cdf
-    for (size_t j = 0; j < h + 1; j++) {
-        marginal_cdf[j] /= marginal_I;  // cdf[i]/funcInt
+    };
+    if (pool) {
+        pool->parallel_for(0, h, 16, build_rows);
+    } else {
+        build_rows(0, h);
     }
 
+    marginal = Alias(row_totals);
 }
 
 Vec3 Sphere::Image::sample(float &out_pdf) const {
@@ -105,34 +93,26 @@ Vec3 Sphere::Image::sample(float &out_pdf) const {
     // Use your importance sampling data structure to generate a sample direction.
     // Tip: std::upper_bound can easily binary search your CDF
 
-    float Xi = RNG::unit();
-    float Yi = RNG::unit();
-
-    // cdf[offset] <= u < cdf[offset+1] <- what upper_bound returns
-    auto y = --std::upper_bound(marginal_cdf.begin(), marginal_cdf.end(), Yi);
-    auto ind_y = std::distance(marginal_cdf.begin(), y); // offset
-    float dy = (Yi - *y) / (marginal_cdf[ind_y + 1] - *y); // (u - cdf[offset])/(cdf[offset + 1] - cdf[offset])
-    float pdf_y = marginal_func[ind_y]/marginal_I; // pdf = func[offset]/funcInt
-    float y_sample = (ind_y + dy)/h; // (offset + du) / count
-
-    // Repeat for p(u|v)
-    auto x = --std::upper_bound(conditional_cdf[ind_y].begin(), conditional_cdf[ind_y].end(), Xi);
-    auto ind_x = std::distance(conditional_cdf[ind_y].begin(), x);
-    float dx = (Xi - *x) / (conditional_cdf[ind_y][ind_x + 1] - *x);
-    float pdf_x = conditional_func[ind_y][ind_x]/marginal_func[ind_y];
-    float x_sample = (ind_x + dx)/w;
+    // Pick a row, then a pixel in it, and a uniform offset within the pixel
+    // from what is left of each random number
+    float pmf_y, pmf_x, dy, dx;
+    size_t ind_y = Alias::sample(marginal.bins.data(), h, RNG::unit(), pmf_y, dy);
+    size_t ind_x = Alias::sample(conditional.data() + ind_y * w, w, RNG::unit(), pmf_x, dx);
+    float y_sample = (ind_y + dy) / h;
+    float x_sample = (ind_x + dx) / w;
 
     // Get theta and phi
     float theta = y_sample * PI_F;
     float phi = x_sample * 2.f * PI_F;
 
-    // Transform from (u, v) to (theta, phi) in unit sphere
-    // using absolute value of the determinant of the Jacobian
-    out_pdf = pdf_x*pdf_y/(2*PI_F*std::sin(theta)*PI_F); 
+    // The pmfs become densities over [0,1]^2 by multiplying by the number of
+    // pixels, then move to the sphere by the determinant of the Jacobian
+    float sin_theta = std::sin(theta);
+    out_pdf = pmf_x * w * pmf_y * h / (2 * PI_F * PI_F * sin_theta);
 
-    float xs = std::sin(theta) * std::cos(phi);
+    float xs = sin_theta * std::cos(phi);
     float ys = std::cos(theta);
-    float zs = std::sin(theta) * std::sin(phi);
+    float zs = sin_theta * std::sin(phi);
 
     return Vec3(xs, ys, zs);
 }
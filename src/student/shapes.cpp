@@ -31,6 +31,7 @@ Trace Sphere::hit(const Ray &ray) const {
 
     // RAY DIRECTION MUST BE UNIT IF YOU USE 
     // THE SIMPLIFIED QUADRATIC FORMULA IN SLIDES (not used here)
+    COUNT_TRAVERSAL(primitive_tests, 1);
     Vec3 d = ray.dir;
     // Vec3 d = ray.dir.unit();
     Vec3 o = ray.point;
@@ -60,6 +61,7 @@ Trace Sphere::hit(const Ray &ray) const {
     Trace ret;
     ret.hit = hit; // was there an intersection?
     if (!hit) return ret;
+    COUNT_TRAVERSAL(hits, 1);
     ret.time = t; // at what time did the intersection occur?
     ray.time_bounds.y = t; // update time bounds for efficiency
     ret.position = ray.at(t); // where was the intersection?
@@ -67,4 +69,24 @@ Trace Sphere::hit(const Ray &ray) const {
     return ret;
 }
 
+bool Sphere::occluded(const Ray &ray) const {
+    COUNT_TRAVERSAL(primitive_tests, 1);
+
+    // Either intersection within the time bounds blocks the ray
+    Vec3 d = ray.dir;
+    Vec3 o = ray.point;
+    float od = dot(o, d);
+    float d2 = d.norm_squared();
+    float discriminant = od * od - d2 * (o.norm_squared() - radius * radius);
+    if (discriminant <= 0) return false;
+
+    float root_discriminant = std::sqrt(discriminant);
+    float t1 = (-od + root_discriminant) / d2;
+    float t2 = (-od - root_discriminant) / d2;
+    bool hit = (t2 <= ray.time_bounds.y && t2 >= ray.time_bounds.x) ||
+               (t1 <= ray.time_bounds.y && t1 >= ray.time_bounds.x);
+    if (hit) COUNT_TRAVERSAL(hits, 1);
+    return hit;
+}
+
 } // namespace PT
@@ -29,6 +29,7 @@ BBox Triangle::bbox() const {
 }
 
 Trace Triangle::hit(const Ray &ray) const {
+    COUNT_TRAVERSAL(primitive_tests, 1);
 
     // Vertices of triangle - has position and surface normal
     Tri_Mesh_Vert v_0 = vertex_list[v0];
@@ -56,6 +57,7 @@ Trace Triangle::hit(const Ray &ray) const {
     // was there an intersection?
     ret.hit = (u >= 0) && (v >= 0) && (1 - u - v >= 0) && (t <= ray.time_bounds.y) && (t >= ray.time_bounds.x);
     if (!ret.hit) return ret;
+    COUNT_TRAVERSAL(hits, 1);
     ret.time = t; // at what time did the intersection occur?
     ray.time_bounds.y = t; // update time bounds for efficiency
     ret.position = ray.at(t); // where was the intersection?
@@ -65,13 +67,40 @@ Trace Triangle::hit(const Ray &ray) const {
     return ret;
 }
 
+bool Triangle::occluded(const Ray &ray) const {
+    COUNT_TRAVERSAL(primitive_tests, 1);
+
+    // The same test as hit(), minus the shading data, and rejecting as
+    // soon as the barycentrics fall outside the triangle.
+    Vec3 p0 = vertex_list[v0].position;
+    Vec3 e1 = vertex_list[v1].position - p0;
+    Vec3 e2 = vertex_list[v2].position - p0;
+    Vec3 s = ray.point - p0;
+
+    Vec3 sXnd = cross(s, -ray.dir);
+    Vec3 e1Xe2 = cross(e1, e2);
+    float det = dot(e1Xe2, -ray.dir);
+    if (det == 0) return false;
+
+    float u = -dot(sXnd, e2) / det;
+    if (u < 0) return false;
+    float v = dot(sXnd, e1) / det;
+    if (v < 0 || 1 - u - v < 0) return false;
+    float t = dot(e1Xe2, s) / det;
+    if (t > ray.time_bounds.y || t < ray.time_bounds.x) return false;
+
+    COUNT_TRAVERSAL(hits, 1);
+    return true;
+}
+
 Triangle::Triangle(Tri_Mesh_Vert *verts, unsigned int v0, unsigned int v1, unsigned int v2)
     : vertex_list(verts), v0(v0), v1(v1), v2(v2) {}
 
-void Tri_Mesh::build(const GL::Mesh &mesh) {
+void Tri_Mesh::build(const GL::Mesh &mesh, BVH_Layout layout, Thread_Pool *pool) {
 
     verts.clear();
     triangles.clear();
+    indices = mesh.indices();
 
     for (const auto &v : mesh.verts()) {
         verts.push_back({v.pos, v.norm});
@@ -85,11 +114,20 @@ void Tri_Mesh::build(const GL::Mesh &mesh) {
         tris.push_back(Triangle(verts.data(), idxs[i], idxs[i + 1], idxs[i + 2]));
     }
 
-    triangles.build(std::move(tris), 4);
+    triangles.build(std::move(tris), 4, layout, pool);
 }
 
 Tri_Mesh::Tri_Mesh(const GL::Mesh &mesh) { build(mesh); }
 
+bool Tri_Mesh::matches(const GL::Mesh &mesh) const {
+    if (verts.size() != mesh.verts().size() || indices != mesh.indices()) return false;
+    for (size_t i = 0; i < verts.size(); i++) {
+        const GL::Mesh::Vert &v = mesh.verts()[i];
+        if (verts[i].position != v.pos || verts[i].normal != v.norm) return false;
+    }
+    return true;
+}
+
 BBox Tri_Mesh::bbox() const { return triangles.bbox(); }
 
 Trace Tri_Mesh::hit(const Ray &ray) const { 
@@ -97,6 +135,8 @@ Trace Tri_Mesh::hit(const Ray &ray) const {
     return t;
 }
 
+bool Tri_Mesh::occluded(const Ray &ray) const { return triangles.occluded(ray); }
+
 size_t Tri_Mesh::visualize(GL::Lines &lines, GL::Lines &active, size_t level,
                            const Mat4 &trans) const {
     return triangles.visualize(lines, active, level, trans);
@@ -0,0 +1,203 @@
+
+#include "exr.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+namespace EXR {
+
+// Tiles are square and at most this many pixels wide
+static const size_t tile_size = 64;
+// Each batch holds this many tiles per thread
+static const size_t batch_per_thread = 4;
+
+// Attribute and compression values from the OpenEXR file layout. Values are
+// written in the host's byte order, which is assumed to be little-endian.
+static const uint8_t rle_compression = 1;
+static const int32_t float_pixels = 2;
+
+struct Writer {
+
+    template <class T> void put(T value) {
+        const uint8_t *bytes = (const uint8_t *)&value;
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+    }
+    void put(const std::string &s) { data.insert(data.end(), s.begin(), s.end() + 1); }
+
+    // Attributes are a name, a type name, a size, and the value
+    template <class F> void attribute(const std::string &name, const std::string &type, F &&f) {
+        put(name);
+        put(type);
+        size_t size_at = data.size();
+        put(int32_t(0));
+        size_t start = data.size();
+        f();
+        int32_t size = (int32_t)(data.size() - start);
+        std::memcpy(&data[size_at], &size, sizeof(size));
+    }
+
+    std::vector<uint8_t> data;
+};
+
+// Compresses one tile: the raw bytes are split into even and odd halves
+// (so the high bytes of each value end up together), delta coded, and run
+// length encoded. Runs of at least three equal bytes become a count and the
+// byte; anything else is copied after a negative count. Tiles that don't
+// shrink are stored as they are.
+static void compress(std::vector<uint8_t> &raw, std::vector<uint8_t> &out) {
+
+    size_t n = raw.size();
+    std::vector<uint8_t> bytes(n);
+    size_t half = (n + 1) / 2;
+    for (size_t i = 0; i < n; i++) bytes[(i % 2 ? half : 0) + i / 2] = raw[i];
+    for (size_t i = n - 1; i > 0; i--) bytes[i] = (uint8_t)(bytes[i] - bytes[i - 1] + 128);
+
+    const size_t min_run = 3, max_run = 127;
+    out.clear();
+    out.reserve(n + n / max_run + 1);
+    size_t start = 0;
+    while (start < n) {
+        size_t end = start + 1;
+        while (end < n && bytes[end] == bytes[start] && end - start < max_run + 1) end++;
+        if (end - start >= min_run) {
+            out.push_back((uint8_t)(end - start - 1));
+            out.push_back(bytes[start]);
+        } else {
+            // Copy until the next run of three
+            while (end < n && end - start < max_run &&
+                   !(end + 2 < n && bytes[end] == bytes[end + 1] && bytes[end] == bytes[end + 2])) {
+                end++;
+            }
+            out.push_back((uint8_t)-(int8_t)(end - start));
+            out.insert(out.end(), bytes.begin() + start, bytes.begin() + end);
+        }
+        start = end;
+    }
+
+    if (out.size() >= n) out.swap(raw);
+}
+
+Channel channel(std::string name, const float *pixels, size_t w, size_t h, size_t stride,
+                size_t offset) {
+    return {std::move(name), [=](size_t x, size_t y, size_t n, float *out) {
+                const float *row = pixels + ((h - y - 1) * w + x) * stride + offset;
+                for (size_t i = 0; i < n; i++) out[i] = row[i * stride];
+            }};
+}
+
+std::string write(const std::string &file, size_t w, size_t h, std::vector<Channel> channels,
+                  Thread_Pool *pool) {
+
+    if (!w || !h || channels.empty()) return "Cannot write an empty EXR image!";
+
+    // Channels must be listed (and stored) in alphabetical order
+    std::sort(channels.begin(), channels.end(),
+              [](const Channel &l, const Channel &r) { return l.name < r.name; });
+    bool long_names = std::any_of(channels.begin(), channels.end(),
+                                  [](const Channel &c) { return c.name.size() > 31; });
+
+    Writer header;
+    header.put(uint32_t(20000630));
+    // Version 2, single-part tiled
+    header.put(uint32_t(2 | 0x200 | (long_names ? 0x400 : 0)));
+    header.attribute("channels", "chlist", [&]() {
+        for (const Channel &c : channels) {
+            header.put(c.name);
+            header.put(float_pixels);
+            header.put(uint32_t(0)); // linear flag and padding
+            header.put(int32_t(1));  // x and y sampling
+            header.put(int32_t(1));
+        }
+        header.put(uint8_t(0));
+    });
+    header.attribute("compression", "compression", [&]() { header.put(rle_compression); });
+    for (const char *window : {"dataWindow", "displayWindow"}) {
+        header.attribute(window, "box2i", [&]() {
+            header.put(int32_t(0));
+            header.put(int32_t(0));
+            header.put(int32_t(w - 1));
+            header.put(int32_t(h - 1));
+        });
+    }
+    header.attribute("lineOrder", "lineOrder", [&]() { header.put(uint8_t(0)); });
+    header.attribute("pixelAspectRatio", "float", [&]() { header.put(1.0f); });
+    header.attribute("screenWindowCenter", "v2f", [&]() {
+        header.put(0.0f);
+        header.put(0.0f);
+    });
+    header.attribute("screenWindowWidth", "float", [&]() { header.put(1.0f); });
+    header.attribute("tiles", "tiledesc", [&]() {
+        header.put(uint32_t(tile_size));
+        header.put(uint32_t(tile_size));
+        header.put(uint8_t(0)); // one level, rounding down
+    });
+    header.put(uint8_t(0));
+
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return "Failed to open EXR file " + file + "!";
+
+    // The offset of each tile is only known once the tiles before it are
+    // compressed, so the table is filled in at the end.
+    size_t tiles_x = (w + tile_size - 1) / tile_size;
+    size_t tiles_y = (h + tile_size - 1) / tile_size;
+    size_t n_tiles = tiles_x * tiles_y;
+    std::vector<uint64_t> offsets(n_tiles);
+    out.write((const char *)header.data.data(), header.data.size());
+    uint64_t table = header.data.size();
+    out.write((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+
+    size_t batch = (pool ? pool->size() : 1) * batch_per_thread;
+    std::vector<std::vector<uint8_t>> chunks(batch);
+
+    auto encode = [&](size_t t, std::vector<uint8_t> &chunk) {
+        size_t tx = t % tiles_x, ty = t / tiles_x;
+        size_t x0 = tx * tile_size, y0 = ty * tile_size;
+        size_t tw = std::min(tile_size, w - x0), th = std::min(tile_size, h - y0);
+
+        // Each row of the tile stores its pixels channel by channel
+        std::vector<uint8_t> raw(tw * th * channels.size() * sizeof(float)), packed;
+        float *pixels = (float *)raw.data();
+        for (size_t y = 0; y < th; y++) {
+            for (size_t c = 0; c < channels.size(); c++) {
+                channels[c].read(x0, y0 + y, tw, pixels + (y * channels.size() + c) * tw);
+            }
+        }
+        compress(raw, packed);
+
+        Writer tile;
+        tile.data.reserve(5 * sizeof(int32_t) + packed.size());
+        tile.put(int32_t(tx));
+        tile.put(int32_t(ty));
+        tile.put(int32_t(0)); // level
+        tile.put(int32_t(0));
+        tile.put(int32_t(packed.size()));
+        tile.data.insert(tile.data.end(), packed.begin(), packed.end());
+        chunk = std::move(tile.data);
+    };
+
+    for (size_t begin = 0; begin < n_tiles; begin += batch) {
+        size_t end = std::min(begin + batch, n_tiles);
+        auto encode_range = [&](size_t b, size_t e) {
+            for (size_t t = b; t < e; t++) encode(t, chunks[t - begin]);
+        };
+        if (pool) {
+            pool->parallel_for(begin, end, 1, encode_range);
+        } else {
+            encode_range(begin, end);
+        }
+        for (size_t t = begin; t < end; t++) {
+            offsets[t] = (uint64_t)out.tellp();
+            out.write((const char *)chunks[t - begin].data(), chunks[t - begin].size());
+        }
+    }
+
+    out.seekp((std::streamoff)table);
+    out.write((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+    if (!out) return "Failed to write EXR file " + file + "!";
+    return {};
+}
+
+} // namespace EXR
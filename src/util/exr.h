@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class Thread_Pool;
+
+namespace EXR {
+
+// One float channel of an image. Layers are written as channels named
+// "layer.X"; the main image uses plain "R", "G" and "B".
+struct Channel {
+    std::string name;
+    // Fills out[0, n) with pixels [x, x + n) of row y, counting rows from the top
+    std::function<void(size_t x, size_t y, size_t n, float *out)> read;
+};
+
+// A channel read from an image of w by h pixels of stride floats each, with
+// rows stored from the bottom up like HDR_Image, taking the float at offset
+// in each pixel, e.g. the green of a Spectrum with stride 3 and offset 1.
+Channel channel(std::string name, const float *pixels, size_t w, size_t h, size_t stride = 1,
+                size_t offset = 0);
+
+// Writes a tiled, RLE compressed EXR. Tiles are read and compressed in
+// batches on the pool (if given), and written in order as each batch is done,
+// so the whole file never has to be held in memory.
+std::string write(const std::string &file, size_t w, size_t h, std::vector<Channel> channels,
+                  Thread_Pool *pool = nullptr);
+
+} // namespace EXR
@@ -1,6 +1,7 @@
 
 #include "hdr_image.h"
 #include "../lib/log.h"
+#include "exr.h"
 
 #include <sf_libs/stb_image.h>
 #include <sf_libs/tinyexr.h>
@@ -32,6 +33,10 @@ void HDR_Image::resize(size_t _w, size_t _h) {
     dirty = true;
 }
 
+const Spectrum *HDR_Image::data() const {
+    return pixels.data();
+}
+
 void HDR_Image::clear(Spectrum color) {
     for (auto &s : pixels)
         s = color;
@@ -133,8 +138,25 @@ std::string HDR_Image::load_from(std::string file) {
     return {};
 }
 
+void HDR_Image::assign(size_t _w, size_t _h, std::vector<Spectrum> &&_pixels, std::string file) {
+    assert(_pixels.size() == _w * _h);
+    w = _w;
+    h = _h;
+    pixels = std::move(_pixels);
+    last_path = file;
+    dirty = true;
+}
+
 std::string HDR_Image::loaded_from() const { return last_path; }
 
+std::string HDR_Image::save_exr(std::string file) const {
+    static_assert(sizeof(Spectrum) == 3 * sizeof(float));
+    const float *data = (const float *)pixels.data();
+    return EXR::write(file, w, h,
+                      {EXR::channel("R", data, w, h, 3, 0), EXR::channel("G", data, w, h, 3, 1),
+                       EXR::channel("B", data, w, h, 3, 2)});
+}
+
 void HDR_Image::tonemap(float e) const {
 
     if (e <= 0.0f) {
@@ -23,13 +23,19 @@ public:
     Spectrum at(size_t x, size_t y) const;
     Spectrum &at(size_t i);
     Spectrum at(size_t i) const;
+    // Pixels are stored row by row from the bottom
+    const Spectrum *data() const;
 
     void clear(Spectrum color);
     void resize(size_t w, size_t h);
     std::pair<size_t, size_t> dimension() const;
 
     std::string load_from(std::string file);
+    // Takes w * h pixels, laid out as data() returns them, that were decoded
+    // from file elsewhere
+    void assign(size_t w, size_t h, std::vector<Spectrum> &&pixels, std::string file);
     std::string loaded_from() const;
+    std::string save_exr(std::string file) const;
 
     void tonemap_to(std::vector<unsigned char> &data, float exposure = 0.0f) const;
     const GL::Tex2D &get_texture(float exposure = 0.0f) const;
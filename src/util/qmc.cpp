@@ -0,0 +1,202 @@
+
+#include "qmc.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+namespace QMC {
+
+uint32_t hash(uint32_t seed, uint32_t v) {
+    // lowbias32 (Wellons) of the combined value
+    uint32_t x = seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Direction numbers of the first four Sobol dimensions, from Joe and Kuo's
+// new-joe-kuo-6.21201 table
+static const std::array<std::array<uint32_t, 32>, 4> &directions() {
+    static const std::array<std::array<uint32_t, 32>, 4> table = [] {
+        struct Poly {
+            uint32_t s, a;
+            uint32_t m[3];
+        };
+        const Poly polys[3] = {{1, 0, {1}}, {2, 1, {1, 3}}, {3, 1, {1, 3, 1}}};
+
+        std::array<std::array<uint32_t, 32>, 4> v = {};
+        for (uint32_t i = 0; i < 32; i++) v[0][i] = 1u << (31 - i);
+        for (size_t d = 1; d < 4; d++) {
+            const Poly &p = polys[d - 1];
+            for (uint32_t i = 0; i < 32; i++) {
+                if (i < p.s) {
+                    v[d][i] = p.m[i] << (31 - i);
+                    continue;
+                }
+                v[d][i] = v[d][i - p.s] ^ (v[d][i - p.s] >> p.s);
+                for (uint32_t k = 1; k < p.s; k++) {
+                    if ((p.a >> (p.s - 1 - k)) & 1) v[d][i] ^= v[d][i - k];
+                }
+            }
+        }
+        return v;
+    }();
+    return table;
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of the bits of x, from the most significant down, using the
+// Laine-Karras style hash with Burley's constants
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+void owen_sobol(uint32_t index, uint32_t group, uint32_t seed, float out[4]) {
+
+    uint32_t group_seed = hash(seed, group);
+
+    // Shuffling the index keeps the group a (scrambled) Sobol sequence, but
+    // decorrelates it from the other groups
+    index = nested_uniform_scramble(index, group_seed);
+
+    uint32_t x[4] = {};
+    const auto &v = directions();
+    for (uint32_t bit = 0; index; bit++, index >>= 1) {
+        if (index & 1) {
+            for (size_t d = 0; d < 4; d++) x[d] ^= v[d][bit];
+        }
+    }
+
+    // Only the top 24 bits fit in a float without rounding up to 1
+    for (uint32_t d = 0; d < 4; d++) {
+        out[d] = (nested_uniform_scramble(x[d], hash(group_seed, d)) >> 8) * 0x1p-24f;
+    }
+}
+
+static const uint32_t mask_size = 64;
+
+// Ranks of a blue noise dither mask, made with Ulichney's void-and-cluster
+// method ("The void-and-cluster method for dither array generation", 1993)
+static std::vector<uint32_t> void_and_cluster() {
+
+    const uint32_t n = mask_size * mask_size;
+    const float sigma = 1.5f;
+
+    // Gaussian energy filter over toroidal offsets
+    std::vector<float> filter(n);
+    for (uint32_t y = 0; y < mask_size; y++) {
+        for (uint32_t x = 0; x < mask_size; x++) {
+            float dx = (float)std::min(x, mask_size - x);
+            float dy = (float)std::min(y, mask_size - y);
+            filter[y * mask_size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    std::vector<bool> on(n, false);
+    std::vector<float> energy(n, 0.0f);
+    auto splat = [&](uint32_t p, float sign) {
+        uint32_t px = p % mask_size, py = p / mask_size;
+        for (uint32_t y = 0; y < mask_size; y++) {
+            for (uint32_t x = 0; x < mask_size; x++) {
+                uint32_t fx = (x - px) & (mask_size - 1), fy = (y - py) & (mask_size - 1);
+                energy[y * mask_size + x] += sign * filter[fy * mask_size + fx];
+            }
+        }
+    };
+    auto set = [&](uint32_t p, bool value) {
+        on[p] = value;
+        splat(p, value ? 1.0f : -1.0f);
+    };
+    // Tightest cluster is the set pixel with the most energy, and the
+    // largest void the empty pixel with the least
+    auto tightest_cluster = [&]() {
+        uint32_t best = 0;
+        float best_e = -1.0f;
+        for (uint32_t p = 0; p < n; p++) {
+            if (on[p] && energy[p] > best_e) {
+                best = p;
+                best_e = energy[p];
+            }
+        }
+        return best;
+    };
+    auto largest_void = [&]() {
+        uint32_t best = 0;
+        float best_e = INFINITY;
+        for (uint32_t p = 0; p < n; p++) {
+            if (!on[p] && energy[p] < best_e) {
+                best = p;
+                best_e = energy[p];
+            }
+        }
+        return best;
+    };
+
+    // Start from a fixed random tenth of the pixels, then move the tightest
+    // cluster into the largest void until that no longer changes anything
+    uint32_t n_initial = n / 10;
+    for (uint32_t i = 0, placed = 0; placed < n_initial; i++) {
+        uint32_t p = hash(0x5eedu, i) % n;
+        if (on[p]) continue;
+        set(p, true);
+        placed++;
+    }
+    for (;;) {
+        uint32_t cluster = tightest_cluster();
+        set(cluster, false);
+        uint32_t gap = largest_void();
+        set(gap, true);
+        if (gap == cluster) break;
+    }
+    std::vector<bool> prototype = on;
+    std::vector<float> prototype_energy = energy;
+
+    // Ranks below the prototype's come from removing its tightest clusters,
+    // and the rest from filling the largest voids
+    std::vector<uint32_t> rank(n);
+    for (uint32_t r = n_initial; r > 0; r--) {
+        uint32_t cluster = tightest_cluster();
+        set(cluster, false);
+        rank[cluster] = r - 1;
+    }
+    on = prototype;
+    energy = prototype_energy;
+    for (uint32_t r = n_initial; r < n; r++) {
+        uint32_t gap = largest_void();
+        set(gap, true);
+        rank[gap] = r;
+    }
+    return rank;
+}
+
+float blue_noise(uint32_t x, uint32_t y, uint32_t dim) {
+
+    static const std::vector<uint32_t> rank = void_and_cluster();
+
+    // Offsets follow the R2 sequence, so consecutive dimensions are far apart
+    uint32_t ox = (uint32_t)(dim * 0.7548776662f * mask_size);
+    uint32_t oy = (uint32_t)(dim * 0.5698402910f * mask_size);
+    x = (x + ox) % mask_size;
+    y = (y + oy) % mask_size;
+    return (rank[y * mask_size + x] + 0.5f) / (mask_size * mask_size);
+}
+
+} // namespace QMC
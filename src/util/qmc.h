@@ -0,0 +1,24 @@
+
+#pragma once
+
+#include <cstdint>
+
+// Low-discrepancy sequences for quasi-Monte Carlo sampling
+namespace QMC {
+
+// Dimensions 4 * group to 4 * group + 3 of point index of an Owen-scrambled
+// Sobol sequence, using Burley's hash-based scrambling ("Practical Hash-based
+// Owen Scrambling", JCGT 2020). Each group of four dimensions is a 4D Sobol
+// sequence whose points are shuffled independently of the other groups, so
+// any number of dimensions can be drawn. Different seeds give independent
+// scramblings.
+void owen_sobol(uint32_t index, uint32_t group, uint32_t seed, float out[4]);
+
+// Value in [0,1) of a tiling 64x64 blue noise mask at pixel (x, y). Each
+// dimension uses the mask at a different offset.
+float blue_noise(uint32_t x, uint32_t y, uint32_t dim);
+
+// Mixes v into a hash value
+uint32_t hash(uint32_t seed, uint32_t v);
+
+} // namespace QMC
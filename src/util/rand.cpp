@@ -1,6 +1,6 @@
-
 #include "rand.h"
 #include "../lib/mathlib.h"
+#include "qmc.h"
 
 #include <ctime>
 #include <random>
@@ -8,24 +8,121 @@
 
 namespace RNG {
 
-static thread_local std::mt19937 rng;
+const char *Sequence_Names[(int)Sequence::count] = {"Random", "Sobol", "Blue Noise Sobol"};
+
+// SplitMix64 finalizer, used to turn counters into well mixed seeds
+static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically
+// Good Algorithms for Random Number Generation", 2014): 16 bytes of state, and
+// a cheap reseed, so every pixel sample can start its own stream.
+struct PCG32 {
+
+    void seed(uint64_t init_state, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += init_state;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // Only the top 24 bits fit in a float without rounding up to 1
+    float unit() { return (next() >> 8) * 0x1p-24f; }
+
+    uint64_t state = 0x853c49e6748fea9bull, inc = 0xda3e39cb94b95bdbull;
+};
+
+// Used outside of pixel samples
+static thread_local PCG32 rng;
+
+// The pixel sample being traced on this thread, if any
+struct Sample_State {
+    bool active = false;
+    Sequence sequence = Sequence::random;
+    uint32_t x = 0, y = 0, index = 0, dim = 0;
+    uint32_t seed = 0;
+    // Sequence values are made four dimensions at a time
+    float group[4] = {};
+    PCG32 rng;
+};
+
+static thread_local Sample_State sample;
+
+static float next_dimension() {
+    if (sample.dim % 4 == 0) {
+        QMC::owen_sobol(sample.index, sample.dim / 4, sample.seed, sample.group);
+    }
+    return sample.group[sample.dim++ % 4];
+}
+
+float independent_unit() { return rng.unit(); }
 
 float unit() {
-    std::uniform_real_distribution<float> d(0.0f, 1.0f);
-    return d(rng);
+    if (!sample.active) return rng.unit();
+    switch (sample.sequence) {
+    case Sequence::sobol: return next_dimension();
+    case Sequence::blue_noise: {
+        // The mask is offset by the dimension before next_dimension moves on
+        float shift = QMC::blue_noise(sample.x, sample.y, sample.dim);
+        float u = shift + next_dimension();
+        return u < 1.0f ? u : u - 1.0f;
+    }
+    default: return sample.rng.unit();
+    }
 }
 
+void begin_sample(Sequence sequence, uint32_t frame, uint32_t x, uint32_t y, uint32_t index) {
+
+    sample.active = true;
+    sample.sequence = sequence;
+    sample.x = x;
+    sample.y = y;
+    sample.index = index;
+    sample.dim = 0;
+
+    // Everything drawn during the sample depends only on these counters, so
+    // the image does not depend on which thread traced which sample.
+    uint64_t pixel = ((uint64_t)y << 32) | x;
+    switch (sequence) {
+    case Sequence::sobol: {
+        sample.seed = QMC::hash(QMC::hash(QMC::hash(0, frame), x), y);
+    } break;
+    case Sequence::blue_noise: {
+        // Every pixel shares the sequence, and the mask moves with the frame
+        sample.seed = QMC::hash(0, frame);
+        sample.x = x + frame * 37;
+        sample.y = y + frame * 23;
+    } break;
+    default: {
+        sample.rng.seed(mix64(((uint64_t)frame << 32) | index), mix64(pixel));
+    } break;
+    }
+}
+
+void end_sample() { sample.active = false; }
+
 int integer(int min, int max) { return (int)lerp((float)min, (float)max, unit()); }
 
 bool coin_flip(float p) { return unit() < p; }
 
 void seed() {
     std::random_device r;
-    std::random_device::result_type seed =
-        r() ^
-        (std::random_device::result_type)std::hash<std::thread::id>()(std::this_thread::get_id()) ^
-        (std::random_device::result_type)std::hash<time_t>()(std::time(nullptr));
-    rng.seed(seed);
+    uint64_t seed =
+        ((uint64_t)r() << 32) ^ r() ^ std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+        std::hash<time_t>()(std::time(nullptr));
+    rng.seed(mix64(seed), (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id()));
 }
 
 } // namespace RNG
@@ -1,6 +1,7 @@
-
 #pragma once
 
+#include <cstdint>
+
 namespace RNG {
 
 // Generate random float in the range [0,1]
@@ -12,6 +13,27 @@ int integer(int min, int max);
 // Return true with probability p and false with probability 1-p
 bool coin_flip(float p = 0.5f);
 
-// Seed the current thread's PRNG
+// Seed the current thread's PRNG, which is used outside of pixel samples
 void seed();
+
+// Where unit() takes its numbers from while tracing a pixel sample:
+// - random: independent random numbers
+// - sobol: an Owen-scrambled Sobol sequence, scrambled differently per pixel
+// - blue_noise: one scrambled Sobol sequence for every pixel, shifted by a
+//   blue noise mask, so that neighboring pixels' errors differ as much as
+//   possible and the remaining noise is less visible
+enum class Sequence : int { random, sobol, blue_noise, count };
+extern const char *Sequence_Names[(int)Sequence::count];
+
+// Until end_sample, unit() on this thread returns successive dimensions of the
+// given sample of pixel (x, y) in an animation frame. Every number drawn takes
+// up a dimension. The numbers depend only on these arguments, so renders are
+// reproducible no matter how their samples are spread over threads.
+void begin_sample(Sequence sequence, uint32_t frame, uint32_t x, uint32_t y, uint32_t index);
+void end_sample();
+
+// Generate random float in the range [0,1], never taken from the current
+// pixel sample, for choices that should not use up one of its dimensions
+float independent_unit();
+
 } // namespace RNG
@@ -2,68 +2,361 @@
 #include "thread_pool.h"
 #include "../util/rand.h"
 
+#include <chrono>
+#include <ctime>
+
+// Chase-Lev work-stealing deque ("Correct and Efficient Work-Stealing for
+// Weak Memory Models", Le et al. 2013). Only the owning worker may push and
+// pop at the bottom; any thread may steal from the top.
+class Thread_Pool::Deque {
+public:
+    Deque() { array = new Array(64); }
+    ~Deque() {
+        delete array.load();
+        for (Array *a : retired) delete a;
+    }
+
+    void push(Task *task) {
+        long long b = bottom.load(std::memory_order_relaxed);
+        long long t = top.load(std::memory_order_acquire);
+        Array *a = array.load(std::memory_order_relaxed);
+        if (b - t > (long long)a->size - 1) {
+            a = grow(a, t, b);
+        }
+        a->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    Task *pop() {
+        long long b = bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = top.load(std::memory_order_relaxed);
+
+        Task *task = nullptr;
+        if (t <= b) {
+            task = a->get(b);
+            if (t == b) {
+                // Last task: race against thieves for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                 std::memory_order_relaxed))
+                    task = nullptr;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+    Task *steal() {
+        long long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = bottom.load(std::memory_order_acquire);
+
+        if (t >= b) return nullptr;
+
+        Array *a = array.load(std::memory_order_acquire);
+        Task *task = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+
+private:
+    struct Array {
+        Array(size_t size) : size(size), mask(size - 1), data(new std::atomic<Task *>[size]) {}
+
+        Task *get(long long i) const { return data[i & mask].load(std::memory_order_relaxed); }
+        void put(long long i, Task *task) { data[i & mask].store(task, std::memory_order_relaxed); }
+
+        size_t size, mask;
+        std::unique_ptr<std::atomic<Task *>[]> data;
+    };
+
+    Array *grow(Array *a, long long t, long long b) {
+        Array *next = new Array(a->size * 2);
+        for (long long i = t; i < b; i++) next->put(i, a->get(i));
+        // Thieves may still be reading the old array, so it is kept alive
+        // until the deque is destroyed.
+        retired.push_back(a);
+        array.store(next, std::memory_order_release);
+        return next;
+    }
+
+    std::atomic<long long> top = 0, bottom = 0;
+    std::atomic<Array *> array;
+    std::vector<Array *> retired;
+};
+
+// Counts a finished task off pending. The last one is only taken off while
+// holding the done mutex, and notifies under it, so a waiter that sees zero
+// (and may then destroy the pool or group) can't do so before the notify is
+// over. Tasks that aren't the last skip the lock.
+static void finish_pending(std::atomic<size_t> &pending, std::mutex &done_mutex,
+                           std::condition_variable &done_cond) {
+    size_t n = pending.load();
+    for (;;) {
+        if (n > 1) {
+            if (pending.compare_exchange_weak(n, n - 1)) return;
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(done_mutex);
+        if (pending.compare_exchange_strong(n, n - 1)) {
+            done_cond.notify_all();
+            return;
+        }
+    }
+}
+
+// The innermost Work_Timer::Scope open on the current thread
+static thread_local Work_Timer::Scope *this_scope = nullptr;
+
+// Time descheduled threads spend waiting for a core isn't counted where the
+// platform gives the calling thread's CPU time
+static uint64_t thread_nanoseconds() {
+#ifdef _WIN32
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+#else
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+Work_Timer::Scope::Scope(Work_Timer *timer) : timer(timer), outer(this_scope) {
+    if (timer || outer) {
+        start = thread_nanoseconds();
+        if (outer) outer->stop(start);
+    }
+    this_scope = this;
+}
+
+Work_Timer::Scope::~Scope() {
+    if (timer || outer) {
+        uint64_t now = thread_nanoseconds();
+        stop(now);
+        if (outer) outer->start = now;
+    }
+    this_scope = outer;
+}
+
+void Work_Timer::Scope::stop(uint64_t now) {
+    if (timer) timer->nanoseconds.fetch_add(now - start, std::memory_order_relaxed);
+}
+
+Work_Timer *Work_Timer::current() { return this_scope ? this_scope->timer : nullptr; }
+
+// The worker (if any) that is running on the current thread
+static thread_local Thread_Pool *this_pool = nullptr;
+static thread_local size_t this_worker = 0;
+
+// Each thread keeps a few finished tasks around to avoid reallocating them
+struct Task_Cache {
+    ~Task_Cache() {
+        for (Task *task : free) delete task;
+    }
+    std::vector<Task *> free;
+};
+static thread_local Task_Cache task_cache;
+
+Task *Thread_Pool::alloc_task() {
+    if (task_cache.free.empty()) return new Task();
+    Task *task = task_cache.free.back();
+    task_cache.free.pop_back();
+    return task;
+}
+
+void Thread_Pool::free_task(Task *task) {
+    task->reset();
+    if (task_cache.free.size() < 256) {
+        task_cache.free.push_back(task);
+    } else {
+        delete task;
+    }
+}
+
 Thread_Pool::Thread_Pool(size_t threads) { start(threads); }
 
 Thread_Pool::~Thread_Pool() { stop(); }
 
 void Thread_Pool::start(size_t threads) {
-    n_threads = threads;
+    n_threads = std::max(threads, size_t(1));
     stop_now = false;
-    stop_when_done = false;
-    for (size_t i = 0; i < threads; i++)
-        workers.emplace_back([this] {
+    for (size_t i = 0; i < n_threads; i++) deques.push_back(std::make_unique<Deque>());
+    for (size_t i = 0; i < n_threads; i++)
+        workers.emplace_back([this, i] {
             RNG::seed();
+            this_pool = this;
+            this_worker = i;
             for (;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop_now || this->stop_when_done || !this->tasks.empty();
-                    });
-                    if (this->stop_now || (this->stop_when_done && this->tasks.empty()))
-                        return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
+                if (Task *task = find_task(i)) {
+                    execute(task);
+                    continue;
                 }
-                task();
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                sleeping++;
+                sleep_cond.wait(lock, [this] { return stop_now || queued.load() > 0; });
+                sleeping--;
+                if (stop_now) return;
             }
         });
 }
 
+void Thread_Pool::push(Task *task) {
+
+    // Counted before the task becomes visible, so that it can never be taken
+    // (and the counters decremented) before they were incremented
+    pending++;
+    queued++;
+    if (this_pool == this) {
+        deques[this_worker]->push(task);
+    } else {
+        std::lock_guard<std::mutex> lock(inject_mutex);
+        injected.push_back(task);
+    }
+
+    if (sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        sleep_cond.notify_one();
+    }
+}
+
+Task *Thread_Pool::find_task(size_t self) {
+
+    Task *task = nullptr;
+    if (self < n_threads) task = deques[self]->pop();
+
+    if (!task) {
+        std::lock_guard<std::mutex> lock(inject_mutex);
+        if (!injected.empty()) {
+            task = injected.front();
+            injected.pop_front();
+        }
+    }
+
+    if (!task) {
+        // Start from a random victim so thieves don't all pile onto one deque
+        static thread_local unsigned int state = 0x9e3779b9u ^ (unsigned int)self;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        size_t start = state % n_threads;
+        for (size_t i = 0; i < n_threads && !task; i++) {
+            size_t victim = (start + i) % n_threads;
+            if (victim != self) task = deques[victim]->steal();
+        }
+    }
+
+    if (task) queued--;
+    return task;
+}
+
+void Thread_Pool::execute(Task *task) {
+    (*task)();
+    free_task(task);
+    finish_pending(pending, done_mutex, done_cond);
+}
+
+bool Thread_Pool::run_one() {
+    // Other threads don't help out, as they could pick up an arbitrarily
+    // long task while the caller only wanted to wait for its own work.
+    if (this_pool != this) return false;
+    Task *task = find_task(this_worker);
+    if (!task) return false;
+    execute(task);
+    return true;
+}
+
+bool Thread_Pool::in_worker() const { return this_pool == this; }
+
 void Thread_Pool::clear() {
-    stop();
-    start(n_threads);
+    discard();
+    wait();
 }
 
 void Thread_Pool::wait() {
 
+    // A worker waiting on the whole pool would be waiting on itself
+    assert(this_pool != this);
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cond.wait(lock, [this] { return pending.load() == 0; });
+}
+
+void Thread_Pool::discard() {
+
+    // Queued tasks are destroyed without running, which breaks their promises
+    std::vector<Task *> dropped;
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop_when_done = true;
+        std::lock_guard<std::mutex> lock(inject_mutex);
+        dropped.insert(dropped.end(), injected.begin(), injected.end());
+        injected.clear();
     }
-
-    condition.notify_all();
-    for (std::thread &worker : workers) {
-        worker.join();
+    for (auto &deque : deques) {
+        while (!deque->empty()) {
+            if (Task *task = deque->steal()) dropped.push_back(task);
+        }
     }
-    workers.clear();
 
-    start(n_threads);
+    for (Task *task : dropped) {
+        queued--;
+        free_task(task);
+        finish_pending(pending, done_mutex, done_cond);
+    }
 }
 
 void Thread_Pool::stop() {
 
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(sleep_mutex);
         stop_now = true;
     }
 
-    condition.notify_all();
+    sleep_cond.notify_all();
     for (std::thread &worker : workers) {
         worker.join();
     }
     workers.clear();
 
-    std::queue<std::function<void()>> empty;
-    std::swap(tasks, empty);
+    discard();
+    deques.clear();
+}
+
+Task_Group::~Task_Group() {
+    cancel();
+    wait();
+}
+
+void Task_Group::finish() { finish_pending(pending, done_mutex, done_cond); }
+
+void Task_Group::wait() {
+
+    Work_Timer::Scope waiting(nullptr);
+    if (pool.in_worker()) {
+        while (pending.load() > 0) {
+            if (!pool.run_one()) std::this_thread::yield();
+        }
+        // The last task may still be notifying; it holds the mutex until done
+        std::lock_guard<std::mutex> lock(done_mutex);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cond.wait(lock, [this] { return pending.load() == 0; });
+}
+
+void Task_Group::cancel() { cancel_now = true; }
+
+void Task_Group::reset() {
+    assert(pending.load() == 0);
+    cancel_now = false;
 }
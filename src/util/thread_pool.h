@@ -1,15 +1,95 @@
-
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <deque>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "../lib/log.h"
 
+// Type-erased, move-only callable. Callables that fit in the inline buffer
+// are constructed in place, so most tasks need no allocation of their own.
+class Task {
+public:
+    Task() = default;
+    Task(const Task &src) = delete;
+    Task &operator=(const Task &src) = delete;
+    ~Task() { reset(); }
+
+    template <class F> void set(F &&f) {
+        using Fn = std::decay_t<F>;
+        reset();
+        if constexpr (sizeof(Fn) <= inline_size && alignof(Fn) <= alignof(std::max_align_t)) {
+            new (storage) Fn(std::forward<F>(f));
+            call = [](void *s) { (*static_cast<Fn *>(s))(); };
+            destroy = [](void *s) { static_cast<Fn *>(s)->~Fn(); };
+        } else {
+            *reinterpret_cast<Fn **>(storage) = new Fn(std::forward<F>(f));
+            call = [](void *s) { (**static_cast<Fn **>(s))(); };
+            destroy = [](void *s) { delete *static_cast<Fn **>(s); };
+        }
+    }
+
+    void operator()() { call(storage); }
+
+    void reset() {
+        if (destroy) destroy(storage);
+        call = nullptr;
+        destroy = nullptr;
+    }
+
+private:
+    static const size_t inline_size = 48;
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    void (*call)(void *) = nullptr;
+    void (*destroy)(void *) = nullptr;
+};
+
+// Time spent on one piece of work, such as building one BVH, summed over all
+// threads that work on it. A thread counts the CPU time it spends in one of
+// the timer's Scopes (wall time on Windows). Scopes nest: an inner Scope pauses the outer one,
+// and a Scope without a timer counts towards nothing. The pool's waits open
+// such a Scope, so neither waiting nor other tasks run while waiting count.
+class Work_Timer {
+public:
+    class Scope {
+    public:
+        Scope(Work_Timer *timer);
+        ~Scope();
+
+        Scope(const Scope &src) = delete;
+        Scope &operator=(const Scope &src) = delete;
+
+    private:
+        void stop(uint64_t now);
+
+        Work_Timer *timer;
+        Scope *outer;
+        uint64_t start = 0;
+
+        friend class Work_Timer;
+    };
+
+    // The timer the calling thread is currently counting towards, if any
+    static Work_Timer *current();
+    double seconds() const { return nanoseconds.load() * 1e-9; }
+
+private:
+    std::atomic<uint64_t> nanoseconds = 0;
+};
+
+// Work-stealing thread pool. Each worker owns a Chase-Lev deque: tasks
+// enqueued from a worker go to the bottom of its own deque, and idle workers
+// steal from the top of a random victim's deque. Tasks enqueued from other
+// threads go through a shared injection queue.
 class Thread_Pool {
 public:
     Thread_Pool(size_t threads);
@@ -19,32 +99,137 @@ public:
     void wait();
     void clear();
 
+    size_t size() const { return n_threads; }
+
     template <class F, class... Args>
     auto enqueue(F &&f, Args &&...args)
         -> std::future<typename std::invoke_result<F, Args...>::type> {
 
         using return_type = typename std::invoke_result<F, Args...>::type;
-        assert(!stop_now && !stop_when_done);
 
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
+        std::packaged_task<return_type()> task(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace([task]() { (*task)(); });
-        }
-        condition.notify_one();
+        std::future<return_type> res = task.get_future();
+        run(std::move(task));
         return res;
     }
 
+    // Enqueue a task without creating a future for its result
+    template <class F> void run(F &&f) {
+        assert(!stop_now);
+        Task *task = alloc_task();
+        task->set(std::forward<F>(f));
+        push(task);
+    }
+
+    // Call fn(b, e) over [begin, end) split into chunks of at most grain
+    // elements. The calling thread works on chunks too and returns once all
+    // of them are done, so this may be used from inside a pool task.
+    template <class F> void parallel_for(size_t begin, size_t end, size_t grain, F &&fn) {
+
+        if (begin >= end) return;
+        grain = std::max(grain, size_t(1));
+
+        struct State {
+            std::atomic<size_t> next, done;
+            size_t begin, end, grain, chunks;
+            std::remove_reference_t<F> *fn;
+        };
+        auto state = std::make_shared<State>();
+        state->next = 0;
+        state->done = 0;
+        state->begin = begin;
+        state->end = end;
+        state->grain = grain;
+        state->chunks = (end - begin + grain - 1) / grain;
+        state->fn = &fn;
+
+        // The state is shared with the helpers since they may only get to run
+        // after every chunk has already been taken, and fn has gone out of scope
+        auto work = [](State &s) {
+            for (size_t c = s.next++; c < s.chunks; c = s.next++) {
+                size_t b = s.begin + c * s.grain;
+                (*s.fn)(b, std::min(b + s.grain, s.end));
+                s.done++;
+            }
+        };
+
+        size_t helpers = std::min(n_threads, state->chunks - 1);
+        for (size_t i = 0; i < helpers; i++) {
+            run([state, work]() { work(*state); });
+        }
+
+        work(*state);
+        Work_Timer::Scope waiting(nullptr);
+        while (state->done.load() < state->chunks) {
+            if (!run_one()) std::this_thread::yield();
+        }
+    }
+
+    // If called from one of this pool's workers, run one queued task
+    bool run_one();
+    // Whether the calling thread is one of this pool's workers
+    bool in_worker() const;
+
 private:
+    class Deque;
+
+    static Task *alloc_task();
+    static void free_task(Task *task);
+
     void start(size_t);
+    void push(Task *task);
+    Task *find_task(size_t self);
+    void execute(Task *task);
+    void discard();
+
     size_t n_threads;
-    bool stop_now = true;
-    bool stop_when_done = true;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
+    std::atomic<bool> stop_now = true;
+    std::atomic<size_t> queued = 0, pending = 0, sleeping = 0;
+
+    std::mutex sleep_mutex, done_mutex, inject_mutex;
+    std::condition_variable sleep_cond, done_cond;
+
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    std::vector<std::unique_ptr<Deque>> deques;
+    std::deque<Task *> injected;
+};
+
+// A set of tasks on a Thread_Pool that can be waited on and cancelled as a
+// unit, without affecting the pool's other work. Cancelling sets a token that
+// long-running tasks should poll through cancelled(); tasks that have not
+// started yet are skipped. Waiting from inside a pool task runs other queued
+// tasks in the meantime.
+class Task_Group {
+public:
+    Task_Group(Thread_Pool &pool) : pool(pool) {}
+    ~Task_Group();
+
+    Task_Group(const Task_Group &src) = delete;
+    Task_Group &operator=(const Task_Group &src) = delete;
+
+    template <class F> void run(F &&f) {
+        pending++;
+        pool.run([this, f = std::forward<F>(f)]() mutable {
+            if (!cancelled()) f();
+            finish();
+        });
+    }
+
+    void wait();
+    void cancel();
+    void reset();
+
+    bool cancelled() const { return cancel_now.load(std::memory_order_relaxed); }
+    bool done() const { return pending.load() == 0; }
+
+private:
+    void finish();
+
+    Thread_Pool &pool;
+    std::atomic<size_t> pending = 0;
+    std::atomic<bool> cancel_now = false;
+    std::mutex done_mutex;
+    std::condition_variable done_cond;
 };